@@ -0,0 +1,273 @@
+#include "ColorConverter.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLOR_CONVERTER_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+// MSVC compiles the intrinsics of every instruction set without flags
+#define TARGET_SSE2
+#define TARGET_AVX2
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// BT.601 limited range in 8 bit fixed point, the same rounding as swscale
+static inline uint8_t toY(int r, int g, int b) {
+	return (uint8_t) (((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+}
+
+static inline uint8_t toU(int r, int g, int b) {
+	return (uint8_t) (((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+}
+
+static inline uint8_t toV(int r, int g, int b) {
+	return (uint8_t) (((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+}
+
+static void convertRowsScalar(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width, bool bgra) {
+	int red = bgra ? 2 : 0;
+	int blue = bgra ? 0 : 2;
+	for (int i = 0; i < width; i += 2) {
+		const uint8_t* p00 = row0 + i * 4;
+		const uint8_t* p01 = p00 + 4;
+		const uint8_t* p10 = row1 + i * 4;
+		const uint8_t* p11 = p10 + 4;
+
+		y0[i] = toY(p00[red], p00[1], p00[blue]);
+		y0[i + 1] = toY(p01[red], p01[1], p01[blue]);
+		y1[i] = toY(p10[red], p10[1], p10[blue]);
+		y1[i + 1] = toY(p11[red], p11[1], p11[blue]);
+
+		int r = (p00[red] + p01[red] + p10[red] + p11[red] + 2) >> 2;
+		int g = (p00[1] + p01[1] + p10[1] + p11[1] + 2) >> 2;
+		int b = (p00[blue] + p01[blue] + p10[blue] + p11[blue] + 2) >> 2;
+		u[i / 2] = toU(r, g, b);
+		v[i / 2] = toV(r, g, b);
+	}
+}
+
+#ifdef COLOR_CONVERTER_X86
+
+// The kernels work on 16 bit lanes: Y sums up to 56228 (exact as unsigned), U and V stay within +-28688 (signed)
+
+// 8 pixels -> 8 x 16 bit per channel
+TARGET_SSE2 static inline void loadChannelsSSE2(const uint8_t* pixels, __m128i& r, __m128i& g, __m128i& b, bool bgra) {
+	__m128i mask = _mm_set1_epi32(0xFF);
+	__m128i low = _mm_loadu_si128((const __m128i*) pixels);
+	__m128i high = _mm_loadu_si128((const __m128i*) (pixels + 16));
+	__m128i first = _mm_packs_epi32(_mm_and_si128(low, mask), _mm_and_si128(high, mask));
+	g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 8), mask), _mm_and_si128(_mm_srli_epi32(high, 8), mask));
+	__m128i third = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(low, 16), mask), _mm_and_si128(_mm_srli_epi32(high, 16), mask));
+	r = bgra ? third : first;
+	b = bgra ? first : third;
+}
+
+TARGET_SSE2 static inline __m128i computeYSSE2(__m128i r, __m128i g, __m128i b) {
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(66)), _mm_mullo_epi16(g, _mm_set1_epi16(129))),
+		_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(25)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(16));
+}
+
+TARGET_SSE2 static inline __m128i computeChromaSSE2(__m128i r, __m128i g, __m128i b, short redFactor, short greenFactor, short blueFactor) {
+	__m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(redFactor)), _mm_mullo_epi16(g, _mm_set1_epi16(greenFactor))),
+		_mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(blueFactor)), _mm_set1_epi16(128)));
+	return _mm_add_epi16(_mm_srai_epi16(sum, 8), _mm_set1_epi16(128));
+}
+
+// rounded average of the 2x2 blocks, the 4 results are in the lower half
+TARGET_SSE2 static inline __m128i averageBlocksSSE2(__m128i row0, __m128i row1) {
+	__m128i pairs = _mm_madd_epi16(_mm_add_epi16(row0, row1), _mm_set1_epi16(1));
+	__m128i average = _mm_srli_epi32(_mm_add_epi32(pairs, _mm_set1_epi32(2)), 2);
+	return _mm_packs_epi32(average, average);
+}
+
+TARGET_SSE2 static void convertRowsSSE2(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width, bool bgra) {
+	int i = 0;
+	for (; i + 8 <= width; i += 8) {
+		__m128i r0, g0, b0, r1, g1, b1;
+		loadChannelsSSE2(row0 + i * 4, r0, g0, b0, bgra);
+		loadChannelsSSE2(row1 + i * 4, r1, g1, b1, bgra);
+
+		__m128i luma0 = computeYSSE2(r0, g0, b0);
+		__m128i luma1 = computeYSSE2(r1, g1, b1);
+		_mm_storel_epi64((__m128i*) (y0 + i), _mm_packus_epi16(luma0, luma0));
+		_mm_storel_epi64((__m128i*) (y1 + i), _mm_packus_epi16(luma1, luma1));
+
+		__m128i r = averageBlocksSSE2(r0, r1);
+		__m128i g = averageBlocksSSE2(g0, g1);
+		__m128i b = averageBlocksSSE2(b0, b1);
+		__m128i chromaU = computeChromaSSE2(r, g, b, -38, -74, 112);
+		__m128i chromaV = computeChromaSSE2(r, g, b, 112, -94, -18);
+		int packedU = _mm_cvtsi128_si32(_mm_packus_epi16(chromaU, chromaU));
+		int packedV = _mm_cvtsi128_si32(_mm_packus_epi16(chromaV, chromaV));
+		std::memcpy(u + i / 2, &packedU, 4);
+		std::memcpy(v + i / 2, &packedV, 4);
+	}
+	if (i < width) {
+		convertRowsScalar(row0 + i * 4, row1 + i * 4, y0 + i, y1 + i, u + i / 2, v + i / 2, width - i, bgra);
+	}
+}
+
+// The AVX2 packs work per 128 bit lane, the permutes put the 64 bit blocks back in order
+
+// 16 pixels -> 16 x 16 bit per channel
+TARGET_AVX2 static inline void loadChannelsAVX2(const uint8_t* pixels, __m256i& r, __m256i& g, __m256i& b, bool bgra) {
+	__m256i mask = _mm256_set1_epi32(0xFF);
+	__m256i low = _mm256_loadu_si256((const __m256i*) pixels);
+	__m256i high = _mm256_loadu_si256((const __m256i*) (pixels + 32));
+	__m256i first = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(low, mask), _mm256_and_si256(high, mask)), 0xD8);
+	g = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(low, 8), mask), _mm256_and_si256(_mm256_srli_epi32(high, 8), mask)), 0xD8);
+	__m256i third = _mm256_permute4x64_epi64(_mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(low, 16), mask), _mm256_and_si256(_mm256_srli_epi32(high, 16), mask)), 0xD8);
+	r = bgra ? third : first;
+	b = bgra ? first : third;
+}
+
+TARGET_AVX2 static inline __m256i computeYAVX2(__m256i r, __m256i g, __m256i b) {
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(66)), _mm256_mullo_epi16(g, _mm256_set1_epi16(129))),
+		_mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(25)), _mm256_set1_epi16(128)));
+	return _mm256_add_epi16(_mm256_srli_epi16(sum, 8), _mm256_set1_epi16(16));
+}
+
+TARGET_AVX2 static inline __m256i computeChromaAVX2(__m256i r, __m256i g, __m256i b, short redFactor, short greenFactor, short blueFactor) {
+	__m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(redFactor)), _mm256_mullo_epi16(g, _mm256_set1_epi16(greenFactor))),
+		_mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(blueFactor)), _mm256_set1_epi16(128)));
+	return _mm256_add_epi16(_mm256_srai_epi16(sum, 8), _mm256_set1_epi16(128));
+}
+
+// rounded average of the 2x2 blocks, the 8 results are in the lower half
+TARGET_AVX2 static inline __m256i averageBlocksAVX2(__m256i row0, __m256i row1) {
+	__m256i pairs = _mm256_madd_epi16(_mm256_add_epi16(row0, row1), _mm256_set1_epi16(1));
+	__m256i average = _mm256_srli_epi32(_mm256_add_epi32(pairs, _mm256_set1_epi32(2)), 2);
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(average, average), 0xD8);
+}
+
+TARGET_AVX2 static void convertRowsAVX2(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width, bool bgra) {
+	int i = 0;
+	for (; i + 16 <= width; i += 16) {
+		__m256i r0, g0, b0, r1, g1, b1;
+		loadChannelsAVX2(row0 + i * 4, r0, g0, b0, bgra);
+		loadChannelsAVX2(row1 + i * 4, r1, g1, b1, bgra);
+
+		__m256i luma0 = computeYAVX2(r0, g0, b0);
+		__m256i luma1 = computeYAVX2(r1, g1, b1);
+		_mm_storeu_si128((__m128i*) (y0 + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(luma0, luma0), 0xD8)));
+		_mm_storeu_si128((__m128i*) (y1 + i), _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(luma1, luma1), 0xD8)));
+
+		__m256i r = averageBlocksAVX2(r0, r1);
+		__m256i g = averageBlocksAVX2(g0, g1);
+		__m256i b = averageBlocksAVX2(b0, b1);
+		__m128i chromaU = _mm256_castsi256_si128(computeChromaAVX2(r, g, b, -38, -74, 112));
+		__m128i chromaV = _mm256_castsi256_si128(computeChromaAVX2(r, g, b, 112, -94, -18));
+		_mm_storel_epi64((__m128i*) (u + i / 2), _mm_packus_epi16(chromaU, chromaU));
+		_mm_storel_epi64((__m128i*) (v + i / 2), _mm_packus_epi16(chromaV, chromaV));
+	}
+	if (i < width) {
+		convertRowsSSE2(row0 + i * 4, row1 + i * 4, y0 + i, y1 + i, u + i / 2, v + i / 2, width - i, bgra);
+	}
+}
+
+#endif
+
+ColorConverter::ColorConverter() {
+	this->kernel = Kernel::Scalar;
+	this->convertRows = &convertRowsScalar;
+	if (!setKernel(Kernel::AVX2)) {
+		setKernel(Kernel::SSE2);
+	}
+}
+
+void ColorConverter::convert(const uint8_t* source, int sourceStride, int width, int height, PixelOrder order, uint8_t* const destination[3], const int destinationStride[3]) {
+	convertRect(source, sourceStride, width, height, order, destination, destinationStride, 0, 0, width, height);
+}
+
+void ColorConverter::convertRect(const uint8_t* source, int sourceStride, int width, int height, PixelOrder order, uint8_t* const destination[3], const int destinationStride[3],
+	int x, int y, int rectWidth, int rectHeight) {
+	// a chroma sample covers 2x2 pixels
+	int left = std::max(0, x) & ~1;
+	int top = std::max(0, y) & ~1;
+	int right = std::min(width & ~1, (x + rectWidth + 1) & ~1);
+	int bottom = std::min(height & ~1, (y + rectHeight + 1) & ~1);
+	if (right <= left || bottom <= top) {
+		return;
+	}
+
+	for (int row = top; row < bottom; row += 2) {
+		const uint8_t* row0 = source + (ptrdiff_t) row * sourceStride + left * 4;
+		const uint8_t* row1 = row0 + sourceStride;
+		convertRows(row0, row1,
+			destination[0] + (ptrdiff_t) row * destinationStride[0] + left,
+			destination[0] + (ptrdiff_t) (row + 1) * destinationStride[0] + left,
+			destination[1] + (ptrdiff_t) (row / 2) * destinationStride[1] + left / 2,
+			destination[2] + (ptrdiff_t) (row / 2) * destinationStride[2] + left / 2,
+			right - left, order == PixelOrder::BGRA);
+	}
+}
+
+bool ColorConverter::setKernel(Kernel kernel) {
+	if (!isSupported(kernel)) {
+		return false;
+	}
+	this->kernel = kernel;
+	switch (kernel) {
+#ifdef COLOR_CONVERTER_X86
+	case Kernel::AVX2:
+		convertRows = &convertRowsAVX2;
+		break;
+	case Kernel::SSE2:
+		convertRows = &convertRowsSSE2;
+		break;
+#endif
+	default:
+		convertRows = &convertRowsScalar;
+		break;
+	}
+	return true;
+}
+
+ColorConverter::Kernel ColorConverter::getKernel() {
+	return kernel;
+}
+
+const char* ColorConverter::getKernelName(Kernel kernel) {
+	switch (kernel) {
+	case Kernel::SSE2:
+		return "SSE2";
+	case Kernel::AVX2:
+		return "AVX2";
+	default:
+		return "scalar";
+	}
+}
+
+bool ColorConverter::isSupported(Kernel kernel) {
+	if (kernel == Kernel::Scalar) {
+		return true;
+	}
+#ifdef COLOR_CONVERTER_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	bool hasSSE2 = (info[3] & (1 << 26)) != 0;
+	// AVX2 also needs the OS to save the YMM registers
+	bool hasOSXSAVE = (info[2] & (1 << 27)) != 0;
+	bool hasAVX = (info[2] & (1 << 28)) != 0;
+	bool hasAVX2 = false;
+	if (hasOSXSAVE && hasAVX && (_xgetbv(0) & 0x6) == 0x6) {
+		__cpuidex(info, 7, 0);
+		hasAVX2 = (info[1] & (1 << 5)) != 0;
+	}
+#else
+	bool hasSSE2 = __builtin_cpu_supports("sse2");
+	bool hasAVX2 = __builtin_cpu_supports("avx2");
+#endif
+	return kernel == Kernel::SSE2 ? hasSSE2 : hasAVX2;
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+
+// RGBA/BGRA -> I420 for frames that keep their size, which is what the stream does unless the profile scales it down.
+// BT.601 limited range like swscale, the chroma is the average of each 2x2 block.
+// The SSE2 and AVX2 kernels give exactly the same bytes as the scalar one.
+class ColorConverter {
+public:
+	enum class PixelOrder {
+		RGBA,
+		BGRA
+	};
+
+	enum class Kernel {
+		Scalar,
+		SSE2,
+		AVX2
+	};
+
+	// picks the fastest kernel the CPU has
+	ColorConverter();
+
+	// width and height have to be even, the strides can be negative (bottom up images)
+	void convert(const uint8_t* source, int sourceStride, int width, int height, PixelOrder order, uint8_t* const destination[3], const int destinationStride[3]);
+	// Only the pixels of the rectangle, the rest of the destination stays as it is.
+	// The rectangle is rounded out to even coordinates and clipped to the frame.
+	void convertRect(const uint8_t* source, int sourceStride, int width, int height, PixelOrder order, uint8_t* const destination[3], const int destinationStride[3],
+		int x, int y, int rectWidth, int rectHeight);
+
+	// false if the CPU doesn't have it
+	bool setKernel(Kernel kernel);
+	Kernel getKernel();
+	static const char* getKernelName(Kernel kernel);
+	static bool isSupported(Kernel kernel);
+
+private:
+	// converts two rows of pixels (width is even) into two rows of Y and one row of U and V
+	typedef void (*ConvertRows)(const uint8_t* row0, const uint8_t* row1, uint8_t* y0, uint8_t* y1, uint8_t* u, uint8_t* v, int width, bool bgra);
+
+	Kernel kernel;
+	ConvertRows convertRows;
+};
@@ -83,7 +83,7 @@ void handleCommand(std::string jsonCommand, WebSocket ws, HandlerList* handlers)
 	if (!clients.count(ws)) {
 		clientSetMutex.unlock();
 		std::string errorMessage = "{\"error\": true, \"message\": \"Error: User not authenicated\"";
-		ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+		sendToClient(ws, errorMessage);
 	} else {
 		clientSetMutex.unlock();
 	}
@@ -99,7 +99,7 @@ void handleCommand(std::string jsonCommand, WebSocket ws, HandlerList* handlers)
 	} catch (Exception ex) {
 		std::string error = "{ \"error\": true, \"message\": \"Could not get JSON: " + ex.message() + "\"}";
 		app.logger().error(error);
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 		return;
 	}
 	if (pObject != nullptr) {
@@ -0,0 +1,51 @@
+#pragma once
+#include <algorithm>
+
+// A part of the projector window that changed, in pixels with the origin at the bottom left like OpenGL has it
+struct DamageRect {
+    int x = 0;
+    int y = 0;
+    int width = 0;
+    int height = 0;
+
+    static DamageRect full(int frameWidth, int frameHeight) {
+        DamageRect rect;
+        rect.width = frameWidth;
+        rect.height = frameHeight;
+        return rect;
+    }
+
+    bool isEmpty() const {
+        return width <= 0 || height <= 0;
+    }
+
+    bool covers(int frameWidth, int frameHeight) const {
+        return x <= 0 && y <= 0 && x + width >= frameWidth && y + height >= frameHeight;
+    }
+
+    // smallest rectangle containing both
+    void unite(const DamageRect& other) {
+        if (other.isEmpty()) {
+            return;
+        }
+        if (isEmpty()) {
+            *this = other;
+            return;
+        }
+        int right = std::max(x + width, other.x + other.width);
+        int top = std::max(y + height, other.y + other.height);
+        x = std::min(x, other.x);
+        y = std::min(y, other.y);
+        width = right - x;
+        height = top - y;
+    }
+
+    void clip(int frameWidth, int frameHeight) {
+        int right = std::min(x + width, frameWidth);
+        int top = std::min(y + height, frameHeight);
+        x = std::max(x, 0);
+        y = std::max(y, 0);
+        width = std::max(right - x, 0);
+        height = std::max(top - y, 0);
+    }
+};
@@ -0,0 +1,183 @@
+#include <algorithm>
+#include "FontRegistry.h"
+#include "Poco/Exception.h"
+#include "Poco/File.h"
+#include "Poco/Path.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+FontRegistry::FontRegistry(Logger* logger, FT_Library& freeTypeLibrary) {
+    this->consoleLogger = logger;
+    this->_freeTypeLibrary = freeTypeLibrary;
+}
+
+FontRegistry::~FontRegistry() {
+    Mutex::ScopedLock lock(registryMutex);
+    for (std::pair<FT_Face const, Font*>& faceOwner : faceOwners) {
+        FT_Done_Face(faceOwner.first);
+    }
+}
+
+FT_Face FontRegistry::acquireSharedFace(const std::string& fontPath) {
+    Mutex::ScopedLock lock(registryMutex);
+    Font* font = mapFont(fontPath);
+    if (font == nullptr) {
+        return nullptr;
+    }
+    if (font->sharedFace == nullptr) {
+        font->sharedFace = newFace(*font);
+        if (font->sharedFace == nullptr) {
+            return nullptr;
+        }
+    }
+    font->sharedFaceReferences++;
+    return font->sharedFace;
+}
+
+void FontRegistry::releaseSharedFace(FT_Face face) {
+    Mutex::ScopedLock lock(registryMutex);
+    std::map<FT_Face, Font*>::iterator ownerIt = faceOwners.find(face);
+    if (ownerIt == faceOwners.end()) {
+        return;
+    }
+    Font* font = ownerIt->second;
+    if (--font->sharedFaceReferences == 0) {
+        font->sharedFace = nullptr;
+        doneFace(face);
+    }
+}
+
+FT_Face FontRegistry::createPrivateFace(const std::string& fontPath) {
+    Mutex::ScopedLock lock(registryMutex);
+    Font* font = mapFont(fontPath);
+    if (font == nullptr) {
+        return nullptr;
+    }
+    FT_Face face = newFace(*font);
+    if (face != nullptr) {
+        font->privateFaces++;
+    }
+    return face;
+}
+
+void FontRegistry::destroyPrivateFace(FT_Face face) {
+    Mutex::ScopedLock lock(registryMutex);
+    std::map<FT_Face, Font*>::iterator ownerIt = faceOwners.find(face);
+    if (ownerIt == faceOwners.end()) {
+        return;
+    }
+    ownerIt->second->privateFaces--;
+    doneFace(face);
+}
+
+std::vector<FontRegistry::FontInfo> FontRegistry::getLoadedFonts() {
+    Mutex::ScopedLock lock(registryMutex);
+    std::vector<FontInfo> loadedFonts;
+    for (std::pair<const std::string, std::unique_ptr<Font>>& entry : fonts) {
+        Font& font = *entry.second;
+        size_t fileSize = font.mapping->end() - font.mapping->begin();
+        FontInfo info = { font.path, fileSize, getResidentBytes(font.mapping->begin(), fileSize), font.sharedFaceReferences, font.privateFaces };
+        loadedFonts.push_back(info);
+    }
+    return loadedFonts;
+}
+
+FontRegistry::Font* FontRegistry::mapFont(const std::string& fontPath) {
+    // the same file under different relative paths is still one font
+    std::string absolutePath = Poco::Path(fontPath).absolute().toString();
+    std::map<std::string, std::unique_ptr<Font>>::iterator fontIt = fonts.find(absolutePath);
+    if (fontIt != fonts.end()) {
+        return fontIt->second.get();
+    }
+
+    std::unique_ptr<Font> font(new Font());
+    font->path = fontPath;
+    try {
+        font->mapping.reset(new Poco::SharedMemory(Poco::File(fontPath), Poco::SharedMemory::AM_READ));
+    } catch (Poco::Exception& e) {
+        consoleLogger->error("Could not map the font file " + fontPath + ": " + e.displayText());
+        return nullptr;
+    }
+    return fonts.insert(std::make_pair(absolutePath, std::move(font))).first->second.get();
+}
+
+FT_Face FontRegistry::newFace(Font& font) {
+    FT_Face face;
+    const FT_Byte* fontData = reinterpret_cast<const FT_Byte*>(font.mapping->begin());
+    FT_Long fontDataSize = (FT_Long) (font.mapping->end() - font.mapping->begin());
+    int freeTypeError = FT_New_Memory_Face(_freeTypeLibrary, fontData, fontDataSize, 0, &face);
+    if (freeTypeError) {
+        consoleLogger->error("Error loading the font " + font.path + ". Error code: " + std::to_string(freeTypeError));
+        return nullptr;
+    }
+    faceOwners[face] = &font;
+    return face;
+}
+
+void FontRegistry::doneFace(FT_Face face) {
+    Font* font = faceOwners[face];
+    faceOwners.erase(face);
+    FT_Done_Face(face);
+
+    if (font->sharedFaceReferences == 0 && font->privateFaces == 0) {
+        // nobody uses the font anymore, give the mapping back
+        for (std::map<std::string, std::unique_ptr<Font>>::iterator fontIt = fonts.begin(); fontIt != fonts.end(); ++fontIt) {
+            if (fontIt->second.get() == font) {
+                fonts.erase(fontIt);
+                break;
+            }
+        }
+    }
+}
+
+size_t FontRegistry::getResidentBytes(const char* begin, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+#ifdef _WIN32
+    SYSTEM_INFO systemInfo;
+    GetSystemInfo(&systemInfo);
+    size_t pageSize = systemInfo.dwPageSize;
+    uintptr_t firstPage = reinterpret_cast<uintptr_t>(begin) & ~(uintptr_t) (pageSize - 1);
+    size_t pageCount = (reinterpret_cast<uintptr_t>(begin) + size - firstPage + pageSize - 1) / pageSize;
+
+    std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages(pageCount);
+    for (size_t i = 0; i < pageCount; i++) {
+        pages[i].VirtualAddress = reinterpret_cast<PVOID>(firstPage + i * pageSize);
+    }
+    if (!QueryWorkingSetEx(GetCurrentProcess(), pages.data(), (DWORD) (pageCount * sizeof(PSAPI_WORKING_SET_EX_INFORMATION)))) {
+        return 0;
+    }
+    size_t residentPages = 0;
+    for (const PSAPI_WORKING_SET_EX_INFORMATION& page : pages) {
+        if (page.VirtualAttributes.Valid) {
+            residentPages++;
+        }
+    }
+#else
+    size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    uintptr_t firstPage = reinterpret_cast<uintptr_t>(begin) & ~(uintptr_t) (pageSize - 1);
+    size_t pageCount = (reinterpret_cast<uintptr_t>(begin) + size - firstPage + pageSize - 1) / pageSize;
+
+    std::vector<unsigned char> pages(pageCount);
+    if (mincore(reinterpret_cast<void*>(firstPage), pageCount * pageSize, pages.data()) != 0) {
+        return 0;
+    }
+    size_t residentPages = 0;
+    for (unsigned char page : pages) {
+        if (page & 1) {
+            residentPages++;
+        }
+    }
+#endif
+    return std::min(size, residentPages * pageSize);
+}
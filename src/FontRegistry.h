@@ -0,0 +1,62 @@
+#pragma once
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Poco/Logger.h"
+#include "Poco/Mutex.h"
+#include "Poco/SharedMemory.h"
+
+using Poco::Logger;
+using Poco::Mutex;
+
+// Process wide owner of the font files and their FreeType faces. Every font file is memory mapped once,
+// no matter how many renderers and rasterizer threads use it, and unmapped when the last face is gone.
+// All FT_New_Memory_Face/FT_Done_Face calls on the FT_Library go through here, so they never run concurrently.
+class FontRegistry {
+public:
+    struct FontInfo {
+        std::string path;
+        size_t fileSize;
+        size_t residentBytes;   // how much of the mapping is in physical memory right now
+        int sharedFaceReferences;
+        int privateFaces;
+    };
+
+    FontRegistry(Logger* logger, FT_Library& freeTypeLibrary);
+    ~FontRegistry();
+
+    // The face of the font shared by everyone on the render thread, nullptr if the font can't be loaded.
+    // Holding it keeps the font loaded and mapped, it is never sized or rendered with, so its state must not be changed.
+    // Every acquire needs a releaseSharedFace.
+    FT_Face acquireSharedFace(const std::string& fontPath);
+    void releaseSharedFace(FT_Face face);
+    // A face only the caller uses (FT_Face isn't thread safe), backed by the same mapping. Sizing it, measuring
+    // and rendering happen on it, the rasterizer workers have one per font. Every create needs a destroyPrivateFace.
+    FT_Face createPrivateFace(const std::string& fontPath);
+    void destroyPrivateFace(FT_Face face);
+
+    std::vector<FontInfo> getLoadedFonts();
+
+private:
+    struct Font {
+        std::string path;
+        std::unique_ptr<Poco::SharedMemory> mapping;
+        FT_Face sharedFace = nullptr;
+        int sharedFaceReferences = 0;
+        int privateFaces = 0;
+    };
+
+    Logger* consoleLogger;
+    FT_Library _freeTypeLibrary;
+    Mutex registryMutex;
+    std::map<std::string, std::unique_ptr<Font>> fonts;
+    std::map<FT_Face, Font*> faceOwners;
+
+    Font* mapFont(const std::string& fontPath);
+    FT_Face newFace(Font& font);
+    void doneFace(FT_Face face);
+    static size_t getResidentBytes(const char* begin, size_t size);
+};
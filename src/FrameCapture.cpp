@@ -0,0 +1,162 @@
+#include <glad/glad.h>
+#include <cstring>
+#include "FrameCapture.h"
+#include "Poco/Timestamp.h"
+
+FrameCapture::FrameCapture(int numberOfFrames) : frames(numberOfFrames), readyFrames(numberOfFrames), freeFrames(numberOfFrames) {
+    this->enabled = false;
+    this->fullFrameRequested = true;
+    this->nextPixelBuffer = 0;
+    this->lastWidth = 0;
+    this->lastHeight = 0;
+    this->spareFrame = nullptr;
+    for (CapturedFrame& frame : frames) {
+        freeFrames.push(&frame);
+    }
+}
+
+FrameCapture::~FrameCapture() {
+}
+
+void FrameCapture::setRedrawCallback(std::function<void()> callback) {
+    this->redrawCallback = callback;
+}
+
+void FrameCapture::setEnabled(bool enabled) {
+    bool isWakingUp = enabled && !this->enabled;
+    if (isWakingUp) {
+        // nothing was read back while disabled, the streamer's picture is outdated
+        fullFrameRequested = true;
+    }
+    this->enabled = enabled;
+    if (isWakingUp && redrawCallback) {
+        // the retained render loop sleeps up to its idle timeout otherwise
+        redrawCallback();
+    }
+}
+
+bool FrameCapture::isEnabled() {
+    return enabled;
+}
+
+CapturedFrame* FrameCapture::takeFrame() {
+    CapturedFrame* frame;
+    if (!readyFrames.pop(frame)) {
+        return nullptr;
+    }
+    return frame;
+}
+
+void FrameCapture::recycleFrame(CapturedFrame* frame) {
+    freeFrames.push(frame);
+}
+
+void FrameCapture::requestFullFrame() {
+    fullFrameRequested = true;
+}
+
+void FrameCapture::readBack(int width, int height, unsigned long long generation, const DamageRect& damage) {
+    if (!enabled || width <= 0 || height <= 0) {
+        return;
+    }
+
+    PixelBuffer& pixelBuffer = pixelBuffers[nextPixelBuffer];
+    nextPixelBuffer = (nextPixelBuffer + 1) % 2;
+    DamageRect readRect = damage;
+    readRect.unite(carriedDamage);
+    carriedDamage = DamageRect();
+    if (pixelBuffer.pending) {
+        // not delivered yet (deliverPending wasn't called), this frame is newer and reads its damage too
+        readRect.unite(pixelBuffer.damage);
+        pixelBuffer.pending = false;
+    }
+    if (fullFrameRequested.exchange(false) || width != lastWidth || height != lastHeight) {
+        readRect = DamageRect::full(width, height);
+        lastWidth = width;
+        lastHeight = height;
+    }
+    readRect.clip(width, height);
+
+    if (pixelBuffer.id == 0) {
+        glGenBuffers(1, &pixelBuffer.id);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer.id);
+    if (pixelBuffer.width != width || pixelBuffer.height != height) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, (GLsizeiptr) width * height * 4, NULL, GL_STREAM_READ);
+        pixelBuffer.width = width;
+        pixelBuffer.height = height;
+    }
+
+    // with a pack buffer bound this only queues the copy, the pixels are copied out in deliverPending
+    // the rows of the rectangle are packed tightly, RGBA rows are always 4 byte aligned
+    if (!readRect.isEmpty()) {
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(readRect.x, readRect.y, readRect.width, readRect.height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    pixelBuffer.damage = readRect;
+    pixelBuffer.generation = generation;
+    pixelBuffer.captureTime = Poco::Timestamp().epochMicroseconds();
+    pixelBuffer.pending = true;
+}
+
+bool FrameCapture::deliverPending() {
+    bool isFrameLost = false;
+    // the older buffer first, so the streamer gets the frames in order
+    for (int i = 0; i < 2; i++) {
+        PixelBuffer& pixelBuffer = pixelBuffers[(nextPixelBuffer + i) % 2];
+        if (!pixelBuffer.pending) {
+            continue;
+        }
+        pixelBuffer.pending = false;
+
+        // a frame left over from a failed map first, only the streamer may push to freeFrames
+        CapturedFrame* frame = spareFrame;
+        spareFrame = nullptr;
+        if (frame == nullptr && !freeFrames.pop(frame)) {
+            // the streamer holds on to all frames, the next frame that is read back brings the damage along
+            carriedDamage.unite(pixelBuffer.damage);
+            isFrameLost = true;
+            continue;
+        }
+
+        // only allocates when more of the window changed than ever before
+        size_t damageSize = (size_t) pixelBuffer.damage.width * pixelBuffer.damage.height * 4;
+        frame->pixels.resize(damageSize);
+        if (damageSize > 0) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, pixelBuffer.id);
+            const void* pixels = glMapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+            if (pixels == nullptr) {
+                glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+                spareFrame = frame;
+                carriedDamage.unite(pixelBuffer.damage);
+                isFrameLost = true;
+                continue;
+            }
+            std::memcpy(frame->pixels.data(), pixels, damageSize);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+
+        frame->width = pixelBuffer.width;
+        frame->height = pixelBuffer.height;
+        frame->damage = pixelBuffer.damage;
+        frame->generation = pixelBuffer.generation;
+        frame->captureTime = pixelBuffer.captureTime;
+        readyFrames.push(frame);
+    }
+    return isFrameLost;
+}
+
+void FrameCapture::releaseGL() {
+    for (PixelBuffer& pixelBuffer : pixelBuffers) {
+        if (pixelBuffer.id != 0) {
+            glDeleteBuffers(1, &pixelBuffer.id);
+        }
+        pixelBuffer = PixelBuffer();
+    }
+    carriedDamage = DamageRect();
+    lastWidth = 0;
+    lastHeight = 0;
+}
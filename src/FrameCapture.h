@@ -0,0 +1,77 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include "SPSCQueue.h"
+#include "DamageRect.h"
+
+// What changed in one rendered frame of the projector window: the damaged rectangle of the frame before,
+// RGBA rows bottom up like glReadPixels gives them. The first frame and every frame after a gap cover the whole window.
+struct CapturedFrame {
+    int width = 0;                      // of the window
+    int height = 0;
+    DamageRect damage;                  // empty if the frame looks exactly like the one before
+    unsigned long long generation = 0;  // renderGeneration the frame was rendered for
+    int64_t captureTime = 0;            // microseconds, Poco::Timestamp
+    std::vector<unsigned char> pixels;  // damage.width * damage.height pixels
+};
+
+// Reads back the frames the render loop draws, for the streamer.
+// The render thread starts an asynchronous glReadPixels into a pixel buffer object after drawing and copies
+// the result out one loop iteration later, when the GPU is long done with it, so it never waits for the readback.
+// Only the damaged part of a frame is read back, the streamer keeps the picture and patches it in frame by frame.
+// A frame that can't be delivered isn't lost, its damage is added to the next one.
+// Frames go to the streamer through a lock-free queue, the buffers come back through a second one.
+class FrameCapture {
+public:
+    FrameCapture(int numberOfFrames = 4);
+    ~FrameCapture();
+
+    // Called when the capture gets enabled, the render loop may be asleep and has to draw a first frame.
+    // Set before the streamer starts.
+    void setRedrawCallback(std::function<void()> callback);
+
+    // Streamer side. Frames are only read back while the capture is enabled.
+    void setEnabled(bool enabled);
+    bool isEnabled();
+    // Oldest captured frame, nullptr if nothing new was captured. Every frame has to be applied in order,
+    // then given back with recycleFrame.
+    CapturedFrame* takeFrame();
+    void recycleFrame(CapturedFrame* frame);
+    // the next frame covers the whole window, for when the streamer lost track of the picture
+    void requestFullFrame();
+
+    // Render thread side, with the projector context current
+    // Call after drawing and before swapping the buffers, with what changed since the last complete frame
+    void readBack(int width, int height, unsigned long long generation, const DamageRect& damage);
+    // Call once per loop iteration, hands the frames read back in earlier iterations to the streamer.
+    // Returns true if a frame couldn't be delivered, the next one has its damage, so render one.
+    bool deliverPending();
+    void releaseGL();
+
+private:
+    struct PixelBuffer {
+        unsigned int id = 0;
+        int width = 0;
+        int height = 0;
+        DamageRect damage;
+        unsigned long long generation = 0;
+        int64_t captureTime = 0;
+        bool pending = false;
+    };
+
+    std::atomic<bool> enabled;
+    std::atomic<bool> fullFrameRequested;
+    std::function<void()> redrawCallback;
+    std::vector<CapturedFrame> frames;
+    SPSCQueue<CapturedFrame*> readyFrames;  // render thread -> streamer
+    SPSCQueue<CapturedFrame*> freeFrames;   // streamer -> render thread
+    PixelBuffer pixelBuffers[2];
+    int nextPixelBuffer;
+    // render thread only
+    DamageRect carriedDamage;   // of frames that couldn't be delivered
+    CapturedFrame* spareFrame;  // taken from freeFrames but not delivered, used before the next pop
+    int lastWidth;
+    int lastHeight;
+};
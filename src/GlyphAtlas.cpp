@@ -0,0 +1,144 @@
+#include <glad/glad.h>
+#include "GlyphAtlas.h"
+
+GlyphAtlas::GlyphAtlas(int pageSize, int maxPages) {
+    this->_pageSize = pageSize;
+    this->_maxPages = maxPages;
+}
+
+GlyphAtlas::~GlyphAtlas() {
+    for (Page& page : pages) {
+        glDeleteTextures(1, &page.textureID);
+    }
+}
+
+bool GlyphAtlas::canFit(int width, int height) {
+    return width + 2 * padding <= _pageSize && height + 2 * padding <= _pageSize;
+}
+
+bool GlyphAtlas::add(int width, int height, const unsigned char* pixels, Region& region) {
+    if (!canFit(width, height)) {
+        return false;
+    }
+
+    if (pages.empty()) {
+        createPage();
+    }
+
+    int x = 0;
+    int y = 0;
+    unsigned int pageIndex = 0;
+    bool found = false;
+
+    for (pageIndex = 0; pageIndex < pages.size(); pageIndex++) {
+        if (addToPage(pages[pageIndex], width, height, x, y)) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        if ((int) pages.size() >= _maxPages) {
+            return false;
+        }
+        createPage();
+        pageIndex = pages.size() - 1;
+        addToPage(pages[pageIndex], width, height, x, y);
+    }
+
+    if (width > 0 && height > 0) {
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glBindTexture(GL_TEXTURE_2D, pages[pageIndex].textureID);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, width, height, GL_RED, GL_UNSIGNED_BYTE, pixels);
+    }
+
+    float pageSize = (float) _pageSize;
+    region.page = pageIndex;
+    region.u0 = x / pageSize;
+    region.v0 = y / pageSize;
+    region.u1 = (x + width) / pageSize;
+    region.v1 = (y + height) / pageSize;
+
+    return true;
+}
+
+bool GlyphAtlas::addToPage(Page& page, int width, int height, int& x, int& y) {
+    int paddedWidth = width + padding;
+    int paddedHeight = height + padding;
+
+    // best fitting shelf: the lowest one the glyph fits in, so tall shelves aren't wasted on small glyphs
+    Shelf* bestShelf = nullptr;
+    for (Shelf& shelf : page.shelves) {
+        if (shelf.height >= paddedHeight && shelf.x + paddedWidth <= _pageSize) {
+            if (bestShelf == nullptr || shelf.height < bestShelf->height) {
+                bestShelf = &shelf;
+            }
+        }
+    }
+
+    if (bestShelf == nullptr) {
+        if (page.nextShelfY + paddedHeight > _pageSize) {
+            return false;
+        }
+        Shelf shelf = { page.nextShelfY, paddedHeight, padding };
+        page.nextShelfY += paddedHeight;
+        page.shelves.push_back(shelf);
+        bestShelf = &page.shelves.back();
+    }
+
+    x = bestShelf->x;
+    y = bestShelf->y;
+    bestShelf->x += paddedWidth;
+
+    return true;
+}
+
+void GlyphAtlas::createPage() {
+    Page page;
+    glGenTextures(1, &page.textureID);
+    glBindTexture(GL_TEXTURE_2D, page.textureID);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    resetPage(page);
+    pages.push_back(page);
+}
+
+void GlyphAtlas::resetPage(Page& page) {
+    // zero the whole page so the padding around the glyphs is transparent
+    std::vector<unsigned char> emptyPixels(_pageSize * _pageSize, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glBindTexture(GL_TEXTURE_2D, page.textureID);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RED, _pageSize, _pageSize, 0, GL_RED, GL_UNSIGNED_BYTE, emptyPixels.data());
+    page.shelves.clear();
+    page.nextShelfY = padding;
+}
+
+unsigned int GlyphAtlas::getTexture(unsigned int page) {
+    return pages[page].textureID;
+}
+
+unsigned int GlyphAtlas::getPageCount() {
+    return pages.size();
+}
+
+int GlyphAtlas::getPageSize() {
+    return _pageSize;
+}
+
+unsigned int GlyphAtlas::getGeneration() {
+    return generation;
+}
+
+void GlyphAtlas::clear() {
+    generation++;
+    if (pages.empty()) {
+        return;
+    }
+    for (unsigned int i = 1; i < pages.size(); i++) {
+        glDeleteTextures(1, &pages[i].textureID);
+    }
+    pages.resize(1);
+    resetPage(pages[0]);
+}
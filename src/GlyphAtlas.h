@@ -0,0 +1,54 @@
+#pragma once
+#include <vector>
+
+// Packs glyph bitmaps into a few large single channel textures (pages) using a shelf packer,
+// so a whole text box can be drawn while binding one or a few textures instead of one per glyph.
+class GlyphAtlas {
+public:
+    struct Region {
+        unsigned int page;  // index of the page the glyph lives in
+        float u0;           // texture coordinates of the top left corner
+        float v0;
+        float u1;           // texture coordinates of the bottom right corner
+        float v1;
+    };
+
+    GlyphAtlas(int pageSize = 1024, int maxPages = 8);
+    ~GlyphAtlas();
+
+    // Uploads the bitmap into the atlas. Returns false if the atlas is full (the caller should clear() and retry)
+    // or if the bitmap can never fit into a page.
+    bool add(int width, int height, const unsigned char* pixels, Region& region);
+    unsigned int getTexture(unsigned int page);
+    unsigned int getPageCount();
+    int getPageSize();
+    bool canFit(int width, int height);
+    // Evicts all glyphs, keeps the first page texture around so it can be reused
+    void clear();
+    // Incremented on every clear(), regions handed out before a change are no longer valid
+    unsigned int getGeneration();
+
+private:
+    struct Shelf {
+        int y;
+        int height;
+        int x;
+    };
+
+    struct Page {
+        unsigned int textureID;
+        std::vector<Shelf> shelves;
+        int nextShelfY;
+    };
+
+    int _pageSize;
+    int _maxPages;
+    unsigned int generation = 0;
+    // empty space around every glyph, so linear filtering doesn't pick up the neighbours
+    const int padding = 1;
+    std::vector<Page> pages;
+
+    bool addToPage(Page& page, int width, int height, int& x, int& y);
+    void createPage();
+    void resetPage(Page& page);
+};
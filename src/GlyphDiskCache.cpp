@@ -0,0 +1,329 @@
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <vector>
+#include "GlyphDiskCache.h"
+#include "Poco/Exception.h"
+#include "Poco/File.h"
+#include "Poco/Path.h"
+
+// the mappings are closed and the pending glyphs flushed once this many font sizes are open
+static const size_t maxOpenFiles = 16;
+static const char fileMagic[4] = { 'S', 'T', 'P', 'G' };
+static const uint32_t fileVersion = 1;
+
+GlyphDiskCache::GlyphDiskCache(Logger* logger, const std::string& directory) {
+    this->consoleLogger = logger;
+    this->_directory = directory;
+    this->enabled = true;
+    this->fontSwitches = 0;
+    this->nextFileId = 0;
+    this->flushRequested = false;
+    try {
+        Poco::File(directory).createDirectories();
+    } catch (Poco::Exception& e) {
+        consoleLogger->error("Could not create the glyph cache directory " + directory + ": " + e.displayText());
+        this->enabled = false;
+    }
+}
+
+GlyphDiskCache::~GlyphDiskCache() {
+    flush();
+}
+
+bool GlyphDiskCache::lookup(const std::string& fontPath, float fontSize, int charCode, GlyphBitmap& glyph) {
+    if (flushRequested.exchange(false)) {
+        flush();
+    }
+    Mutex::ScopedLock lock(cacheMutex);
+    CacheFile* file = getFile(fontPath, fontSize);
+    if (file == nullptr) {
+        return false;
+    }
+
+    std::map<int, GlyphBitmap>::iterator pendingIt = file->pending.find(charCode);
+    if (pendingIt != file->pending.end()) {
+        glyph = pendingIt->second;
+        return true;
+    }
+
+    std::map<int, const char*>::iterator entryIt = file->entries.find(charCode);
+    if (entryIt == file->entries.end()) {
+        return false;
+    }
+
+    // the mapping has no alignment guarantees, copy instead of casting
+    GlyphEntry entry;
+    std::memcpy(&entry, entryIt->second, sizeof(GlyphEntry));
+    glyph.charCode = entry.charCode;
+    glyph.width = entry.width;
+    glyph.rows = entry.rows;
+    glyph.left = entry.left;
+    glyph.top = entry.top;
+    glyph.advance = (long) entry.advance;
+    glyph.height = (long) entry.height;
+    glyph.inFont = entry.inFont != 0;
+    const unsigned char* pixels = reinterpret_cast<const unsigned char*>(file->mapping->begin()) + entry.pixelOffset;
+    glyph.pixels.assign(pixels, pixels + entry.width * entry.rows);
+    return true;
+}
+
+void GlyphDiskCache::store(const std::string& fontPath, float fontSize, const GlyphBitmap& glyph) {
+    if (flushRequested.exchange(false)) {
+        flush();
+    }
+    Mutex::ScopedLock lock(cacheMutex);
+    CacheFile* file = getFile(fontPath, fontSize);
+    if (file == nullptr || file->entries.find(glyph.charCode) != file->entries.end()) {
+        return;
+    }
+    file->pending[glyph.charCode] = glyph;
+}
+
+void GlyphDiskCache::flush() {
+    // the workers keep looking glyphs up while the files are written, only taking
+    // the snapshot and swapping the mapping happen under the lock
+    Mutex::ScopedLock flushLock(flushMutex);
+    std::vector<FileSnapshot> snapshots;
+    {
+        Mutex::ScopedLock lock(cacheMutex);
+        for (std::pair<const std::string, std::unique_ptr<CacheFile>>& file : files) {
+            if (file.second->pending.empty()) {
+                continue;
+            }
+            FileSnapshot snapshot;
+            snapshot.key = file.first;
+            snapshot.id = file.second->id;
+            snapshot.temporaryPath = file.second->path + ".tmp";
+            for (std::pair<const int, GlyphBitmap>& pendingGlyph : file.second->pending) {
+                snapshot.writtenGlyphs.push_back(pendingGlyph.first);
+            }
+            serializeFile(*file.second, snapshot.contents);
+            snapshots.push_back(std::move(snapshot));
+        }
+    }
+    if (snapshots.empty()) {
+        return;
+    }
+
+    for (FileSnapshot& snapshot : snapshots) {
+        if (!writeTemporaryFile(snapshot.temporaryPath, snapshot.contents)) {
+            snapshot.temporaryPath.clear();
+        }
+    }
+
+    Mutex::ScopedLock lock(cacheMutex);
+    for (FileSnapshot& snapshot : snapshots) {
+        if (snapshot.temporaryPath.empty()) {
+            continue;
+        }
+        std::map<std::string, std::unique_ptr<CacheFile>>::iterator fileIt = files.find(snapshot.key);
+        if (fileIt == files.end() || fileIt->second->id != snapshot.id) {
+            // written or reset by someone else in the meantime, the snapshot is outdated
+            try {
+                Poco::File(snapshot.temporaryPath).remove();
+            } catch (Poco::Exception&) {
+            }
+            continue;
+        }
+        CacheFile& file = *fileIt->second;
+        if (replaceFile(file, snapshot.temporaryPath)) {
+            // the glyphs stored while writing stay pending for the next flush
+            for (int charCode : snapshot.writtenGlyphs) {
+                file.pending.erase(charCode);
+            }
+        }
+    }
+}
+
+GlyphDiskCache::CacheFile* GlyphDiskCache::getFile(const std::string& fontPath, float fontSize) {
+    if (!enabled) {
+        return nullptr;
+    }
+
+    // FNV-1a of the absolute font path, stable between runs unlike std::hash
+    std::string absolutePath = Poco::Path(fontPath).absolute().toString();
+    uint64_t pathHash = 14695981039346656037ull;
+    for (unsigned char c : absolutePath) {
+        pathHash = (pathHash ^ c) * 1099511628211ull;
+    }
+    uint32_t fixedFontSize = (uint32_t) (fontSize * 64);
+    char fileKey[64];
+    std::snprintf(fileKey, sizeof(fileKey), "%016llx-%u", (unsigned long long) pathHash, fixedFontSize);
+
+    if (fontPath != lastFontPath) {
+        // switched fonts, the font files may have been replaced since their cache files were opened
+        lastFontPath = fontPath;
+        fontSwitches++;
+    }
+
+    std::map<std::string, std::unique_ptr<CacheFile>>::iterator fileIt = files.find(fileKey);
+    if (fileIt != files.end()) {
+        CacheFile* file = fileIt->second.get();
+        if (file->validatedAt != fontSwitches) {
+            uint64_t fontFileSize;
+            int64_t fontModified;
+            if (!readFontFileInfo(fontPath, fontFileSize, fontModified)) {
+                return nullptr;
+            }
+            if (fontFileSize != file->fontFileSize || fontModified != file->fontModified) {
+                file->mapping.reset();
+                file->entries.clear();
+                file->pending.clear();
+                file->id = ++nextFileId;
+                file->fontFileSize = fontFileSize;
+                file->fontModified = fontModified;
+            }
+            file->validatedAt = fontSwitches;
+        }
+        return file;
+    }
+
+    if (files.size() >= maxOpenFiles) {
+        // the files with pending glyphs stay open until the next lookup or store flushes them outside the lock
+        std::map<std::string, std::unique_ptr<CacheFile>>::iterator evictIt = files.begin();
+        while (evictIt != files.end()) {
+            if (evictIt->second->pending.empty()) {
+                evictIt = files.erase(evictIt);
+            } else {
+                flushRequested = true;
+                ++evictIt;
+            }
+        }
+    }
+
+    std::unique_ptr<CacheFile> file(new CacheFile());
+    if (!readFontFileInfo(fontPath, file->fontFileSize, file->fontModified)) {
+        return nullptr;
+    }
+    file->path = Poco::Path(Poco::Path(_directory), std::string(fileKey) + ".glyphs").toString();
+    file->fontSize = fixedFontSize;
+    file->validatedAt = fontSwitches;
+    file->id = ++nextFileId;
+    mapFile(*file);
+
+    return files.insert(std::make_pair(std::string(fileKey), std::move(file))).first->second.get();
+}
+
+void GlyphDiskCache::mapFile(CacheFile& file) {
+    file.entries.clear();
+    file.mapping.reset();
+
+    Poco::File cacheFile(file.path);
+    if (!cacheFile.exists() || cacheFile.getSize() < sizeof(FileHeader)) {
+        return;
+    }
+
+    try {
+        file.mapping.reset(new Poco::SharedMemory(cacheFile, Poco::SharedMemory::AM_READ));
+    } catch (Poco::Exception& e) {
+        consoleLogger->warning("Could not map the glyph cache " + file.path + ": " + e.displayText());
+        return;
+    }
+
+    const char* begin = file.mapping->begin();
+    size_t size = file.mapping->end() - begin;
+
+    FileHeader header;
+    std::memcpy(&header, begin, sizeof(FileHeader));
+    bool isValid = std::memcmp(header.magic, fileMagic, sizeof(fileMagic)) == 0
+        && header.version == fileVersion
+        && header.fontFileSize == file.fontFileSize
+        && header.fontModified == file.fontModified
+        && header.fontSize == file.fontSize
+        && sizeof(FileHeader) + (uint64_t) header.glyphCount * sizeof(GlyphEntry) <= size;
+
+    for (uint32_t i = 0; isValid && i < header.glyphCount; i++) {
+        const char* entryPosition = begin + sizeof(FileHeader) + i * sizeof(GlyphEntry);
+        GlyphEntry entry;
+        std::memcpy(&entry, entryPosition, sizeof(GlyphEntry));
+        if (entry.width < 0 || entry.rows < 0 || entry.pixelOffset + (uint64_t) entry.width * entry.rows > size) {
+            isValid = false;
+            break;
+        }
+        file.entries[entry.charCode] = entryPosition;
+    }
+
+    if (!isValid) {
+        // written for another version of the font (or broken), it gets replaced on the next flush
+        file.entries.clear();
+        file.mapping.reset();
+    }
+}
+
+void GlyphDiskCache::serializeFile(const CacheFile& file, std::vector<char>& contents) {
+    // the existing glyphs are copied out of the mapping, it has to be closed before the file can be replaced
+    std::vector<GlyphEntry> entries;
+    std::vector<char> pixels;
+    for (const std::pair<const int, const char*>& mappedEntry : file.entries) {
+        GlyphEntry entry;
+        std::memcpy(&entry, mappedEntry.second, sizeof(GlyphEntry));
+        const char* entryPixels = file.mapping->begin() + entry.pixelOffset;
+        entry.pixelOffset = pixels.size();
+        pixels.insert(pixels.end(), entryPixels, entryPixels + entry.width * entry.rows);
+        entries.push_back(entry);
+    }
+    for (const std::pair<const int, GlyphBitmap>& pendingGlyph : file.pending) {
+        const GlyphBitmap& glyph = pendingGlyph.second;
+        GlyphEntry entry = { glyph.charCode, glyph.width, glyph.rows, glyph.left, glyph.top, glyph.inFont ? 1 : 0, glyph.advance, glyph.height, pixels.size() };
+        pixels.insert(pixels.end(), glyph.pixels.begin(), glyph.pixels.end());
+        entries.push_back(entry);
+    }
+
+    uint64_t pixelStart = sizeof(FileHeader) + entries.size() * sizeof(GlyphEntry);
+    for (GlyphEntry& entry : entries) {
+        entry.pixelOffset += pixelStart;
+    }
+
+    FileHeader header;
+    std::memcpy(header.magic, fileMagic, sizeof(fileMagic));
+    header.version = fileVersion;
+    header.fontFileSize = file.fontFileSize;
+    header.fontModified = file.fontModified;
+    header.fontSize = file.fontSize;
+    header.glyphCount = (uint32_t) entries.size();
+
+    contents.clear();
+    contents.reserve(pixelStart + pixels.size());
+    contents.insert(contents.end(), reinterpret_cast<const char*>(&header), reinterpret_cast<const char*>(&header) + sizeof(FileHeader));
+    contents.insert(contents.end(), reinterpret_cast<const char*>(entries.data()), reinterpret_cast<const char*>(entries.data()) + entries.size() * sizeof(GlyphEntry));
+    contents.insert(contents.end(), pixels.begin(), pixels.end());
+}
+
+bool GlyphDiskCache::writeTemporaryFile(const std::string& temporaryPath, const std::vector<char>& contents) {
+    // written next to the cache file and renamed, so a crash never leaves a half written cache file behind
+    std::ofstream out(temporaryPath, std::ios::binary | std::ios::trunc);
+    out.write(contents.data(), contents.size());
+    if (!out) {
+        consoleLogger->warning("Could not write the glyph cache " + temporaryPath);
+        return false;
+    }
+    return true;
+}
+
+bool GlyphDiskCache::replaceFile(CacheFile& file, const std::string& temporaryPath) {
+    // the mapping keeps the old file open, it can't be replaced before it is closed
+    file.entries.clear();
+    file.mapping.reset();
+    file.id = ++nextFileId;
+    bool isReplaced = true;
+    try {
+        Poco::File(temporaryPath).renameTo(file.path);
+    } catch (Poco::Exception& e) {
+        consoleLogger->warning("Could not replace the glyph cache " + file.path + ": " + e.displayText());
+        isReplaced = false;
+    }
+    mapFile(file);
+    return isReplaced;
+}
+
+bool GlyphDiskCache::readFontFileInfo(const std::string& fontPath, uint64_t& fontFileSize, int64_t& fontModified) {
+    try {
+        Poco::File fontFile(fontPath);
+        fontFileSize = fontFile.getSize();
+        fontModified = fontFile.getLastModified().epochMicroseconds();
+    } catch (Poco::Exception&) {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,92 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Poco/Logger.h"
+#include "Poco/Mutex.h"
+#include "Poco/SharedMemory.h"
+#include "GlyphRasterizer.h"
+
+using Poco::Logger;
+using Poco::Mutex;
+
+// Rendered glyph bitmaps and their metrics on disk, one memory mapped file per font and pixel size,
+// so a restart or a font switch doesn't have to run FreeType again for glyphs it rendered before.
+// The files remember the size and modification time of the font file, they are rebuilt when the font changes.
+// Thread safe, shared by all the rasterizer workers.
+class GlyphDiskCache {
+public:
+    GlyphDiskCache(Logger* logger, const std::string& directory);
+    ~GlyphDiskCache();
+
+    bool lookup(const std::string& fontPath, float fontSize, int charCode, GlyphBitmap& glyph);
+    // Kept in memory until the next flush()
+    void store(const std::string& fontPath, float fontSize, const GlyphBitmap& glyph);
+    // Writes the stored glyphs to disk
+    void flush();
+
+private:
+    // on disk: FileHeader, glyphCount GlyphEntries, then the pixels of all glyphs
+    struct FileHeader {
+        char magic[4];
+        uint32_t version;
+        uint64_t fontFileSize;
+        int64_t fontModified;   // microseconds since the epoch
+        uint32_t fontSize;      // 26.6 fixed point
+        uint32_t glyphCount;
+    };
+
+    struct GlyphEntry {
+        int32_t charCode;
+        int32_t width;
+        int32_t rows;
+        int32_t left;
+        int32_t top;
+        int32_t inFont;
+        int64_t advance;
+        int64_t height;
+        uint64_t pixelOffset;   // from the start of the file
+    };
+
+    struct CacheFile {
+        std::string path;
+        uint64_t fontFileSize = 0;
+        int64_t fontModified = 0;
+        uint32_t fontSize = 0;
+        unsigned int validatedAt = 0;           // value of fontSwitches when the font file was last checked
+        std::unique_ptr<Poco::SharedMemory> mapping;
+        std::map<int, const char*> entries;     // where the GlyphEntry of a code point is in the mapping
+        std::map<int, GlyphBitmap> pending;     // stored, but not written yet
+        unsigned int id = 0;                    // changes whenever the file is replaced or reset
+    };
+
+    // what flush() writes outside the lock
+    struct FileSnapshot {
+        std::string key;
+        unsigned int id;
+        std::string temporaryPath;
+        std::vector<int> writtenGlyphs;
+        std::vector<char> contents;
+    };
+
+    Logger* consoleLogger;
+    std::string _directory;
+    bool enabled;
+    Mutex cacheMutex;
+    Mutex flushMutex;   // one flush at a time, taken before cacheMutex
+    unsigned int nextFileId;
+    std::atomic<bool> flushRequested;   // too many files are open, some of them have pending glyphs
+    std::map<std::string, std::unique_ptr<CacheFile>> files;
+    std::string lastFontPath;
+    unsigned int fontSwitches;
+
+    CacheFile* getFile(const std::string& fontPath, float fontSize);
+    void mapFile(CacheFile& file);
+    void serializeFile(const CacheFile& file, std::vector<char>& contents);
+    bool writeTemporaryFile(const std::string& temporaryPath, const std::vector<char>& contents);
+    bool replaceFile(CacheFile& file, const std::string& temporaryPath);
+    static bool readFontFileInfo(const std::string& fontPath, uint64_t& fontFileSize, int64_t& fontModified);
+};
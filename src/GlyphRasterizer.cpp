@@ -0,0 +1,268 @@
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include "GlyphRasterizer.h"
+#include "GlyphDiskCache.h"
+#include "FontRegistry.h"
+#include "Poco/StringTokenizer.h"
+
+using Poco::StringTokenizer;
+
+GlyphRasterizer::GlyphRasterizer(Logger* logger, FontRegistry* fontRegistry) {
+    this->consoleLogger = logger;
+    this->_fontRegistry = fontRegistry;
+    this->_numberOfWorkers = 2;
+    this->_diskCache = nullptr;
+    this->stopping = false;
+    this->notificationPending = false;
+    this->activeLazyBatch = 0;
+    this->activePrewarmBatch = 0;
+    this->activeMetricsBatch = 0;
+}
+
+GlyphRasterizer::~GlyphRasterizer() {
+    stopping = true;
+    // one stop per worker, a worker that just checked stopping would miss a wakeUpAll and wait forever
+    for (size_t i = 0; i < workers.size(); i++) {
+        requests.enqueueUrgentNotification(new StopRequest());
+    }
+    for (std::unique_ptr<Poco::Thread>& thread : threads) {
+        thread->join();
+    }
+}
+
+void GlyphRasterizer::setNumberOfWorkers(int numberOfWorkers) {
+    this->_numberOfWorkers = std::max(1, numberOfWorkers);
+}
+
+void GlyphRasterizer::setOnGlyphsReady(std::function<void()> onGlyphsReady) {
+    this->_onGlyphsReady = onGlyphsReady;
+}
+
+void GlyphRasterizer::setDiskCache(GlyphDiskCache* diskCache) {
+    this->_diskCache = diskCache;
+}
+
+void GlyphRasterizer::startWorkers() {
+    for (int i = 0; i < _numberOfWorkers; i++) {
+        workers.push_back(std::unique_ptr<Worker>(new Worker(this)));
+        threads.push_back(std::unique_ptr<Poco::Thread>(new Poco::Thread("GlyphRasterizer" + std::to_string(i))));
+        threads.back()->start(*workers.back());
+    }
+}
+
+void GlyphRasterizer::request(const std::string& fontPath, float fontSize, int charCode, unsigned int batch, bool urgent) {
+    if (workers.empty()) {
+        startWorkers();
+    }
+    if (urgent) {
+        requests.enqueueUrgentNotification(new GlyphRequest(fontPath, fontSize, charCode, batch));
+    } else {
+        requests.enqueueNotification(new GlyphRequest(fontPath, fontSize, charCode, batch));
+    }
+}
+
+void GlyphRasterizer::requestMetrics(const std::string& fontPath, const std::vector<float>& fontSizes, const std::vector<int>& charCodes, unsigned int batch) {
+    if (workers.empty()) {
+        startWorkers();
+    }
+    // the layout can't start before it has them, so they go before everything else
+    requests.enqueueUrgentNotification(new MetricsRequest(fontPath, fontSizes, charCodes, batch));
+}
+
+void GlyphRasterizer::setActiveBatches(unsigned int lazyBatch, unsigned int prewarmBatch) {
+    activeLazyBatch = lazyBatch;
+    activePrewarmBatch = prewarmBatch;
+}
+
+void GlyphRasterizer::setActiveMetricsBatch(unsigned int metricsBatch) {
+    activeMetricsBatch = metricsBatch;
+}
+
+bool GlyphRasterizer::isBatchActive(unsigned int batch) {
+    return batch == activeLazyBatch || batch == activePrewarmBatch || batch == activeMetricsBatch;
+}
+
+bool GlyphRasterizer::poll(GlyphBitmap& glyph) {
+    // allow the workers to wake up the render thread again, before looking at the queues so nothing gets missed
+    notificationPending = false;
+    for (std::unique_ptr<Worker>& worker : workers) {
+        if (worker->results.pop(glyph)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool GlyphRasterizer::pollMetrics(GlyphMeasurement& measurement) {
+    notificationPending = false;
+    for (std::unique_ptr<Worker>& worker : workers) {
+        if (worker->measurements.pop(measurement)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void GlyphRasterizer::notifyGlyphsReady() {
+    // one wake up is enough until the render thread polls again
+    if (!notificationPending.exchange(true) && _onGlyphsReady) {
+        _onGlyphsReady();
+    }
+}
+
+GlyphRasterizer::Worker::Worker(GlyphRasterizer* owner) : results(1024), measurements(1024) {
+    this->owner = owner;
+    this->face = nullptr;
+    this->faceFontSize = 0;
+}
+
+GlyphRasterizer::Worker::~Worker() {
+    if (face) {
+        owner->_fontRegistry->destroyPrivateFace(face);
+    }
+}
+
+bool GlyphRasterizer::Worker::loadFace(const std::string& fontPath, float fontSize) {
+    if (face == nullptr || fontPath != faceFontPath) {
+        if (face) {
+            owner->_fontRegistry->destroyPrivateFace(face);
+        }
+        // every worker needs its own face, they all read the font from the same mapping
+        face = owner->_fontRegistry->createPrivateFace(fontPath);
+        if (face == nullptr) {
+            owner->consoleLogger->error("Could not load " + fontPath + " for rasterizing glyphs in the background");
+            return false;
+        }
+        faceFontPath = fontPath;
+        faceFontSize = 0;
+    }
+    if (fontSize != faceFontSize) {
+        FT_Set_Pixel_Sizes(face, 0, fontSize);
+        faceFontSize = fontSize;
+    }
+    return true;
+}
+
+void GlyphRasterizer::Worker::run() {
+    while (!owner->stopping) {
+        Poco::AutoPtr<Poco::Notification> notification(owner->requests.waitDequeueNotification());
+        if (notification.isNull()) {
+            continue;
+        }
+        if (dynamic_cast<StopRequest*>(notification.get()) != nullptr) {
+            return;
+        }
+        MetricsRequest* metricsRequest = dynamic_cast<MetricsRequest*>(notification.get());
+        if (metricsRequest != nullptr) {
+            if (owner->isBatchActive(metricsRequest->batch)) {
+                measure(*metricsRequest);
+            }
+            continue;
+        }
+        GlyphRequest* glyphRequest = dynamic_cast<GlyphRequest*>(notification.get());
+        if (glyphRequest == nullptr || !owner->isBatchActive(glyphRequest->batch)) {
+            continue;
+        }
+
+        GlyphBitmap glyph;
+        GlyphDiskCache* diskCache = owner->_diskCache;
+        if (diskCache && diskCache->lookup(glyphRequest->fontPath, glyphRequest->fontSize, glyphRequest->charCode, glyph)) {
+            // rendered by an earlier run, no FreeType needed
+        } else if (loadFace(glyphRequest->fontPath, glyphRequest->fontSize) && rasterize(face, glyphRequest->charCode, glyph)) {
+            glyph.inFont = FT_Get_Char_Index(face, glyphRequest->charCode) != 0;
+            if (diskCache) {
+                diskCache->store(glyphRequest->fontPath, glyphRequest->fontSize, glyph);
+            }
+        } else {
+            // still answer the request, so the owner doesn't wait for it forever
+            glyph = { glyphRequest->charCode, 0, 0, 0, 0, 0, 0, {} };
+            glyph.inFont = false;
+        }
+        glyph.batch = glyphRequest->batch;
+
+        // the render thread drains the queue every frame, only wait if it is really behind
+        while (!results.push(std::move(glyph))) {
+            if (owner->stopping) {
+                return;
+            }
+            owner->notifyGlyphsReady();
+            Poco::Thread::sleep(1);
+        }
+        owner->notifyGlyphsReady();
+
+        // write the new glyphs once a burst of requests is done, not after every glyph
+        if (diskCache && owner->requests.empty()) {
+            diskCache->flush();
+        }
+    }
+}
+
+void GlyphRasterizer::Worker::measure(const MetricsRequest& request) {
+    // size by size, so the face only changes its size once per size
+    for (float fontSize : request.fontSizes) {
+        bool hasFace = loadFace(request.fontPath, fontSize);
+        for (int charCode : request.charCodes) {
+            // only load the outline, measuring doesn't need a bitmap
+            GlyphMeasurement measurement = { charCode, fontSize, 0, 0, 0, request.batch };
+            if (hasFace && !FT_Load_Glyph(face, FT_Get_Char_Index(face, charCode), FT_LOAD_DEFAULT)) {
+                FT_Glyph_Metrics& glyphMetrics = face->glyph->metrics;
+                measurement.advance = (int) (face->glyph->advance.x >> 6);
+                measurement.ascent = (int) (glyphMetrics.horiBearingY >> 6);
+                measurement.descent = (int) (glyphMetrics.height >> 6) - measurement.ascent;
+            }
+
+            // a failed glyph is still answered (with zeros), so the owner doesn't wait for it forever
+            while (!measurements.push(measurement)) {
+                if (owner->stopping) {
+                    return;
+                }
+                owner->notifyGlyphsReady();
+                Poco::Thread::sleep(1);
+            }
+        }
+    }
+    owner->notifyGlyphsReady();
+}
+
+bool GlyphRasterizer::rasterize(FT_Face face, int charCode, GlyphBitmap& glyph) {
+    unsigned int glyphIndex = FT_Get_Char_Index(face, charCode);
+    if (FT_Load_Glyph(face, glyphIndex, FT_LOAD_DEFAULT) || FT_Render_Glyph(face->glyph, FT_RENDER_MODE_NORMAL)) {
+        return false;
+    }
+
+    FT_Bitmap& bitmap = face->glyph->bitmap;
+    glyph.charCode = charCode;
+    glyph.width = bitmap.width;
+    glyph.rows = bitmap.rows;
+    glyph.left = face->glyph->bitmap_left;
+    glyph.top = face->glyph->bitmap_top;
+    glyph.advance = face->glyph->advance.x;
+    glyph.height = face->glyph->metrics.height;
+
+    // copy row by row, the pitch of the FreeType bitmap can be bigger than its width
+    glyph.pixels.resize(glyph.width * glyph.rows);
+    for (int row = 0; row < glyph.rows; row++) {
+        std::memcpy(glyph.pixels.data() + row * glyph.width, bitmap.buffer + row * bitmap.pitch, glyph.width);
+    }
+
+    return true;
+}
+
+std::vector<int> GlyphRasterizer::parseCodePointRanges(const std::string& ranges) {
+    std::vector<int> codePoints;
+    StringTokenizer tokenizer(ranges, ",", StringTokenizer::TOK_TRIM | StringTokenizer::TOK_IGNORE_EMPTY);
+    for (const std::string& range : tokenizer) {
+        std::string::size_type dash = range.find('-');
+        std::string first = range.substr(0, dash);
+        std::string last = dash == std::string::npos ? first : range.substr(dash + 1);
+
+        // base 0 accepts both 0x0400 and 1024
+        long firstCodePoint = std::strtol(first.c_str(), nullptr, 0);
+        long lastCodePoint = std::strtol(last.c_str(), nullptr, 0);
+        for (long codePoint = firstCodePoint; codePoint <= lastCodePoint && codePoint <= 0x10FFFF; codePoint++) {
+            codePoints.push_back((int) codePoint);
+        }
+    }
+    return codePoints;
+}
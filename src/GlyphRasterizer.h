@@ -0,0 +1,136 @@
+#pragma once
+#include <ft2build.h>
+#include FT_FREETYPE_H
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "Poco/Logger.h"
+#include "Poco/Mutex.h"
+#include "Poco/Notification.h"
+#include "Poco/NotificationQueue.h"
+#include "Poco/Runnable.h"
+#include "Poco/Thread.h"
+#include "SPSCQueue.h"
+
+using Poco::Logger;
+using Poco::Mutex;
+
+class GlyphDiskCache;
+class FontRegistry;
+
+// A rendered glyph that isn't uploaded to OpenGL yet
+struct GlyphBitmap {
+    int charCode;
+    int width;
+    int rows;
+    int left;
+    int top;
+    long advance;   // 26.6 fixed point, like FreeType gives it
+    long height;    // 26.6 fixed point
+    std::vector<unsigned char> pixels;
+    unsigned int batch = 0;     // the request batch the glyph was rasterized for
+    bool inFont = true;         // false if the font doesn't have the glyph (it is the .notdef box then) or rasterizing failed
+};
+
+// What the layout needs to know about a glyph at one size, measured without rendering it
+struct GlyphMeasurement {
+    int charCode;
+    float fontSize;
+    int advance;
+    int ascent;
+    int descent;
+    unsigned int batch = 0;
+};
+
+// Pool of worker threads rasterizing glyphs with FreeType, every worker has its own FT_Face.
+// Requests are tagged with a batch, the owner decides which batches are still wanted, the others are skipped.
+// Finished glyphs go into one lock-free queue per worker, the render thread drains them with poll()
+// and only has to upload them to OpenGL.
+class GlyphRasterizer {
+public:
+    GlyphRasterizer(Logger* logger, FontRegistry* fontRegistry);
+    ~GlyphRasterizer();
+
+    // Number of worker threads, takes effect when the workers are started by the first request
+    void setNumberOfWorkers(int numberOfWorkers);
+    // Called from a worker thread when glyphs are waiting to be polled
+    void setOnGlyphsReady(std::function<void()> onGlyphsReady);
+    // Glyphs found in the disk cache skip FreeType, set it before the first request
+    void setDiskCache(GlyphDiskCache* diskCache);
+
+    // Urgent requests are rasterized before all the normal ones waiting in the queue
+    void request(const std::string& fontPath, float fontSize, int charCode, unsigned int batch, bool urgent = false);
+    // Measures every code point at every size, ahead of the glyph requests
+    void requestMetrics(const std::string& fontPath, const std::vector<float>& fontSizes, const std::vector<int>& charCodes, unsigned int batch);
+    // Requests of other batches still in the queue are dropped by the workers
+    void setActiveBatches(unsigned int lazyBatch, unsigned int prewarmBatch);
+    void setActiveMetricsBatch(unsigned int metricsBatch);
+    // Render thread only
+    bool poll(GlyphBitmap& glyph);
+    bool pollMetrics(GlyphMeasurement& measurement);
+
+    static bool rasterize(FT_Face face, int charCode, GlyphBitmap& glyph);
+    // Parses ranges like "0x20-0x7E, 0xA0-0xFF, 0x2026" into the list of code points they cover
+    static std::vector<int> parseCodePointRanges(const std::string& ranges);
+
+private:
+    class GlyphRequest : public Poco::Notification {
+    public:
+        GlyphRequest(const std::string& fontPath, float fontSize, int charCode, unsigned int batch) :
+            fontPath(fontPath), fontSize(fontSize), charCode(charCode), batch(batch) {}
+        std::string fontPath;
+        float fontSize;
+        int charCode;
+        unsigned int batch;
+    };
+
+    class MetricsRequest : public Poco::Notification {
+    public:
+        MetricsRequest(const std::string& fontPath, const std::vector<float>& fontSizes, const std::vector<int>& charCodes, unsigned int batch) :
+            fontPath(fontPath), fontSizes(fontSizes), charCodes(charCodes), batch(batch) {}
+        std::string fontPath;
+        std::vector<float> fontSizes;
+        std::vector<int> charCodes;
+        unsigned int batch;
+    };
+
+    // ends the worker that dequeues it
+    class StopRequest : public Poco::Notification {
+    };
+
+    class Worker : public Poco::Runnable {
+    public:
+        Worker(GlyphRasterizer* owner);
+        ~Worker();
+        void run();
+        SPSCQueue<GlyphBitmap> results;
+        SPSCQueue<GlyphMeasurement> measurements;
+    private:
+        GlyphRasterizer* owner;
+        FT_Face face;
+        std::string faceFontPath;
+        float faceFontSize;
+        bool loadFace(const std::string& fontPath, float fontSize);
+        void measure(const MetricsRequest& request);
+    };
+
+    Logger* consoleLogger;
+    FontRegistry* _fontRegistry;
+    int _numberOfWorkers;
+    std::function<void()> _onGlyphsReady;
+    GlyphDiskCache* _diskCache;
+    Poco::NotificationQueue requests;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::unique_ptr<Poco::Thread>> threads;
+    std::atomic<bool> stopping;
+    std::atomic<bool> notificationPending;
+    std::atomic<unsigned int> activeLazyBatch;
+    std::atomic<unsigned int> activePrewarmBatch;
+    std::atomic<unsigned int> activeMetricsBatch;
+
+    void startWorkers();
+    bool isBatchActive(unsigned int batch);
+    void notifyGlyphsReady();
+};
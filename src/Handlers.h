@@ -52,7 +52,7 @@ bool getColor(Object::Ptr jsonObject, std::string key, WebSocket ws, Logger* con
 		error = errorMessage;
 	}
 	if (!error.empty()) {
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 		return false;
 	}
 	try {
@@ -63,7 +63,7 @@ bool getColor(Object::Ptr jsonObject, std::string key, WebSocket ws, Logger* con
 	}
 	catch (Exception e) {
 		error = getErrorMessageJSONAsString(e.message(), "color_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 		return false;
 	}
 
@@ -72,7 +72,7 @@ bool getColor(Object::Ptr jsonObject, std::string key, WebSocket ws, Logger* con
 	}
 
 	if (!error.empty()) {
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 		return false;
 	}
 	
@@ -100,14 +100,15 @@ void handleText(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 			consoleLogger->debug("Here's your decoded text: {}", decoded);
 		}
 		textMutex.unlock();
+		requestRedraw();
 	}
 	catch (const Poco::InvalidArgumentException& e) {
 		std::string error = getErrorMessageJSONAsString("Invalid Base64 string", "text_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 	catch (const std::exception& e) {
 		std::string error = getErrorMessageJSONAsString("Something else happened: " + std::string(e.what()), "text_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 }
 
@@ -122,6 +123,7 @@ void handleFontColor(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger
 		textMutex.lock();
 		renderer->setColor(R, G, B, A);
 		textMutex.unlock();
+		requestRedraw();
 		consoleLogger->information("Here's your color: R: " + std::to_string(R) + ", G:" + std::to_string(G) + ", B: " + std::to_string(B) + ", A:" + std::to_string(A));
 	}
 }
@@ -135,9 +137,10 @@ void handleFontSize(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger)
 		textMutex.lock();
 		renderer->setFontSize(fontSizeValue);
 		textMutex.unlock();
+		requestRedraw();
 	} else {
 		std::string error = getErrorMessageJSONAsString("Error: could not set font size to: " + std::to_string(fontSizeValue), "font_size_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 }
 
@@ -162,15 +165,16 @@ void handleFont(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 				file.close();
 				
 				renderer->setFont(fontFullPath);
+				requestRedraw();
 			}
 			else {
 				std::string error = getErrorMessageJSONAsString("Error file " + fontFullPath + " not found", "font_error");
-				ws.sendFrame(error.c_str(), error.length());
+				sendToClient(ws, error);
 			}
 		}
 		catch (Exception e) {
 			std::string error = getErrorMessageJSONAsString(e.message(), "font_error");
-			ws.sendFrame(error.c_str(), error.length());
+			sendToClient(ws, error);
 		}
 	}
 	textMutex.unlock();
@@ -183,7 +187,7 @@ void handleStream(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 	if (shouldStream && !isServerRunning) {
 		// start the server
 
-		screenStreamerTask = new ScreenStreamerTask(&streamingServerMutex, consoleLogger, 0, 0);
+		screenStreamerTask = new ScreenStreamerTask(&streamingServerMutex, consoleLogger, &frameCapture, streamProfile, recordingSettings, 0, 0);
 		taskManager->start(screenStreamerTask);
 
 		isServerRunning = true;
@@ -207,7 +211,7 @@ void handleStream(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 		} else {
 			error = getErrorMessageJSONAsString("Error: could not stop the streaming server, probably it's already stopped", "stream_error");
 		}
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 }
 
@@ -252,7 +256,7 @@ void handlePing(Object::Ptr jsonObject, WebSocket& ws, Logger* consoleLogger) {
 				std::ostringstream oss;
 				Poco::JSON::Stringifier::stringify(*pingResponseJSON, oss);
 				std::string pingResponseString = oss.str();
-				ws.sendFrame(pingResponseString.c_str(), pingResponseString.length());
+				sendToClient(ws, pingResponseString);
 				return;
 			}
 		}
@@ -264,40 +268,64 @@ void handlePing(Object::Ptr jsonObject, WebSocket& ws, Logger* consoleLogger) {
 		sessionTokenMutex.unlock();
 
 		std::string errorMessage = getErrorMessageJSONAsString("Error: session expired", "session_error");
-		ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+		sendToClient(ws, errorMessage);
 
 	}
 	else {
 		std::string errorMessage = getErrorMessageJSONAsString("Error: user not logged in", "session_error");
-		ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+		sendToClient(ws, errorMessage);
 	}
 }
 
+// count, mean and max in microseconds and the non-empty buckets, keyed by their upper limit ("<1024us")
+Object::Ptr latencyHistogramToJSON(const LatencyHistogram& histogram) {
+	Object::Ptr histogramJSON = new Object;
+	histogramJSON->set("count", histogram.getCount());
+	histogramJSON->set("mean_us", histogram.getMeanMicroseconds());
+	histogramJSON->set("max_us", histogram.getMaximumMicroseconds());
+
+	Object::Ptr bucketsJSON = new Object;
+	for (int i = 0; i < LatencyHistogram::numberOfBuckets; i++) {
+		unsigned long long bucket = histogram.getBucket(i);
+		if (bucket == 0) {
+			continue;
+		}
+		if (i == LatencyHistogram::numberOfBuckets - 1) {
+			bucketsJSON->set(">=" + std::to_string(LatencyHistogram::getBucketLimit(i - 1)) + "us", bucket);
+		} else {
+			bucketsJSON->set("<" + std::to_string(LatencyHistogram::getBucketLimit(i)) + "us", bucket);
+		}
+	}
+	histogramJSON->set("buckets", bucketsJSON);
+	return histogramJSON;
+}
+
 void handleGet(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 	std::string what = jsonObject->getValue<std::string>("get");
 	consoleLogger->information("Getting: " + what);
 	if (what == "stream") {
 		streamingServerMutex.lock();
-		std::string isStreamingJSON = "{\"isStreaming\":";
 		if (isServerRunning) {
 			streamingServerMutex.unlock();
-			Event waitForOfferEvent;
-			screenStreamerTask->registerReceiver(ws, &waitForOfferEvent);
-			waitForOfferEvent.wait();
-			isStreamingJSON += "true, \"offer\": ";
-			isStreamingJSON += screenStreamerTask->getOffer(ws);
+			// the offer is sent when the ICE candidates are gathered, the thread of the request doesn't wait for it
+			screenStreamerTask->registerReceiver(ws, [ws, consoleLogger](const std::string& offer) {
+				std::string offerJSON = "{\"isStreaming\":true, \"offer\": " + offer + "}";
+				try {
+					sendToClient(ws, offerJSON);
+				} catch (Exception& e) {
+					consoleLogger->warning("Could not send the offer, the receiver left: " + e.displayText());
+				}
+			});
 		} else {
 			streamingServerMutex.unlock();
-			isStreamingJSON += "false";
+			std::string isStreamingJSON = "{\"isStreaming\":false}";
+			sendToClient(ws, isStreamingJSON);
 		}
-		isStreamingJSON += "}";
-
-		ws.sendFrame(isStreamingJSON.c_str(), isStreamingJSON.length());
 	} else if (what == "ping") {
 		handlePing(jsonObject, ws, consoleLogger);
 	} else if (what == "monitors") {
 		monitorInfo.monitorMutex.lock();
-		ws.sendFrame(monitorInfo.monitorJSONAsString.c_str(), monitorInfo.monitorJSONAsString.length());
+		sendToClient(ws, monitorInfo.monitorJSONAsString);
 		monitorInfo.monitorMutex.unlock();
 	} else if (what == "screen_size") {
 		monitorInfo.monitorMutex.lock();
@@ -312,12 +340,127 @@ void handleGet(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger) {
 
 		std::string screenSizeJSONAsString = oss.str();
 
-		ws.sendFrame(screenSizeJSONAsString.c_str(), screenSizeJSONAsString.length());
+		sendToClient(ws, screenSizeJSONAsString);
 
 		monitorInfo.monitorMutex.unlock();
+	} else if (what == "render_stats") {
+		Object::Ptr renderStatsJSON = new Object;
+		renderStatsJSON->set("frames_rendered", renderStats.framesRendered.load());
+		renderStatsJSON->set("frames_skipped", renderStats.framesSkipped.load());
+		renderStatsJSON->set("idle_wakeups", renderStats.idleWakeups.load());
+
+		std::ostringstream oss;
+		Poco::JSON::Stringifier::stringify(*renderStatsJSON, oss);
+
+		std::string renderStatsJSONAsString = oss.str();
+
+		sendToClient(ws, renderStatsJSONAsString);
+	} else if (what == "stream_stats") {
+		Object::Ptr streamStatsJSON = new Object;
+		streamingServerMutex.lock();
+		streamStatsJSON->set("isStreaming", isServerRunning);
+		if (isServerRunning) {
+			const StreamStats& streamStats = screenStreamerTask->getStats();
+			streamStatsJSON->set("frames_encoded", streamStats.framesEncoded.load());
+			streamStatsJSON->set("frames_suppressed", streamStats.framesSuppressed.load());
+			streamStatsJSON->set("keyframes_forced", streamStats.keyframesForced.load());
+			streamStatsJSON->set("keyframe_requests", streamStats.keyframeRequests.load());
+			streamStatsJSON->set("cache_joins", streamStats.cacheJoins.load());
+			streamStatsJSON->set("frame_allocations", streamStats.allocations.frameAllocations.load());
+			streamStatsJSON->set("frame_buffer_allocations", streamStats.allocations.frameBufferAllocations.load());
+			streamStatsJSON->set("packet_allocations", streamStats.allocations.packetAllocations.load());
+			streamStatsJSON->set("packet_payload_allocations", streamStats.allocations.packetPayloadAllocations.load());
+			streamStatsJSON->set("packet_reference_allocations", streamStats.allocations.packetReferenceAllocations.load());
+			streamStatsJSON->set("frames_dropped", streamStats.framesDropped.load());
+			streamStatsJSON->set("frames_deferred", streamStats.framesDeferred.load());
+			streamStatsJSON->set("pixels_converted", streamStats.pixelsConverted.load());
+
+			Object::Ptr latencyJSON = new Object;
+			latencyJSON->set("capture", latencyHistogramToJSON(streamStats.captureLatency));
+			latencyJSON->set("convert", latencyHistogramToJSON(streamStats.convertLatency));
+			latencyJSON->set("encode", latencyHistogramToJSON(streamStats.encodeLatency));
+			latencyJSON->set("send", latencyHistogramToJSON(streamStats.sendLatency));
+			latencyJSON->set("end_to_end", latencyHistogramToJSON(streamStats.endToEndLatency));
+			latencyJSON->set("cold_start", latencyHistogramToJSON(streamStats.coldStartLatency));
+			latencyJSON->set("warm_start", latencyHistogramToJSON(streamStats.warmStartLatency));
+			streamStatsJSON->set("latency", latencyJSON);
+
+			Poco::JSON::Array::Ptr receiversJSON = new Poco::JSON::Array;
+			for (const ReceiverStats& receiverStats : screenStreamerTask->getReceiverStats()) {
+				Object::Ptr receiverJSON = new Object;
+				receiverJSON->set("id", receiverStats.id);
+				receiverJSON->set("codec", receiverStats.codec);
+				receiverJSON->set("connected", receiverStats.isConnected);
+				receiverJSON->set("buffered_bytes", receiverStats.bufferedBytes);
+				receiverJSON->set("packets_sent", receiverStats.packetsSent);
+				receiverJSON->set("packets_dropped", receiverStats.packetsDropped);
+				receiverJSON->set("keyframe_waits", receiverStats.keyframeWaits);
+				receiverJSON->set("layer", receiverStats.layer);
+				receiverJSON->set("bandwidth_estimate_kbps", receiverStats.bandwidthEstimateKbps);
+				receiversJSON->add(receiverJSON);
+			}
+			streamStatsJSON->set("receivers", receiversJSON);
+
+			RecordingStats recordingStats = screenStreamerTask->getRecordingStats();
+			Object::Ptr recordingJSON = new Object;
+			recordingJSON->set("recording", recordingStats.isRecording);
+			recordingJSON->set("file", recordingStats.file);
+			recordingJSON->set("segments", recordingStats.segments);
+			recordingJSON->set("bytes_written", recordingStats.bytesWritten);
+			recordingJSON->set("packets_dropped", recordingStats.packetsDropped);
+			streamStatsJSON->set("recording", recordingJSON);
+		}
+		streamingServerMutex.unlock();
+
+		std::ostringstream oss;
+		Poco::JSON::Stringifier::stringify(*streamStatsJSON, oss);
+
+		std::string streamStatsJSONAsString = oss.str();
+
+		sendToClient(ws, streamStatsJSONAsString);
+	} else if (what == "fonts") {
+		Poco::JSON::Array::Ptr fontsJSON = new Poco::JSON::Array;
+		for (const FontRegistry::FontInfo& font : fontRegistry->getLoadedFonts()) {
+			Object::Ptr fontJSON = new Object;
+			fontJSON->set("path", font.path);
+			fontJSON->set("file_size", font.fileSize);
+			fontJSON->set("resident_bytes", font.residentBytes);
+			fontJSON->set("shared_face_references", font.sharedFaceReferences);
+			fontJSON->set("private_faces", font.privateFaces);
+			fontsJSON->add(fontJSON);
+		}
+		Object::Ptr fontsResponseJSON = new Object;
+		fontsResponseJSON->set("fonts", fontsJSON);
+
+		std::ostringstream oss;
+		Poco::JSON::Stringifier::stringify(*fontsResponseJSON, oss);
+
+		std::string fontsJSONAsString = oss.str();
+
+		sendToClient(ws, fontsJSONAsString);
+	} else if (what == "stream_profile") {
+		Object::Ptr streamProfileJSON = new Object;
+		streamingServerMutex.lock();
+		streamProfileJSON->set("name", streamProfile.name);
+		streamProfileJSON->set("width", streamProfile.width);
+		streamProfileJSON->set("height", streamProfile.height);
+		streamProfileJSON->set("fps", streamProfile.fps);
+		streamProfileJSON->set("bitrate_kbps", streamProfile.bitrateKbps);
+		streamProfileJSON->set("keyframe_interval_s", streamProfile.keyframeIntervalS);
+		streamProfileJSON->set("speed", streamProfile.speed);
+		streamProfileJSON->set("codecs", VideoEncoder::codecListToString(streamProfile.codecs));
+		streamProfileJSON->set("layers", streamProfile.layers);
+		streamingServerMutex.unlock();
+
+		std::ostringstream oss;
+		Poco::JSON::Stringifier::stringify(*streamProfileJSON, oss);
+
+		std::string streamProfileJSONAsString = oss.str();
+
+		sendToClient(ws, streamProfileJSONAsString);
 	} else {
 		std::string error = getErrorMessageJSONAsString("get command not supported: " + what, "get_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 	consoleLogger->information("Done getting");
 }
@@ -369,32 +512,33 @@ inline void handleSet(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogge
 								renderer->setBoxPosition(x, y);
 
 								textMutex.unlock();
+								requestRedraw();
 
 								std::string confirmation = getConfirmationForSetCommand("box_position");
-								ws.sendFrame(confirmation.c_str(), confirmation.length());
+								sendToClient(ws, confirmation);
 							} else {
 								error = getErrorMessageJSONAsString("Box index " + std::to_string(index) + " not found", "set_error");
-								ws.sendFrame(error.c_str(), error.length());
+								sendToClient(ws, error);
 							}
 						} else {
 							error = getErrorMessageJSONAsString("x or y is invalid", "set_error");
-							ws.sendFrame(error.c_str(), error.length());
+							sendToClient(ws, error);
 						}
 					} catch (Exception e) {
 						error = getErrorMessageJSONAsString(e.message(), "set_error");
-						ws.sendFrame(error.c_str(), error.length());
+						sendToClient(ws, error);
 					}
 				} else {
 					error = getErrorMessageJSONAsString("To set box_position, you need to specify a box index", "set_error");
-					ws.sendFrame(error.c_str(), error.length());
+					sendToClient(ws, error);
 				}
 			} else {
 				error = getErrorMessageJSONAsString("box_position needs to have 2 values: x and y", "set_error");
-				ws.sendFrame(error.c_str(), error.length());
+				sendToClient(ws, error);
 			}
 		} else {
 			error = getErrorMessageJSONAsString("In order to set box position you must give the box_position", "set_error");
-			ws.sendFrame(error.c_str(), error.length());
+			sendToClient(ws, error);
 		}
 	} else if (what == "box_size") {
 		std::string error;
@@ -412,33 +556,85 @@ inline void handleSet(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogge
 								textMutex.lock();
 								renderers.at(index)->setBoxSize(width, height);
 								textMutex.unlock();
+								requestRedraw();
 
 								std::string confirmation = getConfirmationForSetCommand("box_size");
-								ws.sendFrame(confirmation.c_str(), confirmation.length());
+								sendToClient(ws, confirmation);
 							} else {
 								error = getErrorMessageJSONAsString("Box index " + std::to_string(index) + " not found", "set_error");
-								ws.sendFrame(error.c_str(), error.length());
+								sendToClient(ws, error);
 							}
 						} else {
 							error = getErrorMessageJSONAsString("width or height is invalid", "set_error");
-							ws.sendFrame(error.c_str(), error.length());
+							sendToClient(ws, error);
 						}
 					} catch (Exception e) {
 						error = getErrorMessageJSONAsString(e.message(), "set_error");
-						ws.sendFrame(error.c_str(), error.length());
+						sendToClient(ws, error);
 					}
 				} else {
 					error = getErrorMessageJSONAsString("To set box size, you need to specify the index", "set_error");
-					ws.sendFrame(error.c_str(), error.length());
+					sendToClient(ws, error);
 				}
 			} else {
 				error = getErrorMessageJSONAsString("To set box size you need to specify the width and the height", "set_error");
-				ws.sendFrame(error.c_str(), error.length());
+				sendToClient(ws, error);
 			}
 		}
+	} else if (what == "stream_profile") {
+		std::string error;
+		if (jsonObject->isObject("stream_profile")) {
+			try {
+				Object::Ptr streamProfileJSON = jsonObject->getObject("stream_profile");
+				streamingServerMutex.lock();
+				StreamProfile profile = streamProfile;
+				streamingServerMutex.unlock();
+
+				// a profile from the properties, the values given with it override the ones of the profile
+				bool isValid = true;
+				if (streamProfileJSON->has("name")) {
+					isValid = loadStreamProfile(*pConf, streamProfileJSON->getValue<std::string>("name"), profile, error);
+				}
+				if (isValid && (streamProfileJSON->has("width") || streamProfileJSON->has("height") || streamProfileJSON->has("fps") ||
+					streamProfileJSON->has("bitrate_kbps") || streamProfileJSON->has("keyframe_interval_s") || streamProfileJSON->has("speed") ||
+					streamProfileJSON->has("codecs") || streamProfileJSON->has("layers"))) {
+					profile.name = "custom";
+					profile.width = streamProfileJSON->optValue<int>("width", profile.width);
+					profile.height = streamProfileJSON->optValue<int>("height", profile.height);
+					profile.fps = streamProfileJSON->optValue<int>("fps", profile.fps);
+					profile.bitrateKbps = streamProfileJSON->optValue<int>("bitrate_kbps", profile.bitrateKbps);
+					profile.keyframeIntervalS = streamProfileJSON->optValue<int>("keyframe_interval_s", profile.keyframeIntervalS);
+					profile.speed = streamProfileJSON->optValue<int>("speed", profile.speed);
+					profile.layers = streamProfileJSON->optValue<int>("layers", profile.layers);
+					if (streamProfileJSON->has("codecs")) {
+						profile.codecs = VideoEncoder::parseCodecList(streamProfileJSON->getValue<std::string>("codecs"));
+					}
+					isValid = validateStreamProfile(profile, error);
+				}
+
+				if (isValid) {
+					// a running stream keeps its encoder, the profile is used when the stream starts the next time
+					streamingServerMutex.lock();
+					streamProfile = profile;
+					streamingServerMutex.unlock();
+
+					std::string confirmation = getConfirmationForSetCommand("stream_profile");
+					sendToClient(ws, confirmation);
+				} else {
+					error = getErrorMessageJSONAsString(error, "set_error");
+					sendToClient(ws, error);
+				}
+			} catch (Exception e) {
+				error = getErrorMessageJSONAsString(e.message(), "set_error");
+				sendToClient(ws, error);
+			}
+		} else {
+			error = getErrorMessageJSONAsString("In order to set the stream profile you must give the stream_profile as an object", "set_error");
+			sendToClient(ws, error);
+		}
 	} else {
 		std::string error = getErrorMessageJSONAsString("set command not supported: " + what, "set_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 	consoleLogger->information("Done setting");
 }
@@ -456,6 +652,7 @@ void handleBGColor(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger)
 		backgroundColorB = B;
 		backgroundColorA = A;
 		textMutex.unlock();
+		requestRedraw();
 		consoleLogger->information("Here's your color: R: " + std::to_string(R) + ", G:" + std::to_string(G) + ", B: " + std::to_string(B) + ", A:" + std::to_string(A));
 	}
 }
@@ -468,10 +665,11 @@ void handleMonitor(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLogger)
 	if (monitorIndex != monitorInfo.monitorIndex && monitorIndex >= 0 && monitorIndex < monitorInfo.monitorCount) {
 		monitorInfo.monitorIndex = monitorIndex;
 		monitorInfo.hasChanged = true;
+		requestRedraw();
 	} else if(monitorIndex < 0 || monitorIndex >= monitorInfo.monitorCount) {
 		int monitorMaxIndex = monitorInfo.monitorCount - 1;
 		std::string error = getErrorMessageJSONAsString("Monitor index out of range. Values must be between 0 and " + std::to_string(monitorMaxIndex), "monitor_error");
-		ws.sendFrame(error.c_str(), error.length());
+		sendToClient(ws, error);
 	}
 
 	monitorInfo.monitorMutex.unlock();
@@ -591,11 +789,11 @@ void handleAuthentication(Object::Ptr jsonObject, WebSocket ws, Logger* consoleL
 					sessionTokenMutex.unlock();
 
 					std::string successMessage = "{\"message\": \"Succesfully logged in\", \"session_token\": \"" + sessionToken.toString() + "\"}";
-					ws.sendFrame(successMessage.c_str(), successMessage.length());
+					sendToClient(ws, successMessage);
 				}
 				else {
 					std::string errorMessage = getErrorMessageJSONAsString("ERROR: wrong password", "auth_error");
-					ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+					sendToClient(ws, errorMessage);
 				}
 			} else {
 				std::string message = "ERROR: Could not find user";
@@ -603,17 +801,17 @@ void handleAuthentication(Object::Ptr jsonObject, WebSocket ws, Logger* consoleL
 					message += "; " + error;
 				}
 				std::string errorMessage = getErrorMessageJSONAsString(message, "auth_error");
-				ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+				sendToClient(ws, errorMessage);
 			}
 		}
 		else {
 			std::string errorMessage = getErrorMessageJSONAsString("ERROR: user or password empty or too long", "auth_error");
-			ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+			sendToClient(ws, errorMessage);
 		}
 	}
 	else {
 		std::string errorMessage = getErrorMessageJSONAsString("ERROR: missing either user or password", "auth_error");
-		ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+		sendToClient(ws, errorMessage);
 	}
 }
 
@@ -641,28 +839,28 @@ void handleRegistration(Object::Ptr jsonObject, WebSocket ws, Logger* consoleLog
 					insert << "INSERT INTO User(Username, PasswordHash, PasswordSalt, IsAdmin) VALUES(? , ? , ? , 0 )", use(user), use(hashedPassword), use(salt);
 					insert.execute();
 					std::string successMessage = "{\"message\":\"Successfully added user: " + user + "\"}";
-					ws.sendFrame(successMessage.c_str(), successMessage.length());
+					sendToClient(ws, successMessage);
 				}
 				else {
 					std::string error = getErrorMessageJSONAsString("ERROR: User already exists", "registration_error");
-					ws.sendFrame(error.c_str(), error.length());
+					sendToClient(ws, error);
 				}
 
 			}
 			catch (const Poco::Exception& ex) {
 				std::string error = getErrorMessageJSONAsString("SQL Error: " + ex.displayText(), "registration_error");
-				ws.sendFrame(error.c_str(), error.length());
+				sendToClient(ws, error);
 			}
 
 		}
 		else {
 			std::string errorMessage = getErrorMessageJSONAsString("ERROR: missing either user or password", "registration_error");
-			ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+			sendToClient(ws, errorMessage);
 		}
 	}
 	else {
 		std::string errorMessage = getErrorMessageJSONAsString("ERROR: Registrations are closed", "registration_error");
-		ws.sendFrame(errorMessage.c_str(), errorMessage.length());
+		sendToClient(ws, errorMessage);
 	}
 }
 
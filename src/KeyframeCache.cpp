@@ -0,0 +1,49 @@
+#include "KeyframeCache.h"
+#include <cstring>
+
+KeyframeCache::KeyframeCache(int numberOfPackets, size_t maximumBytes, int maximumPacketSize) : buffers(numberOfPackets) {
+	this->maximumBytes = maximumBytes;
+	for (std::vector<std::byte>& buffer : buffers) {
+		// the RTP muxer never writes more than its max_packet_size
+		buffer.reserve(maximumPacketSize);
+	}
+}
+
+void KeyframeCache::add(const uint8_t* data, int size, bool isKeyframeStart) {
+	if (isKeyframeStart) {
+		numberOfPackets = 0;
+		bytes = 0;
+		isValid = true;
+	}
+	if (!isValid) {
+		return;
+	}
+	if (numberOfPackets == (int) buffers.size() || bytes + size > maximumBytes) {
+		// a receiver couldn't decode the packets after a gap, wait for the next keyframe
+		clear();
+		return;
+	}
+
+	std::vector<std::byte>& buffer = buffers[numberOfPackets++];
+	buffer.resize(size);
+	std::memcpy(buffer.data(), data, size);
+	bytes += size;
+}
+
+void KeyframeCache::clear() {
+	isValid = false;
+	numberOfPackets = 0;
+	bytes = 0;
+}
+
+bool KeyframeCache::hasKeyframe() {
+	return isValid && numberOfPackets > 0;
+}
+
+int KeyframeCache::getNumberOfPackets() {
+	return numberOfPackets;
+}
+
+const std::vector<std::byte>& KeyframeCache::getPacket(int index) {
+	return buffers[index];
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// The RTP packets of one layer since its last keyframe, so a receiver that joins mid-stream can start decoding
+// right away instead of waiting for the next keyframe (with a static projector that is seconds away).
+// Only used by the sender thread of the pipeline. The packet buffers are allocated once up front.
+class KeyframeCache {
+public:
+	// maximumPacketSize: the max_packet_size of the RTP muxer
+	KeyframeCache(int numberOfPackets, size_t maximumBytes, int maximumPacketSize);
+
+	KeyframeCache(const KeyframeCache&) = delete;
+	KeyframeCache& operator=(const KeyframeCache&) = delete;
+
+	// isKeyframeStart: the first RTP packet of a keyframe, the packets before it are thrown away.
+	// A group of pictures that doesn't fit isn't cached until the next keyframe.
+	void add(const uint8_t* data, int size, bool isKeyframeStart);
+	// the packets are outdated, nothing is cached until the next keyframe
+	void clear();
+	// false while the cache doesn't start with a keyframe
+	bool hasKeyframe();
+	int getNumberOfPackets();
+	// the first one is the start of the keyframe
+	const std::vector<std::byte>& getPacket(int index);
+
+private:
+	std::vector<std::vector<std::byte>> buffers;
+	int numberOfPackets = 0;
+	size_t bytes = 0;
+	size_t maximumBytes;
+	bool isValid = false;
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+
+// Lock-free latency histogram with power of two buckets. Bucket i counts the latencies below
+// 2^(i + 6) microseconds (64 us, 128 us ... about 1 s), the last bucket everything slower.
+class LatencyHistogram {
+public:
+	static const int numberOfBuckets = 16;
+
+	void record(int64_t microseconds) {
+		if (microseconds < 0) {
+			microseconds = 0;
+		}
+		int bucket = 0;
+		while (bucket < numberOfBuckets - 1 && microseconds >= getBucketLimit(bucket)) {
+			bucket++;
+		}
+		buckets[bucket]++;
+		count++;
+		totalMicroseconds += (unsigned long long) microseconds;
+
+		unsigned long long currentMaximum = maximumMicroseconds.load();
+		while ((unsigned long long) microseconds > currentMaximum && !maximumMicroseconds.compare_exchange_weak(currentMaximum, (unsigned long long) microseconds)) {
+		}
+	}
+
+	// upper limit (exclusive) of the bucket in microseconds, the last bucket has none
+	static int64_t getBucketLimit(int bucket) {
+		return (int64_t) 1 << (bucket + 6);
+	}
+
+	unsigned long long getBucket(int bucket) const {
+		return buckets[bucket].load();
+	}
+
+	unsigned long long getCount() const {
+		return count.load();
+	}
+
+	unsigned long long getMeanMicroseconds() const {
+		unsigned long long samples = count.load();
+		return samples == 0 ? 0 : totalMicroseconds.load() / samples;
+	}
+
+	unsigned long long getMaximumMicroseconds() const {
+		return maximumMicroseconds.load();
+	}
+
+private:
+	std::atomic<unsigned long long> buckets[numberOfBuckets] = {};
+	std::atomic<unsigned long long> count{ 0 };
+	std::atomic<unsigned long long> totalMicroseconds{ 0 };
+	std::atomic<unsigned long long> maximumMicroseconds{ 0 };
+};
@@ -17,6 +17,7 @@
 #include "Poco/Message.h"
 #include "Poco/TaskManager.h"
 #include "TextBoxRenderer.h"
+#include "GlyphDiskCache.h"
 #include "Poco/Exception.h"
 #include "Poco/Net/NetworkInterface.h"
 #include "imgui/imgui.h"
@@ -38,15 +39,21 @@ Mutex clientSetMutex;
 Mutex streamingServerMutex;
 Poco::TaskManager* taskManager;
 ScreenStreamerTask* screenStreamerTask;
-std::set<WebSocket> clients;
+std::map<WebSocket, std::shared_ptr<Mutex>> clients;
 bool isServerRunning = false;
 std::map<int, TextBoxRenderer*> renderers;
+FontRegistry* fontRegistry;
 float backgroundColorR = 0.0f;
 float backgroundColorG = 0.0f;
 float backgroundColorB = 0.0f;
 float backgroundColorA = 0.0f;
 MonitorInfo monitorInfo;
 AutoPtr<PropertyFileConfiguration> pConf;
+std::atomic<unsigned long long> renderGeneration{ 1 };
+RenderStats renderStats;
+FrameCapture frameCapture;
+StreamProfile streamProfile;
+RecordingSettings recordingSettings;
 
 
 // Other variables for main
@@ -62,6 +69,7 @@ void monitor_callback(GLFWmonitor* monitor, int event);
 void setMonitorJSON();
 void createUIWindow(GLFWwindow*& uiWindow, GLFWmonitor* primaryMonitor, SimpleTextProjectorUI*& ui, std::string url, bool& shouldCloseUI, bool& isCheckBoxTicked);
 void uiWindowCloseCallback(GLFWwindow* uiWindow);
+void windowRefreshCallback(GLFWwindow* window);
 static void glfw_error_callback(int error, const char* description);
 
 int RealMain(int argc, char** argv);
@@ -205,6 +213,7 @@ int RealMain(int argc, char** argv) {
     currentWindowMonitor = glfwGetWindowMonitor(window);
 
     glfwMakeContextCurrent(window);
+    glfwSetWindowRefreshCallback(window, windowRefreshCallback);
 
     if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
     {
@@ -215,6 +224,10 @@ int RealMain(int argc, char** argv) {
 
     bool drawDebugLines = pConf->getBool("DrawDebugLines", false);
     float fontSizeDecreaseStep = pConf->getDouble("FontSizeDecreaseStep", 5.0);
+    // retained mode: only redraw the projector when something changed and sleep in between
+    bool retainedRendering = pConf->getBool("RetainedRendering", true);
+    double idleWaitTimeout = pConf->getDouble("RetainedRenderingIdleTimeoutS", 0.5);
+    double uiWaitTimeout = 1.0 / 60.0;
 
 
     // Initialize freetype
@@ -223,12 +236,33 @@ int RealMain(int argc, char** argv) {
         consoleLogger.error("FreeType init failed with error code: " + freeTypeError);
         exit(1);
     }
-    //TextBoxRenderer* renderer = new TextBoxRenderer(defaultWidth, defaultHeight, defaultWidth / 4, defaultHeight / 4, defaultWidth / 2, defaultHeight / 2, &consoleLogger, freeTypeLibrary);
-    TextBoxRenderer* renderer = new TextBoxRenderer(defaultWidth, defaultHeight, 0, 0, defaultWidth / 2, defaultHeight / 2, &consoleLogger, freeTypeLibrary);
+    fontRegistry = new FontRegistry(&consoleLogger, freeTypeLibrary);
+    //TextBoxRenderer* renderer = new TextBoxRenderer(defaultWidth, defaultHeight, defaultWidth / 4, defaultHeight / 4, defaultWidth / 2, defaultHeight / 2, &consoleLogger, fontRegistry);
+    TextBoxRenderer* renderer = new TextBoxRenderer(defaultWidth, defaultHeight, 0, 0, defaultWidth / 2, defaultHeight / 2, &consoleLogger, fontRegistry);
     //renderer->setText("Welcome to SimpleTextProjector");
+    renderer->setRedrawCallback(requestRedraw);
+    frameCapture.setRedrawCallback(requestRedraw);
+    renderer->setGlyphRasterizerThreads(pConf->getInt("GlyphRasterizerThreads", 2));
+    // an empty directory turns the glyph disk cache off
+    std::string glyphCacheDirectory = pConf->getString("GlyphCacheDirectory", "glyphcache");
+    GlyphDiskCache* glyphDiskCache = nullptr;
+    if (!glyphCacheDirectory.empty()) {
+        glyphDiskCache = new GlyphDiskCache(&consoleLogger, glyphCacheDirectory);
+        renderer->setGlyphDiskCache(glyphDiskCache);
+    }
+    renderer->setGlyphPrewarm(GlyphRasterizer::parseCodePointRanges(pConf->getString("GlyphPrewarmRanges", "")));
     std::pair rendererPair(0, renderer);
     renderers.insert(rendererPair);
 
+    std::string streamProfileError;
+    if (!loadStreamProfile(*pConf, pConf->getString("StreamProfile", "default"), streamProfile, streamProfileError)) {
+        consoleLogger.warning("Using the default stream profile, " + streamProfileError);
+    }
+    // an empty directory turns recording off
+    recordingSettings.directory = pConf->getString("RecordingDirectory", "");
+    recordingSettings.segmentMinutes = std::max(1, pConf->getInt("RecordingSegmentMinutes", recordingSettings.segmentMinutes));
+    recordingSettings.segmentMegabytes = std::max(1, pConf->getInt("RecordingSegmentMegabytes", recordingSettings.segmentMegabytes));
+
     bool showGreetingWindow = pConf->getBool("ShowGreetingWindow", true);
 
     // UI window
@@ -240,12 +274,19 @@ int RealMain(int argc, char** argv) {
         createUIWindow(uiWindow, primary, ui, url, shouldCloseUI, isCheckBoxTicked);
     }
 
+    unsigned long long lastRenderedGeneration = 0;
+    bool wasCapturing = false;
+    // the background is not part of the renderer's damage, a new color changes the whole window
+    float renderedBackground[4] = { backgroundColorR, backgroundColorG, backgroundColorB, backgroundColorA };
+    DamageRect frameDamage;
+
     /* Loop until the user closes the window */
     while (!glfwWindowShouldClose(window))
     {
-        glEnable(GL_BLEND);
-        glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-        glEnable(GL_CULL_FACE);
+        if (showGreetingWindow) {
+            glfwMakeContextCurrent(window);
+        }
+
         monitorInfo.monitorMutex.lock();
         if (monitorInfo.hasChanged) {
             const GLFWvidmode* mode = glfwGetVideoMode(monitors[monitorInfo.monitorIndex]);
@@ -254,35 +295,94 @@ int RealMain(int argc, char** argv) {
             monitorInfo.monitorHeight = mode->height;
             monitorInfo.monitorWidth = mode->width;
             monitorInfo.refreshRate = mode->refreshRate;
+            textMutex.lock();
             renderer->setScreenSize(mode->width, mode->height);
+            textMutex.unlock();
             currentWindowMonitor = glfwGetWindowMonitor(window);
+            renderGeneration++;
         }
         monitorInfo.monitorMutex.unlock();
 
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+        // hand the frames read back in the last iteration to the streamer, the GPU is done with them by now
+        if (frameCapture.deliverPending()) {
+            // the streamer was behind and missed a frame, the next one brings its damage along
+            renderGeneration++;
+        }
+        bool isCapturing = frameCapture.isEnabled();
+        if (isCapturing && !wasCapturing) {
+            // the streamer needs a first frame even if nothing changes on screen
+            renderGeneration++;
+        } else if (!isCapturing && wasCapturing) {
+            frameCapture.releaseGL();
+        }
+        wasCapturing = isCapturing;
 
-        textMutex.lock();
-        glClearColor(backgroundColorR, backgroundColorG, backgroundColorB, backgroundColorA);
-        renderer->renderCenteredText(drawDebugLines);
-        textMutex.unlock();
+        unsigned long long currentGeneration = renderGeneration.load();
 
-        /* Swap buffers */
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (!retainedRendering || currentGeneration != lastRenderedGeneration) {
+            glEnable(GL_BLEND);
+            glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+            glEnable(GL_CULL_FACE);
+
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+
+            textMutex.lock();
+            glClearColor(backgroundColorR, backgroundColorG, backgroundColorB, backgroundColorA);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            bool isFrameComplete = renderer->renderCenteredText(drawDebugLines);
+            if (isFrameComplete) {
+                frameDamage.unite(renderer->takeDamage(framebufferWidth, framebufferHeight));
+                if (renderedBackground[0] != backgroundColorR || renderedBackground[1] != backgroundColorG || renderedBackground[2] != backgroundColorB || renderedBackground[3] != backgroundColorA) {
+                    frameDamage = DamageRect::full(framebufferWidth, framebufferHeight);
+                    renderedBackground[0] = backgroundColorR;
+                    renderedBackground[1] = backgroundColorG;
+                    renderedBackground[2] = backgroundColorB;
+                    renderedBackground[3] = backgroundColorA;
+                }
+            }
+            textMutex.unlock();
+
+            lastRenderedGeneration = currentGeneration;
+            if (isFrameComplete) {
+                if (isCapturing) {
+                    // only what changed is read back, the streamer patches it into its picture
+                    frameCapture.readBack(framebufferWidth, framebufferHeight, currentGeneration, frameDamage);
+                }
+                frameDamage = DamageRect();
+                /* Swap buffers */
+                glfwSwapBuffers(window);
+                renderStats.framesRendered++;
+            } else {
+                // glyphs are still being rasterized, the last frame stays up until the renderer asks for a redraw
+                renderStats.framesSkipped++;
+            }
+        } else {
+            // woke up (timeout or an event) and nothing changed
+            renderStats.idleWakeups++;
+        }
+
+        if (retainedRendering) {
+            // sleep until a handler calls requestRedraw() or GLFW has events for us
+            // while streaming, come back quickly to deliver the frame that is being read back
+            glfwWaitEventsTimeout(showGreetingWindow || isCapturing ? uiWaitTimeout : idleWaitTimeout);
+        } else {
+            glfwPollEvents();
+        }
 
         if (showGreetingWindow) {
             glDisable(GL_CULL_FACE);
             glEnable(GL_BLEND);
             glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-            ui->draw();
-
             glfwMakeContextCurrent(uiWindow);
+            ui->draw();
             glfwSwapBuffers(uiWindow);
             if (shouldCloseUI) {
                 showGreetingWindow = false;
                 delete ui;
                 glfwDestroyWindow(uiWindow);
+                glfwMakeContextCurrent(window);
                 if (isCheckBoxTicked) {
                     pConf->setBool("ShowGreetingWindow", false);
                     pConf->save(propertyFilePath);
@@ -324,6 +424,19 @@ int RealMain(int argc, char** argv) {
         streamingServerMutex.unlock();
     }
 
+    // the rasterizer workers of the renderers use the faces, deleting a renderer joins them
+    for (std::pair<const int, TextBoxRenderer*>& rendererPair : renderers) {
+        delete rendererPair.second;
+    }
+    renderers.clear();
+    // then the faces, the library goes last
+    delete fontRegistry;
+    fontRegistry = nullptr;
+
+    if (glyphDiskCache) {
+        glyphDiskCache->flush();
+    }
+
     FT_Done_FreeType(freeTypeLibrary);
 
     return 0;
@@ -379,9 +492,19 @@ void monitor_callback(GLFWmonitor* monitor, int event) {
     Poco::JSON::Stringifier::stringify(*newMonitorJSON, oss);
     std::string newMonitorJSONAsString = oss.str();
 
-    std::set<WebSocket>::iterator clientIterator;
-    for (clientIterator = clients.begin(); clientIterator != clients.end(); clientIterator++) {
-        ((WebSocket)*clientIterator).sendFrame(newMonitorJSONAsString.c_str(), newMonitorJSONAsString.length());
+    // copied, sendToClient takes the lock of the client set itself
+    std::vector<WebSocket> connectedClients;
+    clientSetMutex.lock();
+    for (const std::pair<const WebSocket, std::shared_ptr<Mutex>>& client : clients) {
+        connectedClients.push_back(client.first);
+    }
+    clientSetMutex.unlock();
+    for (WebSocket& client : connectedClients) {
+        try {
+            sendToClient(client, newMonitorJSONAsString);
+        } catch (Poco::Exception&) {
+            // the client is leaving, its own thread removes it
+        }
     }
 }
 
@@ -465,5 +588,32 @@ void createUIWindow(GLFWwindow*& uiWindow, GLFWmonitor* primaryMonitor, SimpleTe
 
 void uiWindowCloseCallback(GLFWwindow* uiWindow) {
     shouldCloseUI = true;
+}
+
+void windowRefreshCallback(GLFWwindow* window) {
+    // the window contents got damaged (e.g. restored after being minimized), draw them again
+    renderGeneration++;
+}
+
+void requestRedraw() {
+    renderGeneration++;
+    glfwPostEmptyEvent();
+}
 
+void sendToClient(WebSocket ws, const std::string& text) {
+    std::shared_ptr<Mutex> sendMutex;
+    clientSetMutex.lock();
+    std::map<WebSocket, std::shared_ptr<Mutex>>::iterator clientIt = clients.find(ws);
+    if (clientIt != clients.end()) {
+        sendMutex = clientIt->second;
+    }
+    clientSetMutex.unlock();
+
+    if (sendMutex) {
+        Mutex::ScopedLock lock(*sendMutex);
+        ws.sendFrame(text.c_str(), (int) text.length());
+    } else {
+        // not (or no longer) a client, only its own thread writes to it
+        ws.sendFrame(text.c_str(), (int) text.length());
+    }
 }
\ No newline at end of file
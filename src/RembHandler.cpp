@@ -0,0 +1,35 @@
+#include "RembHandler.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+RembHandler::RembHandler(std::function<void(unsigned int)> onRemb) {
+	this->onRemb = onRemb;
+}
+
+void RembHandler::incoming(rtc::message_vector& messages, const rtc::message_callback& /*send*/) {
+	for (const rtc::message_ptr& message : messages) {
+		if (message->type != rtc::Message::Control) {
+			continue;
+		}
+
+		// a compound RTCP packet, REMB is payload specific feedback (206) with format 15 and "REMB" after the SSRCs
+		const uint8_t* data = reinterpret_cast<const uint8_t*>(message->data());
+		size_t offset = 0;
+		while (offset + 4 <= message->size()) {
+			const uint8_t* packet = data + offset;
+			size_t length = ((size_t) ((packet[2] << 8) | packet[3]) + 1) * 4;
+			if (offset + length > message->size()) {
+				break;
+			}
+			if (packet[1] == 206 && (packet[0] & 0x1f) == 15 && length >= 20 && std::memcmp(packet + 12, "REMB", 4) == 0) {
+				// 6 bit exponent, 18 bit mantissa
+				unsigned int exponent = packet[17] >> 2;
+				uint64_t mantissa = ((uint64_t) (packet[17] & 0x03) << 16) | (packet[18] << 8) | packet[19];
+				uint64_t bitrate = exponent < 46 ? mantissa << exponent : UINT32_MAX;
+				onRemb((unsigned int) std::min<uint64_t>(bitrate, UINT32_MAX));
+			}
+			offset += length;
+		}
+	}
+}
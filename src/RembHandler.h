@@ -0,0 +1,16 @@
+#pragma once
+#include <functional>
+
+#include "rtc/rtc.hpp"
+
+// Reports the bandwidth estimates (REMB, "goog-remb" in the SDP) a receiver sends back, in bits per second.
+// libdatachannel only has handlers to send REMB, not to read them.
+class RembHandler : public rtc::MediaHandler {
+public:
+	RembHandler(std::function<void(unsigned int)> onRemb);
+
+	void incoming(rtc::message_vector& messages, const rtc::message_callback& send) override;
+
+private:
+	std::function<void(unsigned int)> onRemb;
+};
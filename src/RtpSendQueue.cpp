@@ -0,0 +1,97 @@
+#include "RtpSendQueue.h"
+#include <cstring>
+
+// every frame ends with a packet that is usually shorter than the others
+static const int numberOfShortPackets = 128;
+
+RtpSendQueue::RtpSendQueue(size_t maximumBufferedBytes, int maximumPacketSize) :
+	buffers(getNumberOfPackets(maximumBufferedBytes, maximumPacketSize)),
+	ready(getNumberOfPackets(maximumBufferedBytes, maximumPacketSize)),
+	available(getNumberOfPackets(maximumBufferedBytes, maximumPacketSize)) {
+	this->maximumBufferedBytes = maximumBufferedBytes;
+	this->current = nullptr;
+	for (std::vector<std::byte>& buffer : buffers) {
+		// the RTP muxer never writes more than its max_packet_size
+		buffer.reserve(maximumPacketSize);
+		available.push(&buffer);
+	}
+}
+
+int RtpSendQueue::getNumberOfPackets(size_t maximumBufferedBytes, int maximumPacketSize) {
+	return (int) (maximumBufferedBytes / maximumPacketSize) + numberOfShortPackets;
+}
+
+bool RtpSendQueue::push(const uint8_t* data, int size, bool isKeyframeStart, uint16_t sequenceNumber) {
+	if (dropping && !isKeyframeStart) {
+		packetsDropped++;
+		return false;
+	}
+
+	std::vector<std::byte>* buffer;
+	if (bufferedBytes + size > maximumBufferedBytes || !available.pop(buffer)) {
+		if (!dropping) {
+			keyframeWaits++;
+		}
+		dropping = true;
+		packetsDropped++;
+		return false;
+	}
+	dropping = false;
+
+	buffer->resize(size);
+	std::memcpy(buffer->data(), data, size);
+	if (size >= 4) {
+		(*buffer)[2] = (std::byte) (sequenceNumber >> 8);
+		(*buffer)[3] = (std::byte) (sequenceNumber & 0xff);
+	}
+	bufferedBytes += size;
+	// every buffer fits into the queue
+	ready.push(buffer);
+	packetsQueued.set();
+	return true;
+}
+
+bool RtpSendQueue::isDropping() {
+	return dropping;
+}
+
+const std::vector<std::byte>* RtpSendQueue::front() {
+	if (current == nullptr) {
+		ready.pop(current);
+	}
+	return current;
+}
+
+void RtpSendQueue::release() {
+	if (current == nullptr) {
+		return;
+	}
+	bufferedBytes -= current->size();
+	packetsSent++;
+	available.push(current);
+	current = nullptr;
+}
+
+void RtpSendQueue::waitForPackets() {
+	packetsQueued.wait();
+}
+
+void RtpSendQueue::wake() {
+	packetsQueued.set();
+}
+
+size_t RtpSendQueue::getBufferedBytes() {
+	return bufferedBytes;
+}
+
+unsigned long long RtpSendQueue::getPacketsSent() {
+	return packetsSent;
+}
+
+unsigned long long RtpSendQueue::getPacketsDropped() {
+	return packetsDropped;
+}
+
+unsigned long long RtpSendQueue::getKeyframeWaits() {
+	return keyframeWaits;
+}
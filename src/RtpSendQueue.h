@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "Poco/Event.h"
+#include "SPSCQueue.h"
+
+// Bounded queue of the RTP packets for one receiver. The sender thread of the receiver's codec pushes,
+// the receiver's own thread sends them, so a receiver on a slow network can't hold up the others.
+// When the queue is full it drops everything until the start of the next keyframe: a receiver can't decode
+// the frames after a lost packet anyway. The packet buffers are allocated once up front, as many as the byte limit needs.
+class RtpSendQueue {
+public:
+	// maximumPacketSize: the max_packet_size of the RTP muxer
+	RtpSendQueue(size_t maximumBufferedBytes, int maximumPacketSize);
+
+	RtpSendQueue(const RtpSendQueue&) = delete;
+	RtpSendQueue& operator=(const RtpSendQueue&) = delete;
+
+	// Producer only (more than one thread is fine if they take turns under a lock). isKeyframeStart: the first RTP
+	// packet of a keyframe, where dropping stops. The copy gets the receiver's own sequence number.
+	// Returns false if the packet was dropped.
+	bool push(const uint8_t* data, int size, bool isKeyframeStart, uint16_t sequenceNumber);
+	// true while waiting for a keyframe after a drop
+	bool isDropping();
+
+	// Consumer only. The packet stays valid until it is given back with release.
+	const std::vector<std::byte>* front();
+	void release();
+	// waits until something was pushed or wake was called
+	void waitForPackets();
+	// ends a waitForPackets (or the next one) without a packet
+	void wake();
+
+	// full packets up to the byte limit, plus the short last packets of the frames
+	static int getNumberOfPackets(size_t maximumBufferedBytes, int maximumPacketSize);
+
+	size_t getBufferedBytes();
+	unsigned long long getPacketsSent();
+	unsigned long long getPacketsDropped();
+	// how often the queue ran full and had to wait for a keyframe
+	unsigned long long getKeyframeWaits();
+
+private:
+	std::vector<std::vector<std::byte>> buffers;
+	SPSCQueue<std::vector<std::byte>*> ready;	// producer -> consumer
+	SPSCQueue<std::vector<std::byte>*> available;	// consumer -> producer
+	std::vector<std::byte>* current;		// consumer only, taken from ready and not released yet
+	Poco::Event packetsQueued;
+	size_t maximumBufferedBytes;
+	std::atomic<size_t> bufferedBytes{ 0 };
+	std::atomic<bool> dropping{ false };
+	std::atomic<unsigned long long> packetsSent{ 0 };
+	std::atomic<unsigned long long> packetsDropped{ 0 };
+	std::atomic<unsigned long long> keyframeWaits{ 0 };
+};
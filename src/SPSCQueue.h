@@ -0,0 +1,73 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+// Bounded lock-free ring buffer for exactly one producer thread and one consumer thread.
+// push() and pop() never block and never allocate, the slots are allocated once up front.
+template <typename T>
+class SPSCQueue {
+public:
+    explicit SPSCQueue(size_t capacity) {
+        size_t size = 2;
+        while (size < capacity + 1) {
+            size *= 2;
+        }
+        buffer.resize(size);
+        mask = size - 1;
+    }
+
+    SPSCQueue(const SPSCQueue&) = delete;
+    SPSCQueue& operator=(const SPSCQueue&) = delete;
+
+    // producer only, returns false if the queue is full
+    bool push(T&& item) {
+        size_t currentTail = tail.load(std::memory_order_relaxed);
+        size_t nextTail = (currentTail + 1) & mask;
+        if (nextTail == head.load(std::memory_order_acquire)) {
+            return false;
+        }
+        buffer[currentTail] = std::move(item);
+        tail.store(nextTail, std::memory_order_release);
+        return true;
+    }
+
+    bool push(const T& item) {
+        T copy = item;
+        return push(std::move(copy));
+    }
+
+    // consumer only, returns false if the queue is empty
+    bool pop(T& item) {
+        size_t currentHead = head.load(std::memory_order_relaxed);
+        if (currentHead == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = std::move(buffer[currentHead]);
+        head.store((currentHead + 1) & mask, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+    }
+
+    // only a snapshot when the other side is running
+    size_t size() const {
+        size_t currentTail = tail.load(std::memory_order_acquire);
+        size_t currentHead = head.load(std::memory_order_acquire);
+        return (currentTail - currentHead) & mask;
+    }
+
+    size_t capacity() const {
+        return mask;
+    }
+
+private:
+    std::vector<T> buffer;
+    size_t mask;
+    // head and tail on their own cache lines, so producer and consumer don't keep stealing them from each other
+    alignas(64) std::atomic<size_t> head{ 0 };
+    alignas(64) std::atomic<size_t> tail{ 0 };
+};
@@ -1,4 +1,6 @@
 #include "ScreenStreamer.h"
+#include "Poco/Timestamp.h"
+#include "Poco/String.h"
 
 using namespace std;
 using Poco::JSON::Object;
@@ -6,18 +8,23 @@ using Poco::JSON::Stringifier;
 using Poco::Dynamic::Var;
 
 /* initialize the resources*/
-ScreenStreamer::ScreenStreamer(Task* tsk, Event* stop_event, Mutex* mtx, Logger* logger) {
-	avdevice_register_all();
+ScreenStreamer::ScreenStreamer(Task* tsk, Event* stop_event, Mutex* mtx, Logger* logger, FrameCapture* frame_capture, const StreamProfile& stream_profile, const RecordingSettings& recording_settings) {
 	task = tsk;
 	stopEvent = stop_event;
 	mutex = mtx;
 	appLogger = logger;
+	frameCapture = frame_capture;
+	profile = stream_profile;
+	if (!recording_settings.directory.empty()) {
+		recorder = std::make_unique<StreamRecorder>(logger, recording_settings, numberOfRecorderPackets);
+	}
 }
 
 ScreenStreamer::~ScreenStreamer() {}
 
 void ScreenStreamer::stopStreaming() {
 	shouldStream = false;
+	receiversChanged.set();
 }
 
 std::string ScreenStreamer::peerStateToString(rtc::PeerConnection::State state) {
@@ -62,30 +69,140 @@ bool ScreenStreamer::isStreaming() {
 
 int custom_write(void* opaque, const uint8_t* buf, int buf_size) {
 
-	ScreenStreamer* instance = static_cast<ScreenStreamer*>(opaque);
+	ScreenStreamer::Pipeline* pipeline = static_cast<ScreenStreamer::Pipeline*>(opaque);
 
-	return instance->handle_write((uint8_t*)buf, buf_size);
+	return pipeline->streamer->handle_write(*pipeline, (uint8_t*)buf, buf_size);
 }
 
-int ScreenStreamer::handle_write(uint8_t* buf, int buf_size) {
+int ScreenStreamer::handle_write(Pipeline& pipeline, uint8_t* buf, int buf_size) {
+
+	// the muxer writes its RTCP sender reports through here too (payload types 200 - 204). They have the muxer's own
+	// timestamps and every layer has different ones, the receivers do without them
+	if (buf_size >= 2 && buf[1] >= 200 && buf[1] <= 204) {
+		return buf_size;
+	}
 
 	auto rtp = reinterpret_cast<rtc::RtpHeader*>(buf);
 	rtp->setSsrc(ssrc);
 
-	set<std::shared_ptr<Receiver>>::iterator itr;
+	// the receivers see one stream, every layer has the timestamps of the pts
+	if (!pipeline.hasTimestampBase) {
+		pipeline.timestampBase = rtp->timestamp() - (uint32_t) pipeline.writingPts;
+		pipeline.hasTimestampBase = true;
+	}
+	rtp->setTimestamp(rtp->timestamp() - pipeline.timestampBase);
+	uint16_t sequenceNumber = rtp->seqNumber();
 
-	for (itr = receivers.begin(); itr != receivers.end(); itr++) {
-		std::shared_ptr<Receiver> tmp = *itr;
-		Receiver rr = *tmp;
-		if (rr.isConnected) {
-			std::shared_ptr<rtc::Track> tmpTrack = rr.track;
-			tmpTrack->send(reinterpret_cast<const std::byte*>(buf), buf_size);
+	bool isKeyframeStart = pipeline.writingKeyframe && pipeline.firstRtpPacket;
+	pipeline.firstRtpPacket = false;
+
+	// no lock, no copies and no refcounting, a receiver that leaves meanwhile is kept alive by the snapshot.
+	// The packets are only queued, every receiver has its own thread for the network.
+	for (const std::shared_ptr<Receiver>& receiver : pipeline.receiverReader.get()) {
+		if (!receiver->isConnected || !receiver->hasCodec || receiver->codec != pipeline.codec) {
+			continue;
+		}
+		// only the sender of the layer the receiver gets, or can start or switch to with this packet, takes the lock
+		bool canStartHere = isKeyframeStart && receiver->targetLayer == pipeline.layer;
+		if (!canStartHere && (!receiver->hasStarted || receiver->layer != pipeline.layer)) {
+			continue;
+		}
+		Mutex::ScopedLock lock(receiver->layerMutex);
+		if (!receiver->hasStarted) {
+			// nothing sent yet, it starts with the cached keyframe of its layer (startJoiningReceivers) or the next one
+			if (receiver->targetLayer != pipeline.layer || !isKeyframeStart) {
+				continue;
+			}
+			receiver->layer = pipeline.layer;
+			receiver->hasStarted = true;
+		} else if (receiver->layer != pipeline.layer && receiver->targetLayer == pipeline.layer && isKeyframeStart) {
+			// the receiver can switch here, the sequence numbers go on where the old layer stopped
+			receiver->layer = pipeline.layer;
+			receiver->sequenceNumberOffset = (uint16_t) (receiver->lastSequenceNumber + 1 - sequenceNumber);
+		}
+		if (receiver->layer != pipeline.layer) {
+			continue;
+		}
+
+		uint16_t receiverSequenceNumber = (uint16_t) (sequenceNumber + receiver->sequenceNumberOffset);
+		receiver->lastSequenceNumber = receiverSequenceNumber;
+		bool wasDropping = receiver->sendQueue->isDropping();
+		if (!receiver->sendQueue->push(buf, buf_size, isKeyframeStart, receiverSequenceNumber) && !wasDropping) {
+			// the receiver is too slow, it skips everything up to the next keyframe, on a smaller layer if there is one
+			appLogger->warning("Receiver %d is behind, dropping its packets until the next keyframe", receiver->id);
+			layerKeyframeRequested[pipeline.layer] = true;
+			if (receiver->targetLayer == pipeline.layer && pipeline.layer + 1 < profile.layers) {
+				receiver->targetLayer = pipeline.layer + 1;
+				layerKeyframeRequested[pipeline.layer + 1] = true;
+			}
 		}
 	}
 
+	pipeline.keyframeCache->add(buf, buf_size, isKeyframeStart);
+
 	return buf_size;  // Returning buf_size tells FFmpeg we handled the packet
 }
 
+void ScreenStreamer::startJoiningReceivers(Pipeline& pipeline) {
+	for (const std::shared_ptr<Receiver>& receiver : pipeline.receiverReader.get()) {
+		if (receiver->hasStarted || !receiver->isConnected || !receiver->hasCodec || receiver->codec != pipeline.codec || receiver->targetLayer != pipeline.layer) {
+			continue;
+		}
+		if (!pipeline.keyframeCache->hasKeyframe()) {
+			// the group of pictures was too large to cache (before the first packet the first keyframe is on its way)
+			if (pipeline.hasTimestampBase) {
+				layerKeyframeRequested[pipeline.layer] = true;
+			}
+			continue;
+		}
+
+		// The receiver joined mid-stream, it gets the last keyframe and everything after it, the sequence numbers go on from there.
+		// The cached frames can be seconds old, they get timestamps one frame apart up to the last one so they are shown right away.
+		KeyframeCache& cache = *pipeline.keyframeCache;
+		int numberOfFrames = 0;
+		uint32_t previousTimestamp = 0;
+		for (int i = 0; i < cache.getNumberOfPackets(); i++) {
+			uint32_t timestamp = reinterpret_cast<const rtc::RtpHeader*>(cache.getPacket(i).data())->timestamp();
+			if (i == 0 || timestamp != previousTimestamp) {
+				numberOfFrames++;
+			}
+			previousTimestamp = timestamp;
+		}
+		uint32_t lastTimestamp = previousTimestamp;
+
+		uint32_t frameTicks = 90000 / std::max(1, profile.fps);
+
+		Mutex::ScopedLock lock(receiver->layerMutex);
+		if (receiver->hasStarted || !receiver->hasCodec || receiver->codec != pipeline.codec || receiver->targetLayer != pipeline.layer) {
+			// the sender of another layer started it in the meantime
+			continue;
+		}
+		receiver->layer = pipeline.layer;
+		bool isReplayed = true;
+		int frame = -1;
+		for (int i = 0; i < cache.getNumberOfPackets() && isReplayed; i++) {
+			const std::vector<std::byte>& cached = cache.getPacket(i);
+			pipeline.replayBuffer.assign(reinterpret_cast<const uint8_t*>(cached.data()), reinterpret_cast<const uint8_t*>(cached.data()) + cached.size());
+			auto rtp = reinterpret_cast<rtc::RtpHeader*>(pipeline.replayBuffer.data());
+			if (i == 0 || rtp->timestamp() != previousTimestamp) {
+				frame++;
+			}
+			previousTimestamp = rtp->timestamp();
+			rtp->setTimestamp(lastTimestamp - (uint32_t) (numberOfFrames - 1 - frame) * frameTicks);
+			receiver->lastSequenceNumber = rtp->seqNumber();
+			isReplayed = receiver->sendQueue->push(pipeline.replayBuffer.data(), (int) pipeline.replayBuffer.size(), i == 0, receiver->lastSequenceNumber);
+		}
+		// the sequence numbers go on from the replay either way, a queue that ran full drops until the next keyframe
+		receiver->hasStarted = true;
+		if (isReplayed) {
+			stats.cacheJoins++;
+		} else {
+			appLogger->warning("The cached keyframe didn't fit into the queue of receiver %d, it waits for a new one", receiver->id);
+			layerKeyframeRequested[pipeline.layer] = true;
+		}
+	}
+}
+
 int ScreenStreamer::setAnswer(WebSocket& client, Object::Ptr answerJSON) {
 
 	try {
@@ -97,7 +214,21 @@ int ScreenStreamer::setAnswer(WebSocket& client, Object::Ptr answerJSON) {
 		rtc::Description answer(sdp, type);
 
 		std::shared_ptr<Receiver> currentReceiver;
-		this->getReceiver(&client, currentReceiver);
+		this->getReceiver(client, currentReceiver);
+		if (currentReceiver == NULL) {
+			appLogger->error("No receiver for this answer");
+			return -1;
+		}
+
+		VideoCodec codec;
+		if (!getNegotiatedCodec(answer, codec)) {
+			appLogger->error("The answer doesn't accept any of the offered codecs");
+			return -1;
+		}
+		appLogger->information("Receiver negotiated %s", VideoEncoder::getCodecName(codec));
+		currentReceiver->codec = codec;
+		currentReceiver->hasCodec = true;
+		receiversChanged.set();
 
 		currentReceiver->conn->setRemoteDescription(answer);
 		return 0;
@@ -109,358 +240,506 @@ int ScreenStreamer::setAnswer(WebSocket& client, Object::Ptr answerJSON) {
 	}
 }
 
-int ScreenStreamer::registerReceiver(WebSocket& client, Event* offerEvent) {
+int ScreenStreamer::registerReceiver(const WebSocket& client, std::function<void(const std::string&)> onOffer) {
 	
-	std::shared_ptr<Receiver> r = std::make_shared<Receiver>();
-	int receiverID = receiverIdCount;
-	//r->id = receiverIdCount;
+	std::shared_ptr<Receiver> r = std::make_shared<Receiver>(client);
+	int receiverID = receiverIdCount++;
+	r->id = receiverID;
+	r->sendQueue = std::make_unique<RtpSendQueue>(std::max(minimumReceiverBufferBytes, (size_t) profile.bitrateKbps * 1000 / 8), maximumRtpPacketSize);
 	
 	r->conn = std::make_shared<rtc::PeerConnection>();
-	r->conn->onStateChange([this, &client, r](rtc::PeerConnection::State state) {
+	r->conn->onStateChange([this, r](rtc::PeerConnection::State state) {
 		this->appLogger->information("State: %s", this->peerStateToString(state));
-		std::shared_ptr<Receiver> currentReceiver;
-		this->getReceiver(&client, currentReceiver);
 		if (state == rtc::PeerConnection::State::Connected) {
-			currentReceiver->isConnected = true;
+			// the sender of its layer starts it with the cached keyframe
+			r->isConnected = true;
+			this->receiversChanged.set();
 		}
-		if (state == rtc::PeerConnection::State::Disconnected || state == rtc::PeerConnection::State::Closed) {
-			this->receivers.erase(currentReceiver);
+		// a failed connection (ICE found no path) never gets to Closed on its own, it would keep its WebSocket and queue
+		if (state == rtc::PeerConnection::State::Disconnected || state == rtc::PeerConnection::State::Failed || state == rtc::PeerConnection::State::Closed) {
+			r->isConnected = false;
+			this->removeReceiver(r);
 		}
 	});
 
-	r->conn->onGatheringStateChange([r, this, &client, offerEvent](rtc::PeerConnection::GatheringState state) {
+	// on a libdatachannel thread, the request that registered the receiver has returned long ago
+	r->conn->onGatheringStateChange([r, this, onOffer](rtc::PeerConnection::GatheringState state) {
 		this->appLogger->information("Gathering State: %s", this->gatheringStateToString(state));
 		if (state == rtc::PeerConnection::GatheringState::Complete) {
 			auto description = r->conn->localDescription();
-			Object* jsonMessage = new Object();
+			Object::Ptr jsonMessage = new Object();
 			jsonMessage->set("type", description->typeString());
 			jsonMessage->set("sdp", std::string(description.value()));
 
 			std::ostringstream buffer;
 			Stringifier::stringify(*jsonMessage, buffer);
 
-			std::shared_ptr<Receiver> currentReceiver;
-			this->getReceiver(&client, currentReceiver);
-
-			if (currentReceiver != NULL) {
-				currentReceiver.get()->offer = buffer.str();
-			}
-
-			offerEvent->set();
+			onOffer(buffer.str());
 		}
 	});
 
 	rtc::Description::Video media("video", rtc::Description::Direction::SendOnly);
-	media.addVP9Codec(96);
-	media.setBitrate(3000);
+	// in the order of the profile, every receiver picks the first one it can decode
+	for (VideoCodec codec : profile.codecs) {
+		if (VideoEncoder::isAvailable(codec)) {
+			VideoEncoder::addToDescription(codec, media);
+		} else {
+			appLogger->warning("FFmpeg has no encoder for " + VideoEncoder::getCodecName(codec) + ", it isn't offered");
+		}
+	}
+	media.setBitrate(profile.bitrateKbps);
 	media.addSSRC(ssrc, "video-send");
 
 	r->track = r->conn->addTrack(media);
-
-	r->track->onOpen([r]() {
-		r->track->requestKeyframe(); // So the receiver can start playing immediately
-	});
+	// the receiver's bandwidth estimate picks its simulcast layer
+	Receiver* estimatedReceiver = r.get();
+	r->track->setMediaHandler(std::make_shared<RembHandler>([this, estimatedReceiver](unsigned int bitsPerSecond) {
+		this->onBandwidthEstimate(*estimatedReceiver, bitsPerSecond);
+	}));
+	// the receiver lost packets and can't decode until the next keyframe
+	r->track->chainMediaHandler(std::make_shared<rtc::PliHandler>([this, estimatedReceiver]() {
+		this->stats.keyframeRequests++;
+		this->layerKeyframeRequested[estimatedReceiver->targetLayer] = true;
+	}));
 
 	r->track->onClosed([this, r]() {
-		this->mutex->lock();
-		this->receivers.erase(r);
-		this->mutex->unlock();
+		r->isConnected = false;
+		this->removeReceiver(r);
 	});
 
 	r->track->onMessage([](rtc::binary var) {}, nullptr);
 
+	// before the offer is on its way, its answer looks the receiver up
+	receivers.add(r);
 	r->conn->setLocalDescription();
-
-	r->client = &client;
-
-	receivers.insert(r);
-	receiverIdCount++;
 	return receiverID;
 }
 
-std::string ScreenStreamer::getOffer(WebSocket& client) {
-	std::shared_ptr<Receiver> currentReceiver;
-	this->getReceiver(&client, currentReceiver);
-	if (currentReceiver != NULL) {
-		return currentReceiver.get()->offer;
+const StreamStats& ScreenStreamer::getStats() {
+	return stats;
+}
+
+std::vector<ReceiverStats> ScreenStreamer::getReceiverStats() {
+	std::vector<ReceiverStats> receiverStats;
+	std::shared_ptr<const SnapshotList<Receiver>::Items> snapshot = receivers.get();
+	for (const std::shared_ptr<Receiver>& receiver : *snapshot) {
+		ReceiverStats statsOfReceiver;
+		statsOfReceiver.id = receiver->id;
+		statsOfReceiver.codec = receiver->hasCodec ? VideoEncoder::getCodecName(receiver->codec) : "";
+		statsOfReceiver.isConnected = receiver->isConnected;
+		statsOfReceiver.bufferedBytes = receiver->sendQueue->getBufferedBytes();
+		statsOfReceiver.packetsSent = receiver->sendQueue->getPacketsSent();
+		statsOfReceiver.packetsDropped = receiver->sendQueue->getPacketsDropped();
+		statsOfReceiver.keyframeWaits = receiver->sendQueue->getKeyframeWaits();
+		statsOfReceiver.layer = receiver->targetLayer;
+		statsOfReceiver.bandwidthEstimateKbps = receiver->bandwidthEstimate / 1000;
+		receiverStats.push_back(statsOfReceiver);
 	}
-	else {
-		return "\"error\"";
+	return receiverStats;
+}
+
+RecordingStats ScreenStreamer::getRecordingStats() {
+	RecordingStats recordingStats = {};
+	if (recorder != nullptr) {
+		recordingStats.isRecording = recorder->isRecording();
+		recordingStats.file = recorder->getFile();
+		recordingStats.segments = recorder->getSegments();
+		recordingStats.bytesWritten = recorder->getBytesWritten();
+		recordingStats.packetsDropped = recorder->getPacketsDropped();
 	}
+	return recordingStats;
 }
 
-/*void ScreenStreamer::getReceiver(int id, std::shared_ptr<Receiver>& recv) {
-	set<std::shared_ptr<Receiver>>::iterator itr;
+void ScreenStreamer::removeReceiver(const std::shared_ptr<Receiver>& receiver) {
+	// both the peer connection and the track report it, only the first one counts
+	leftReceiversMutex.lock();
+	if (receivers.remove(receiver)) {
+		leftReceivers.push_back(receiver);
+	}
+	leftReceiversMutex.unlock();
+	receiversChanged.set();
+}
 
-	for (itr = receivers.begin(); itr != receivers.end(); itr++) {
-		if (itr->get()->id == id) {
-			recv = *itr;
-			return;
+void ScreenStreamer::updateReceiverSenders() {
+	stopLeftReceiverSenders();
+
+	std::shared_ptr<const SnapshotList<Receiver>::Items> snapshot = receivers.get();
+	for (const std::shared_ptr<Receiver>& receiver : *snapshot) {
+		if (receiver->isConnected && !receiver->sending) {
+			receiver->sending = true;
+			Receiver* sendingReceiver = receiver.get();
+			receiver->sendThread.startFunc([this, sendingReceiver]() {
+				runReceiverSender(*sendingReceiver);
+			});
 		}
 	}
+}
 
-	recv = NULL;
-}*/
-
+void ScreenStreamer::stopLeftReceiverSenders() {
+	std::vector<std::shared_ptr<Receiver>> left;
+	leftReceiversMutex.lock();
+	left.swap(leftReceivers);
+	leftReceiversMutex.unlock();
+	for (const std::shared_ptr<Receiver>& receiver : left) {
+		stopReceiverSender(*receiver);
+	}
+}
 
-void ScreenStreamer::getReceiver(WebSocket* client, std::shared_ptr<Receiver>& recv) {
-	set<std::shared_ptr<Receiver>>::iterator itr;
+void ScreenStreamer::stopReceiverSender(Receiver& receiver) {
+	if (receiver.sending) {
+		receiver.sending = false;
+		receiver.sendQueue->wake();
+		receiver.sendThread.join();
+	}
+}
 
-	for (itr = receivers.begin(); itr != receivers.end(); itr++) {
-		if (itr->get()->client == client) {
-			recv = *itr;
-			return;
+void ScreenStreamer::runReceiverSender(Receiver& receiver) {
+	while (receiver.sending) {
+		const std::vector<std::byte>* packet = receiver.sendQueue->front();
+		if (packet == nullptr) {
+			// sleeps until the sender of its layer pushes or it is stopped
+			receiver.sendQueue->waitForPackets();
+			continue;
+		}
+		try {
+			receiver.track->send(packet->data(), packet->size());
+		} catch (const std::exception&) {
+			// the track closed, its callbacks remove the receiver
 		}
+		receiver.sendQueue->release();
 	}
-
-	recv = NULL;
 }
 
+bool ScreenStreamer::getNegotiatedCodec(rtc::Description& answer, VideoCodec& codec) {
+	for (unsigned int i = 0; i < answer.mediaCount(); i++) {
+		auto entry = answer.media(i);
+		rtc::Description::Media** media = std::get_if<rtc::Description::Media*>(&entry);
+		if (media == nullptr || (*media)->type() != "video") {
+			continue;
+		}
 
-int ScreenStreamer::startSteaming() {
-
-	//#####################
-	//## Grab the screen ##
-	//#####################
-
-	int ret;
-	AVInputFormat* in_InputFormat = (AVInputFormat*)av_find_input_format("gdigrab");
-	AVDictionary* in_InputFormatOptions = NULL;
-	AVFormatContext* in_InputFormatContext = NULL;
-	AVCodec* in_codec;
-	AVCodecContext* in_codec_ctx;
-
-	in_InputFormatContext = avformat_alloc_context();
-
-	ret = av_dict_set(&in_InputFormatOptions, "framerate", "30", 0);
-	ret = av_dict_set(&in_InputFormatOptions, "offset_x", "0", 0);
-	ret = av_dict_set(&in_InputFormatOptions, "offset_y", "0", 0);
-	ret = av_dict_set(&in_InputFormatOptions, "video_size", "1920x1080", 0);
-	ret = av_dict_set(&in_InputFormatOptions, "probesize", "100M", 0);
-	ret = av_dict_set(&in_InputFormatOptions, "draw_mouse", "0", 0);
-	if (ret < 0) {
-		appLogger->error("error in setting dictionary value");
-		goto input_error;
+		for (VideoCodec candidate : profile.codecs) {
+			int payloadType = VideoEncoder::getPayloadType(candidate);
+			// the receiver answers with the payload types of the offer it accepts
+			if ((*media)->hasPayloadType(payloadType) && Poco::icompare((*media)->rtpMap(payloadType)->format, VideoEncoder::getCodecName(candidate)) == 0) {
+				codec = candidate;
+				return true;
+			}
+		}
 	}
+	return false;
+}
 
-	ret = avformat_open_input(&in_InputFormatContext, "title=SimpleTextProjector", in_InputFormat, &in_InputFormatOptions); // second parameter is the -i parameter of ffmpeg, use title=window_title to specify the window later
-
-	if (ret != 0) {
-		appLogger->error("error: could not open screen capture");
-		goto input_error;
+void ScreenStreamer::getStreamSize(int monitorWidth, int monitorHeight, int& width, int& height) {
+	width = monitorWidth;
+	height = monitorHeight;
+	// scaled down to fit into the size of the profile, never up
+	if (profile.width > 0 && width > profile.width) {
+		height = (int) ((int64_t) height * profile.width / width);
+		width = profile.width;
 	}
-
-	ret = avformat_find_stream_info(in_InputFormatContext, &in_InputFormatOptions);
-	if (ret < 0) {
-		appLogger->error("error in avformat_find_stream_info");
-		goto input_error;
+	if (profile.height > 0 && height > profile.height) {
+		width = (int) ((int64_t) width * profile.height / height);
+		height = profile.height;
 	}
+	// YUV 4:2:0 needs even dimensions
+	width = std::max(2, width & ~1);
+	height = std::max(2, height & ~1);
+}
 
-	in_codec = (AVCodec*)avcodec_find_decoder(in_InputFormatContext->streams[0]->codecpar->codec_id);
-	if (in_codec == NULL) {
-		appLogger->error("Error occurred getting the in_codec");
-		goto input_error;
-	}
+void ScreenStreamer::getLayerSize(int layer, int streamWidth, int streamHeight, int& width, int& height) {
+	width = std::max(2, (streamWidth >> layer) & ~1);
+	height = std::max(2, (streamHeight >> layer) & ~1);
+}
 
-	in_codec_ctx = avcodec_alloc_context3(in_codec);
-	if (in_codec_ctx == NULL) {
-		appLogger->error("Error occurred when getting in_codec_ctx");
-		goto input_error;
+int ScreenStreamer::chooseLayer(int currentLayer, unsigned int bandwidthEstimate) {
+	for (int layer = 0; layer < profile.layers - 1; layer++) {
+		uint64_t needed = (uint64_t) getLayerBitrateKbps(profile, layer) * 1000;
+		if (layer < currentLayer) {
+			// 30 % headroom to move up
+			needed = needed * 13 / 10;
+		}
+		if (bandwidthEstimate >= needed) {
+			return layer;
+		}
 	}
+	return profile.layers - 1;
+}
 
-	ret = avcodec_parameters_to_context(in_codec_ctx, in_InputFormatContext->streams[0]->codecpar);
-	if (ret < 0) {
-		appLogger->error("Error occurred when avcodec_parameters_to_context");
-		goto input_error;
+void ScreenStreamer::onBandwidthEstimate(Receiver& receiver, unsigned int bitsPerSecond) {
+	receiver.bandwidthEstimate = bitsPerSecond;
+	int currentLayer = receiver.targetLayer;
+	int layer = chooseLayer(currentLayer, bitsPerSecond);
+	if (layer != currentLayer) {
+		appLogger->information("Receiver %d estimates %u kbit/s, switching to layer %d", receiver.id, bitsPerSecond / 1000, layer);
+		receiver.targetLayer = layer;
+		// the switch happens with the next keyframe of the layer
+		layerKeyframeRequested[layer] = true;
 	}
+}
 
-	ret = avcodec_open2(in_codec_ctx, in_codec, NULL);
-	if (ret < 0) {
-		appLogger->error("Error occurred when avcodec_open2");
-		goto input_error;
-	}
+void ScreenStreamer::runEncoder(Pipeline& pipeline) {
+	// acquired from the pool but not filled yet, kept for the next packet (only the sender gives packets back), also while parked
+	AVPacket* packet = pipeline.encoderPacket;
 
-	if (false) {
-input_error:
-		avformat_close_input(&in_InputFormatContext);
-		if (in_InputFormatContext == NULL) {
-			appLogger->information("Input format context closed successuflly");
-		} else {
-			appLogger->error("Input format context wasn't closed properly");
+	while (pipeline.running) {
+		QueuedFrame queuedFrame;
+		if (!pipeline.frames.pop(queuedFrame)) {
+			pipeline.framesQueued.tryWait(10);
+			continue;
 		}
 
-		avformat_free_context(in_InputFormatContext);
-		
-		avcodec_free_context(&in_codec_ctx);
-		if (in_codec_ctx == NULL) {
-			appLogger->information("Input codec context was closed successfully");
-		} else {
-			appLogger->error("Input codec context wasn't closed properly");
+		// the encoder fell behind, only the newest picture of the projector is worth encoding
+		QueuedFrame newerFrame;
+		while (pipeline.frames.pop(newerFrame)) {
+			if (queuedFrame.frame->pict_type == AV_PICTURE_TYPE_I) {
+				newerFrame.frame->pict_type = AV_PICTURE_TYPE_I;
+			}
+			pipeline.framePool->release(queuedFrame.frame);
+			stats.framesDropped++;
+			queuedFrame = newerFrame;
 		}
 
-		return -1;
-	}
+		stats.framesEncoded++;
+		int ret = avcodec_send_frame(pipeline.encoder, queuedFrame.frame);
+		// the encoder took its own reference, the frame goes back to the pool on every path
+		pipeline.framePool->release(queuedFrame.frame);
+		if (ret < 0) {
+			appLogger->error("Error encoding frame for output");
+			pipeline.failed = true;
+			break;
+		}
 
-	
-	av_dump_format(in_InputFormatContext, 0, "desktop", 0);
+		// one frame can give more than one packet
+		while (pipeline.running) {
+			if (packet == nullptr) {
+				packet = pipeline.packetPool->acquire();
+				if (packet == nullptr) {
+					// the sender is behind, wait for it instead of throwing encoded data away
+					pipeline.packetsSent.tryWait(10);
+					continue;
+				}
+			}
 
-	//##########################################
-	//## Configure output format && codecs    ##
-	//##########################################
+			ret = avcodec_receive_packet(pipeline.encoder, packet);
+			if (ret < 0) {
+				if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+					// EAGAIN: Need to feed more frames
+					appLogger->error("Error encoding packet for output");
+					pipeline.failed = true;
+				}
+				break;
+			}
 
-	AVFormatContext* out_OutputFormatContext = NULL;
-	AVCodec* out_Codec;
-	AVCodecContext* out_CodecContext;
-	AVStream* out_Stream;
-	AVRational serverFrameRate = { 30, 1 };
-	AVDictionary* out_codecOptions = nullptr;
-	const AVOutputFormat* out_OutputFormat = av_guess_format("rtp", NULL, NULL);
-	AVIOContext* avio_ctx;
-	unsigned char* avio_ctx_buffer;
+			// the pool only has the AVPacket, the encoder allocates its payload
+			stats.allocations.packetPayloadAllocations++;
+			if (packet->flags & AV_PKT_FLAG_KEY) {
+				pipeline.lastKeyframePts = packet->pts;
+			}
 
-	ret = avformat_alloc_output_context2(&out_OutputFormatContext, nullptr, "rtp", nullptr);
-	if (ret < 0) {
-		appLogger->error("Could not allocate output format context!");
-		goto output_error;
-	}
+			av_packet_rescale_ts(packet, pipeline.encoder->time_base, pipeline.stream->time_base);
+			packet->stream_index = pipeline.stream->index;
 
-	// Allocate custom AVIO context (for intercepting writes)
-	avio_ctx_buffer = (unsigned char*)av_malloc(4096);  // Buffer for AVIO context
-	avio_ctx = avio_alloc_context(avio_ctx_buffer, 4096, 1, this, nullptr, &custom_write, nullptr);
+			int64_t encoded = Poco::Timestamp().epochMicroseconds();
+			stats.encodeLatency.record(encoded - queuedFrame.queuedTime);
+			// the packet queue holds every packet of the pool, so this can't fail
+			pipeline.packets.push({ packet, queuedFrame.captureTime, encoded });
+			pipeline.packetsQueued.set();
+			packet = nullptr;
+		}
 
-	if (!avio_ctx) {
-		appLogger->error("Could not allocate AVIO context");
-		goto output_error;
+		if (pipeline.failed) {
+			break;
+		}
 	}
+	// the pool frees it with the rest when the session ends
+	pipeline.encoderPacket = packet;
+}
 
-	// Replace the default AVIO context with our custom one
-	out_OutputFormatContext->pb = avio_ctx;
-	out_OutputFormatContext->pb->max_packet_size = 1200;
-	out_OutputFormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
-	out_OutputFormatContext->oformat = out_OutputFormat;
-
-	// set codec parameters
-	out_Codec = (AVCodec*)avcodec_find_encoder(AV_CODEC_ID_VP9);
-	out_Stream = avformat_new_stream(out_OutputFormatContext, out_Codec);
-	out_CodecContext = avcodec_alloc_context3(out_Codec);
+void ScreenStreamer::runSender(Pipeline& pipeline) {
+	while (pipeline.running) {
+		// also while the projector doesn't change and nothing is written
+		startJoiningReceivers(pipeline);
 
-	appLogger->information("FFmpeg version: %s", std::string(av_version_info()));
-
-	if (!out_Codec) {
-		appLogger->error("Could not find VP9 codec.");
-		goto output_error;
-	}
+		QueuedPacket queuedPacket;
+		if (!pipeline.packets.pop(queuedPacket)) {
+			pipeline.packetsQueued.tryWait(10);
+			continue;
+		}
 
-	out_CodecContext->codec_id = AV_CODEC_ID_VP9;
-	out_CodecContext->codec_type = AVMEDIA_TYPE_VIDEO;
-	out_CodecContext->width = 1920;
-	out_CodecContext->height = 1080;
-	out_CodecContext->bit_rate = 3000;
-	out_CodecContext->pix_fmt = AV_PIX_FMT_YUV420P;
-	out_CodecContext->framerate = serverFrameRate;
-	out_CodecContext->time_base = av_inv_q(serverFrameRate);
-	out_CodecContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
-	out_OutputFormatContext->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+		// packetizes into RTP, handle_write hands the packets to the send queues of the receivers
+		pipeline.writingKeyframe = (queuedPacket.packet->flags & AV_PKT_FLAG_KEY) != 0;
+		pipeline.firstRtpPacket = true;
+		pipeline.writingPts = queuedPacket.packet->pts;
+		if (pipeline.recorder != nullptr) {
+			// only a reference, a full queue drops the packet instead of waiting
+			if (pipeline.recorder->write(queuedPacket.packet)) {
+				stats.allocations.packetReferenceAllocations++;
+			}
+		}
+		int ret = av_write_frame(pipeline.output, queuedPacket.packet);
+		pipeline.packetPool->release(queuedPacket.packet);
+		pipeline.packetsSent.set();
+
+		int64_t sent = Poco::Timestamp().epochMicroseconds();
+		stats.sendLatency.record(sent - queuedPacket.queuedTime);
+		stats.endToEndLatency.record(sent - queuedPacket.captureTime);
+		if (pipeline.isStarting) {
+			pipeline.isStarting = false;
+			(pipeline.isColdStart ? stats.coldStartLatency : stats.warmStartLatency).record(sent - pipeline.startTime);
+		}
 
-	if (out_OutputFormatContext->oformat->flags & AVFMT_GLOBALHEADER) {
-		out_CodecContext->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+		if (ret < 0) {
+			appLogger->error("Error muxing packet");
+			pipeline.failed = true;
+			break;
+		}
 	}
+}
 
-	ret = avcodec_parameters_from_context(out_Stream->codecpar, out_CodecContext);
-	if (ret < 0) {
-		appLogger->error("Could not initialize stream codec parameters!");
-		goto output_error;
-	}
-	
-	av_dict_set(&out_codecOptions, "quality", "realtime", 0);
-	av_dict_set(&out_codecOptions, "speed", "6", 0);
+/*void ScreenStreamer::getReceiver(int id, std::shared_ptr<Receiver>& recv) {
+	set<std::shared_ptr<Receiver>>::iterator itr;
 
-	ret = avcodec_open2(out_CodecContext, out_Codec, &out_codecOptions);
-	if (ret < 0) {
-		appLogger->error("Could not open video encoder!");
-		goto output_error;
+	for (itr = receivers.begin(); itr != receivers.end(); itr++) {
+		if (itr->get()->id == id) {
+			recv = *itr;
+			return;
+		}
 	}
 
-	av_dict_free(&out_codecOptions);
-
-	out_Stream->codecpar->extradata = out_CodecContext->extradata;
-	out_Stream->codecpar->extradata_size = out_CodecContext->extradata_size;
-
-	av_dump_format(out_OutputFormatContext, 0, nullptr, 1);
+	recv = NULL;
+}*/
 
-	ret = avformat_write_header(out_OutputFormatContext, NULL);
-	if (ret < 0) {
-		appLogger->error("Error occurred when writing header");
-		goto output_error;
-	}
 
-	if (false) {
-output_error:
-		// close input
-		avformat_close_input(&in_InputFormatContext);
-		if (in_InputFormatContext == NULL) {
-			appLogger->information("Input format context closed successuflly");
-		}
-		else {
-			appLogger->error("Input format context wasn't closed properly");
+void ScreenStreamer::getReceiver(const WebSocket& client, std::shared_ptr<Receiver>& recv) {
+	std::shared_ptr<const SnapshotList<Receiver>::Items> snapshot = receivers.get();
+	for (const std::shared_ptr<Receiver>& receiver : *snapshot) {
+		if (receiver->client == client) {
+			recv = receiver;
+			return;
 		}
+	}
 
-		avformat_free_context(in_InputFormatContext);
+	recv = NULL;
+}
 
-		avcodec_free_context(&in_codec_ctx);
-		if (in_codec_ctx == NULL) {
-			appLogger->information("Input codec context was closed successfully");
-		}
-		else {
-			appLogger->error("Input codec context wasn't closed properly");
-		}
 
-		// close output
-		avformat_free_context(out_OutputFormatContext);
-		avio_context_free(&avio_ctx);
-		if (avio_ctx == NULL) {
-			appLogger->information("AVIO context closed successfully");
-		} else {
-			appLogger->error("AVIO context wasn't closed properly");
-		}
+int ScreenStreamer::startSteaming() {
 
-		avcodec_free_context(&out_CodecContext);
-		if (out_CodecContext == NULL) {
-			appLogger->information("Output context closed sucessfully");
-		} else {
-			appLogger->error("Output context wasn't closed properly");
+	//#############################################
+	//## Wait for the first frame of the window  ##
+	//#############################################
+
+	// the picture of the projector window, the captured frames only bring the parts that changed
+	Screen screen;
+	int64_t screenCaptureTime = 0;
+	DamageRect screenDamage;
+	CapturedFrame* capturedFrame;
+
+	// the render loop only reads its frames back while the capture is enabled
+	frameCapture->setEnabled(true);
+	for (int i = 0; i < 50 && screen.width == 0 && !task->isCancelled(); i++) {
+		Thread::sleep(100);
+		while ((capturedFrame = frameCapture->takeFrame()) != nullptr) {
+			applyCapturedFrame(screen, capturedFrame, screenDamage);
+			screenCaptureTime = capturedFrame->captureTime;
+			frameCapture->recycleFrame(capturedFrame);
 		}
+	}
 
+	if (screen.width == 0) {
+		appLogger->error("error: no frame was captured from the projector window");
+		frameCapture->setEnabled(false);
 		return -1;
 	}
 
+	int streamWidth;
+	int streamHeight;
+	getStreamSize(screen.width, screen.height, streamWidth, streamHeight);
+	appLogger->information("FFmpeg version: %s", std::string(av_version_info()));
+	appLogger->information("Streaming %dx%d at %d fps, %d kbit/s", streamWidth, streamHeight, profile.fps, profile.bitrateKbps);
+	appLogger->information("Converting the frames with the %s kernel", std::string(ColorConverter::getKernelName(colorConverter.getKernel())));
+	// the recording has the first codec of the profile FFmpeg can encode, in the full size
+	isRecording = false;
+	if (recorder != nullptr) {
+		for (VideoCodec codec : profile.codecs) {
+			if (VideoEncoder::isAvailable(codec)) {
+				recordedCodec = codec;
+				isRecording = true;
+				appLogger->information("Recording %s", VideoEncoder::getCodecName(codec));
+				break;
+			}
+		}
+	}
+
 
 	//##########################################################
-	//## Send frames from input (screen) to the output server ##
+	//## Send frames from the projector to the output server  ##
 	//##########################################################
 
 	bool errorDuringServing = false;
-	AVPacket* pkt;
-	SwsContext* swsContext = sws_getContext(in_codec_ctx->width, in_codec_ctx->height, in_codec_ctx->pix_fmt, out_CodecContext->width, out_CodecContext->height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, nullptr, nullptr, nullptr);
-	
-	if (swsContext != NULL) {
-		appLogger->information("SWS context successfully created");
-	} else {
-		appLogger->error("Could not create SWS context");
-		goto end_server;
+	SwsContext* swsContext = NULL;
+	int64_t framePts = 0;
+	int64_t staticKeyframeInterval = (int64_t) profile.keyframeIntervalS * profile.fps;
+	int64_t frameInterval = 1000000 / profile.fps;
+	int64_t nextFrameTime = av_gettime_relative();
+	int64_t lastForcedKeyframeTime[maximumStreamLayers];
+	for (int layer = 0; layer < maximumStreamLayers; layer++) {
+		lastForcedKeyframeTime[layer] = nextFrameTime - minimumKeyframeIntervalMs * 1000;
 	}
-
-	pkt = av_packet_alloc();
-	if (!pkt) {
-		appLogger->error("Could not allocate AVPacket");
-		goto end_server;
+	// one per codec the receivers negotiated and simulcast layer, every codec gets the same frames
+	std::map<std::pair<VideoCodec, int>, Pipeline*> pipelines;
+	// the picture converted for the encoders, kept for the whole session so only the damaged parts are converted again
+	AVFrame* convertedFrame = av_frame_alloc();
+	if (convertedFrame != nullptr) {
+		stats.allocations.frameAllocations++;
+		convertedFrame->width = streamWidth;
+		convertedFrame->height = streamHeight;
+		convertedFrame->format = AV_PIX_FMT_YUV420P;
+		if (av_frame_get_buffer(convertedFrame, 0) < 0) {
+			av_frame_free(&convertedFrame);
+		} else {
+			stats.allocations.frameBufferAllocations++;
+		}
+	}
+	if (convertedFrame == nullptr) {
+		appLogger->error("Could not allocate the converted frame");
+		errorDuringServing = true;
 	}
+	// the smaller simulcast layers are scaled from the converted frame, layer 0 is the converted frame itself
+	AVFrame* layerFrames[maximumStreamLayers] = { convertedFrame };
+	SwsContext* layerSwsContexts[maximumStreamLayers] = {};
+	for (int layer = 1; layer < profile.layers && !errorDuringServing; layer++) {
+		int layerWidth;
+		int layerHeight;
+		getLayerSize(layer, streamWidth, streamHeight, layerWidth, layerHeight);
+		layerFrames[layer] = av_frame_alloc();
+		layerSwsContexts[layer] = sws_getContext(streamWidth, streamHeight, AV_PIX_FMT_YUV420P, layerWidth, layerHeight, AV_PIX_FMT_YUV420P, SWS_BILINEAR, nullptr, nullptr, nullptr);
+		if (layerFrames[layer] == nullptr || layerSwsContexts[layer] == nullptr) {
+			appLogger->error("Could not set up simulcast layer %d", layer);
+			errorDuringServing = true;
+			break;
+		}
+		stats.allocations.frameAllocations++;
+		layerFrames[layer]->width = layerWidth;
+		layerFrames[layer]->height = layerHeight;
+		layerFrames[layer]->format = AV_PIX_FMT_YUV420P;
+		if (av_frame_get_buffer(layerFrames[layer], 0) < 0) {
+			appLogger->error("Could not allocate the frame of simulcast layer %d", layer);
+			errorDuringServing = true;
+			break;
+		}
+		stats.allocations.frameBufferAllocations++;
+		appLogger->information("Simulcast layer %d: %dx%d at %d kbit/s", layer, layerWidth, layerHeight, getLayerBitrateKbps(profile, layer));
+	}
+	// the first frame has to be converted completely
+	screenDamage = DamageRect::full(screen.width, screen.height);
 	
 	mutex->lock();
 	shouldStream = true;
 	mutex->unlock();
 
-	while (!task->isCancelled()) {
+	while (!task->isCancelled() && !errorDuringServing) {
 		mutex->lock();
 
 		if (!shouldStream) {
@@ -471,160 +750,432 @@ output_error:
 			mutex->unlock();
 		}
 
-		if (receivers.size() <= 0) {
-			Thread::sleep(100); // wait 100 ms then check again
-			continue;
+		for (auto& codecPipeline : pipelines) {
+			if (codecPipeline.second->failed) {
+				errorDuringServing = true;
+			}
 		}
-
-		AVStream* in_stream, * out_stream;
-
-		ret = av_read_frame(in_InputFormatContext, pkt);
-		if (ret < 0) {
-			appLogger->error("Could not read frame");
-			errorDuringServing = true;
+		if (errorDuringServing) {
 			break;
 		}
 
-		in_stream = in_InputFormatContext->streams[pkt->stream_index];
-
-		out_stream = out_OutputFormatContext->streams[pkt->stream_index];
-
-		AVFrame* frame = av_frame_alloc();
-		AVFrame* out_frame = av_frame_alloc();
-
-		out_frame->width = out_CodecContext->width;
-		out_frame->height = out_CodecContext->height;
-		out_frame->format = out_CodecContext->pix_fmt;
-
-		av_frame_get_buffer(out_frame, 0);
-
-		ret = avcodec_send_packet(in_codec_ctx, pkt);
-		if (ret < 0) {
-			appLogger->error("Error sending packet to codec");
-			errorDuringServing = true;
-			break;
+		updateReceiverSenders();
+		std::shared_ptr<const SnapshotList<Receiver>::Items> currentReceivers = receivers.get();
+		// every layer of the codecs of the connected receivers, they switch between the layers with their bandwidth
+		std::set<std::pair<VideoCodec, int>> usedPipelines;
+		for (const std::shared_ptr<Receiver>& receiver : *currentReceivers) {
+			if (receiver->isConnected && receiver->hasCodec) {
+				for (int layer = 0; layer < profile.layers; layer++) {
+					usedPipelines.insert({ receiver->codec, layer });
+				}
+			}
 		}
-
-		ret = avcodec_receive_frame(in_codec_ctx, frame);
-
-		if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-			appLogger->error("Error: AVERROR(EAGAIN) or AVERROR_EOF when receiving frames from desktop capture");
+		if (isRecording) {
+			// the recording keeps the encoder of its layer running while nobody watches
+			usedPipelines.insert({ recordedCodec, 0 });
+		}
+		// the encoders of the others are parked until one comes back
+		for (auto& codecPipeline : pipelines) {
+			if (!codecPipeline.second->isParked && usedPipelines.count(codecPipeline.first) == 0) {
+				parkPipeline(codecPipeline.second);
+			}
+		}
+		if (usedPipelines.empty()) {
+			// nobody is watching, stop reading the frames back and sleep until a receiver connects
+			frameCapture->setEnabled(false);
+			receiversChanged.wait();
+			nextFrameTime = av_gettime_relative();
 			continue;
 		}
-		else if (ret < 0) {
-			appLogger->error("Error receiving frame from codec");
-			errorDuringServing = true;
-			av_frame_free(&frame);
-			break;
+		frameCapture->setEnabled(true);
+
+		for (const std::pair<VideoCodec, int>& key : usedPipelines) {
+			auto codecPipeline = pipelines.find(key);
+			if (codecPipeline == pipelines.end()) {
+				Pipeline* pipeline = openPipeline(key.first, key.second, layerFrames[key.second]->width, layerFrames[key.second]->height);
+				if (pipeline == nullptr) {
+					errorDuringServing = true;
+					break;
+				}
+				pipelines[key] = pipeline;
+			} else if (codecPipeline->second->isParked) {
+				resumePipeline(codecPipeline->second);
+			}
 		}
-
-		AVPacket* outPacket = av_packet_alloc();
-
-		sws_scale(swsContext, frame->data, frame->linesize, 0, in_codec_ctx->height, out_frame->data, out_frame->linesize);
-
-		ret = avcodec_send_frame(out_CodecContext, out_frame);
-		if (ret < 0) {
-			appLogger->error("Error encoding frame for output");
-			errorDuringServing = true;
-			av_frame_free(&frame);
-			av_frame_free(&out_frame);
+		if (errorDuringServing) {
 			break;
 		}
 
-		ret = avcodec_receive_packet(out_CodecContext, outPacket);
-		if (ret < 0) {
-			av_packet_unref(pkt);
-			av_packet_unref(outPacket);
-			av_frame_free(&frame);
-			av_frame_free(&out_frame);
-			av_packet_free(&outPacket);
-			if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-				// EAGAIN: Need to feed more frames
-				continue;
+		// the projector only renders when something changes, so the encoder keeps its own pace
+		int64_t now = av_gettime_relative();
+		if (nextFrameTime > now) {
+			av_usleep((unsigned int) (nextFrameTime - now));
+		} else if (now - nextFrameTime > frameInterval) {
+			// fell behind, don't try to catch up with a burst of frames
+			nextFrameTime = now;
+		}
+		nextFrameTime += frameInterval;
+
+		// every frame rendered since the last tick, each one patches the part of the picture that changed
+		int64_t convertStart = Poco::Timestamp().epochMicroseconds();
+		while ((capturedFrame = frameCapture->takeFrame()) != nullptr) {
+			stats.captureLatency.record(convertStart - capturedFrame->captureTime);
+			applyCapturedFrame(screen, capturedFrame, screenDamage);
+			screenCaptureTime = capturedFrame->captureTime;
+			frameCapture->recycleFrame(capturedFrame);
+		}
+		// rendered again without changes (e.g. the window was exposed) is still the same picture
+		bool hasChanged = !screenDamage.isEmpty();
+
+		if (hasChanged) {
+			// glReadPixels gives the rows bottom up, start at the last one with a negative stride to flip the image
+			const uint8_t* captureData[1] = { screen.pixels.data() + (size_t) (screen.height - 1) * screen.width * 4 };
+			int captureLinesize[1] = { -screen.width * 4 };
+			DamageRect streamDamage;
+
+			if (screen.width - streamWidth <= 1 && screen.width >= streamWidth && screen.height - streamHeight <= 1 && screen.height >= streamHeight) {
+				// same size (an odd last column or row is left out), nothing to scale, only the damage is converted
+				colorConverter.convertRect(captureData[0], captureLinesize[0], streamWidth, streamHeight, ColorConverter::PixelOrder::RGBA, convertedFrame->data, convertedFrame->linesize,
+					screenDamage.x, screen.height - screenDamage.y - screenDamage.height, screenDamage.width, screenDamage.height);
+				streamDamage = screenDamage;
+				// the stream leaves out the bottom row of an odd height, the rows move up by one
+				streamDamage.y -= screen.height - streamHeight;
+				stats.pixelsConverted += (unsigned long long) screenDamage.width * screenDamage.height;
 			} else {
-				appLogger->error("Error encoding packet for output");
-				errorDuringServing = true;
-				break;
+				swsContext = sws_getCachedContext(swsContext, screen.width, screen.height, AV_PIX_FMT_RGBA, streamWidth, streamHeight, AV_PIX_FMT_YUV420P, SWS_BICUBIC, nullptr, nullptr, nullptr);
+				if (swsContext == NULL) {
+					appLogger->error("Could not create SWS context");
+					errorDuringServing = true;
+					break;
+				}
+				sws_scale(swsContext, captureData, captureLinesize, 0, screen.height, convertedFrame->data, convertedFrame->linesize);
+				stats.pixelsConverted += (unsigned long long) screen.width * screen.height;
+				// the bicubic filter spreads a change by a couple of pixels
+				double scaleX = (double) streamWidth / screen.width;
+				double scaleY = (double) streamHeight / screen.height;
+				streamDamage.x = (int) std::floor(screenDamage.x * scaleX) - 2;
+				streamDamage.y = (int) std::floor(screenDamage.y * scaleY) - 2;
+				streamDamage.width = (int) std::ceil((screenDamage.x + screenDamage.width) * scaleX) + 2 - streamDamage.x;
+				streamDamage.height = (int) std::ceil((screenDamage.y + screenDamage.height) * scaleY) + 2 - streamDamage.y;
+			}
+			streamDamage.clip(streamWidth, streamHeight);
+			screenDamage = DamageRect();
+
+			DamageRect layerDamage[maximumStreamLayers];
+			layerDamage[0] = streamDamage;
+			for (int layer = 1; layer < profile.layers; layer++) {
+				// small enough to scale the whole frame, the filter spreads the change by a pixel or two
+				sws_scale(layerSwsContexts[layer], convertedFrame->data, convertedFrame->linesize, 0, streamHeight, layerFrames[layer]->data, layerFrames[layer]->linesize);
+				layerDamage[layer].x = (streamDamage.x >> layer) - 2;
+				layerDamage[layer].y = (streamDamage.y >> layer) - 2;
+				layerDamage[layer].width = ((streamDamage.x + streamDamage.width) >> layer) + 3 - layerDamage[layer].x;
+				layerDamage[layer].height = ((streamDamage.y + streamDamage.height) >> layer) + 3 - layerDamage[layer].y;
+				layerDamage[layer].clip(layerFrames[layer]->width, layerFrames[layer]->height);
+			}
+
+			for (auto& codecPipeline : pipelines) {
+				codecPipeline.second->damage.unite(layerDamage[codecPipeline.second->layer]);
 			}
 		}
 
-		outPacket->dts = pkt->dts;
-		outPacket->pts = pkt->pts;
+		// the pts keeps counting while nothing is encoded, so the RTP timestamps stay on the wall clock
+		int64_t tickPts = framePts++;
+		// a request that comes too soon after the last forced keyframe waits, every receiver asking would flood the stream with them
+		bool keyframeForLayer[maximumStreamLayers] = {};
+		for (int layer = 0; layer < profile.layers; layer++) {
+			if (now - lastForcedKeyframeTime[layer] >= minimumKeyframeIntervalMs * 1000 && layerKeyframeRequested[layer].exchange(false)) {
+				keyframeForLayer[layer] = true;
+				lastForcedKeyframeTime[layer] = now;
+			}
+		}
+		bool isSuppressed = true;
 
-		ret = av_write_frame(out_OutputFormatContext, outPacket);
+		for (auto& codecPipeline : pipelines) {
+			Pipeline* pipeline = codecPipeline.second;
+			if (pipeline->isParked) {
+				continue;
+			}
+			bool isChanged = hasChanged || pipeline->lastEncodedPts < 0 || pipeline->changePending;
+			bool forceKeyframe = keyframeForLayer[pipeline->layer] || pipeline->keyframePending || (!isChanged && tickPts - pipeline->lastKeyframePts >= staticKeyframeInterval);
+			if (!isChanged && !forceKeyframe) {
+				// nothing new on the projector, the receivers keep showing the last frame
+				continue;
+			}
+			isSuppressed = false;
+
+			AVFrame* out_frame = pipeline->framePool->acquire();
+			if (out_frame == nullptr) {
+				// the encoder is behind and all frames are queued, try again with the next tick
+				pipeline->changePending = isChanged;
+				pipeline->keyframePending = forceKeyframe;
+				stats.framesDeferred++;
+				continue;
+			}
+			pipeline->changePending = false;
+			pipeline->keyframePending = false;
+
+			// only the encoder threads read the queued frames, the converted one stays as it is
+			av_frame_copy(out_frame, layerFrames[pipeline->layer]);
+
+			out_frame->pts = tickPts;
+			if (forceKeyframe) {
+				out_frame->pict_type = AV_PICTURE_TYPE_I;
+				stats.keyframesForced++;
+			} else if (pipeline->lastEncodedPts >= 0 && !pipeline->damage.covers(out_frame->width, out_frame->height)) {
+				addRegionOfInterest(out_frame, pipeline->damage);
+			}
+			pipeline->damage = DamageRect();
+			pipeline->lastEncodedPts = tickPts;
 
-		av_packet_unref(pkt);
-		av_packet_unref(outPacket);
-		av_frame_free(&frame);
-		av_frame_free(&out_frame);
-		av_packet_free(&outPacket);
+			int64_t convertEnd = Poco::Timestamp().epochMicroseconds();
+			stats.convertLatency.record(convertEnd - convertStart);
+			pipeline->frames.push({ out_frame, screenCaptureTime, convertEnd });
+			pipeline->framesQueued.set();
+		}
 
-		if (ret < 0) {
-			appLogger->error("Error muxing packet");
-			errorDuringServing = true;
-			break;
+		if (isSuppressed) {
+			stats.framesSuppressed++;
 		}
 	}
 
-end_server:
-
 	appLogger->information("Ending server");
 	
 	//##########################
 	//## free the used memory ##
 	//##########################
 
+	for (auto& codecPipeline : pipelines) {
+		closePipeline(codecPipeline.second);
+	}
+	pipelines.clear();
+	// after the senders, they were the ones writing to it
+	if (recorder != nullptr) {
+		recorder->stop();
+	}
+
+	// the receivers stay registered for the next session, their threads don't
+	stopLeftReceiverSenders();
+	std::shared_ptr<const SnapshotList<Receiver>::Items> remainingReceivers = receivers.get();
+	for (const std::shared_ptr<Receiver>& receiver : *remainingReceivers) {
+		stopReceiverSender(*receiver);
+	}
+
 	sws_freeContext(swsContext);
-	if (swsContext == NULL) {
-		appLogger->information("SWS context closed successfully");
+	swsContext = NULL;
+	for (int layer = 1; layer < maximumStreamLayers; layer++) {
+		sws_freeContext(layerSwsContexts[layer]);
+		av_frame_free(&layerFrames[layer]);
+	}
+	av_frame_free(&convertedFrame);
+
+	frameCapture->setEnabled(false);
+	while ((capturedFrame = frameCapture->takeFrame()) != nullptr) {
+		frameCapture->recycleFrame(capturedFrame);
+	}
+
+	stopEvent->set();
+	if (errorDuringServing) {
+		return 0;
 	} else {
-		appLogger->information("SWS context wasn't closed properly");
+		return -1;
 	}
+}
 
-	av_packet_free(&pkt);
-	
+void ScreenStreamer::applyCapturedFrame(Screen& screen, CapturedFrame* frame, DamageRect& damage) {
+	if (frame->width != screen.width || frame->height != screen.height) {
+		if (!frame->damage.covers(frame->width, frame->height)) {
+			// a part of a picture with another size, it can only be patched into a whole one
+			frameCapture->requestFullFrame();
+			return;
+		}
+		screen.width = frame->width;
+		screen.height = frame->height;
+		screen.pixels.resize((size_t) screen.width * screen.height * 4);
+	}
 
-	// close input
-	avformat_close_input(&in_InputFormatContext);
-	if (in_InputFormatContext == NULL) {
-		appLogger->information("Input format context closed successuflly");
+	const DamageRect& rect = frame->damage;
+	for (int row = 0; row < rect.height; row++) {
+		std::memcpy(screen.pixels.data() + ((size_t) (rect.y + row) * screen.width + rect.x) * 4, frame->pixels.data() + (size_t) row * rect.width * 4, (size_t) rect.width * 4);
 	}
-	else {
-		appLogger->error("Input format context wasn't closed properly");
+	damage.unite(rect);
+}
+
+void ScreenStreamer::addRegionOfInterest(AVFrame* frame, const DamageRect& damage) {
+	if (damage.isEmpty()) {
+		return;
+	}
+	AVFrameSideData* sideData = av_frame_new_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST, sizeof(AVRegionOfInterest));
+	if (sideData == nullptr) {
+		return;
 	}
+	// top down, a negative offset is a better quality for the text that changed, the rest of the frame is mostly skipped anyway
+	AVRegionOfInterest* region = (AVRegionOfInterest*) sideData->data;
+	region->self_size = sizeof(AVRegionOfInterest);
+	region->top = frame->height - damage.y - damage.height;
+	region->bottom = frame->height - damage.y;
+	region->left = damage.x;
+	region->right = damage.x + damage.width;
+	region->qoffset = av_make_q(-1, 5);
+}
 
-	avformat_free_context(in_InputFormatContext);
+ScreenStreamer::Pipeline* ScreenStreamer::openPipeline(VideoCodec codec, int layer, int width, int height) {
 
-	avcodec_free_context(&in_codec_ctx);
-	if (in_codec_ctx == NULL) {
-		appLogger->information("Input codec context was closed successfully");
+	//##########################################
+	//## Configure output format && codecs    ##
+	//##########################################
+
+	Pipeline* pipeline = new Pipeline(this, codec, layer, appLogger, numberOfPipelineFrames, numberOfPipelinePackets);
+	pipeline->startTime = Poco::Timestamp().epochMicroseconds();
+	pipeline->isColdStart = true;
+	// a replay fills at most half of the send queue of a receiver that joins, the other half is left for the live packets
+	size_t cacheBytes = std::max(minimumReceiverBufferBytes, (size_t) profile.bitrateKbps * 1000 / 8) / 2;
+	pipeline->keyframeCache = std::make_unique<KeyframeCache>(RtpSendQueue::getNumberOfPackets(cacheBytes, maximumRtpPacketSize), cacheBytes, maximumRtpPacketSize);
+	pipeline->replayBuffer.reserve(maximumRtpPacketSize);
+	const AVOutputFormat* out_OutputFormat = av_guess_format("rtp", NULL, NULL);
+	unsigned char* avio_ctx_buffer;
+
+	int ret = avformat_alloc_output_context2(&pipeline->output, nullptr, "rtp", nullptr);
+	if (ret < 0) {
+		appLogger->error("Could not allocate output format context!");
+		closePipeline(pipeline);
+		return nullptr;
 	}
-	else {
-		appLogger->error("Input codec context wasn't closed properly");
+
+	// Allocate custom AVIO context (for intercepting writes)
+	avio_ctx_buffer = (unsigned char*)av_malloc(4096);  // Buffer for AVIO context
+	pipeline->avio = avio_alloc_context(avio_ctx_buffer, 4096, 1, pipeline, nullptr, &custom_write, nullptr);
+
+	if (!pipeline->avio) {
+		appLogger->error("Could not allocate AVIO context");
+		av_free(avio_ctx_buffer);
+		closePipeline(pipeline);
+		return nullptr;
 	}
 
-	// close output
-	avformat_free_context(out_OutputFormatContext);
-	avio_context_free(&avio_ctx);
-	if (avio_ctx == NULL) {
-		appLogger->information("AVIO context closed successfully");
+	// Replace the default AVIO context with our custom one
+	pipeline->output->pb = pipeline->avio;
+	pipeline->output->pb->max_packet_size = maximumRtpPacketSize;
+	pipeline->output->flags |= AVFMT_FLAG_CUSTOM_IO;
+	pipeline->output->oformat = out_OutputFormat;
+	pipeline->output->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+	// the payload type the offer has for the codec
+	av_opt_set_int(pipeline->output->priv_data, "payload_type", VideoEncoder::getPayloadType(codec), 0);
+
+	StreamProfile layerProfile = profile;
+	layerProfile.bitrateKbps = getLayerBitrateKbps(profile, layer);
+	ret = pipeline->videoEncoder.open(codec, layerProfile, width, height, (pipeline->output->oformat->flags & AVFMT_GLOBALHEADER) != 0);
+	if (ret < 0) {
+		closePipeline(pipeline);
+		return nullptr;
 	}
-	else {
-		appLogger->error("AVIO context wasn't closed properly");
+	pipeline->encoder = pipeline->videoEncoder.getContext();
+
+	pipeline->stream = avformat_new_stream(pipeline->output, nullptr);
+	if (pipeline->stream == nullptr) {
+		appLogger->error("Could not create the output stream!");
+		closePipeline(pipeline);
+		return nullptr;
 	}
+	pipeline->stream->time_base = pipeline->encoder->time_base;
 
-	avcodec_free_context(&out_CodecContext);
-	if (out_CodecContext == NULL) {
-		appLogger->information("Output context closed sucessfully");
+	// also copies the extradata of the encoder
+	ret = avcodec_parameters_from_context(pipeline->stream->codecpar, pipeline->encoder);
+	if (ret < 0) {
+		appLogger->error("Could not initialize stream codec parameters!");
+		closePipeline(pipeline);
+		return nullptr;
 	}
-	else {
-		appLogger->error("Output context wasn't closed properly");
+
+	av_dump_format(pipeline->output, 0, nullptr, 1);
+
+	ret = avformat_write_header(pipeline->output, NULL);
+	if (ret < 0) {
+		appLogger->error("Error occurred when writing header");
+		closePipeline(pipeline);
+		return nullptr;
 	}
 
-	stopEvent->set();
-	if (errorDuringServing) {
-		return 0;
-	} else {
-		return -1;
+	// everything the stages need per frame is allocated once here
+	pipeline->framePool = std::make_unique<FramePool>(numberOfPipelineFrames, width, height, pipeline->encoder->pix_fmt, &stats.allocations);
+	pipeline->packetPool = std::make_unique<PacketPool>(numberOfPipelinePackets, &stats.allocations);
+	if (!pipeline->framePool->isValid() || !pipeline->packetPool->isValid()) {
+		appLogger->error("Could not allocate the frame and packet pools");
+		closePipeline(pipeline);
+		return nullptr;
+	}
+
+	if (isRecording && codec == recordedCodec && layer == 0 && recorder->start(codec, pipeline->stream->codecpar, pipeline->stream->time_base)) {
+		pipeline->recorder = recorder.get();
+	}
+
+	startPipelineThreads(pipeline);
+	return pipeline;
+}
+
+void ScreenStreamer::startPipelineThreads(Pipeline* pipeline) {
+	pipeline->isStarting = true;
+	pipeline->running = true;
+	pipeline->encoderThread.startFunc([this, pipeline]() { runEncoder(*pipeline); });
+	pipeline->senderThread.startFunc([this, pipeline]() { runSender(*pipeline); });
+}
+
+void ScreenStreamer::stopPipelineThreads(Pipeline* pipeline) {
+	pipeline->running = false;
+	pipeline->framesQueued.set();
+	pipeline->packetsQueued.set();
+	pipeline->packetsSent.set();
+	if (pipeline->encoderThread.isRunning()) {
+		pipeline->encoderThread.join();
 	}
+	if (pipeline->senderThread.isRunning()) {
+		pipeline->senderThread.join();
+	}
+}
+
+void ScreenStreamer::parkPipeline(Pipeline* pipeline) {
+	appLogger->information("Nobody receives %s layer %d, parking its encoder", VideoEncoder::getCodecName(pipeline->codec), pipeline->layer);
+	stopPipelineThreads(pipeline);
+	// both threads are joined, what they left in the queues goes back to the pools from here
+	QueuedFrame queuedFrame;
+	while (pipeline->frames.pop(queuedFrame)) {
+		pipeline->framePool->release(queuedFrame.frame);
+	}
+	QueuedPacket queuedPacket;
+	while (pipeline->packets.pop(queuedPacket)) {
+		pipeline->packetPool->release(queuedPacket.packet);
+	}
+	pipeline->keyframeCache->clear();
+	pipeline->isParked = true;
+}
+
+void ScreenStreamer::resumePipeline(Pipeline* pipeline) {
+	appLogger->information("Resuming the parked %s encoder of layer %d", VideoEncoder::getCodecName(pipeline->codec), pipeline->layer);
+	pipeline->startTime = Poco::Timestamp().epochMicroseconds();
+	pipeline->isColdStart = false;
+	// the encoder is still open, it only needs a keyframe of the current picture
+	pipeline->changePending = true;
+	pipeline->keyframePending = true;
+	pipeline->isParked = false;
+	startPipelineThreads(pipeline);
+}
+
+void ScreenStreamer::closePipeline(Pipeline* pipeline) {
+	stopPipelineThreads(pipeline);
+
+	// close output
+	avformat_free_context(pipeline->output);
+	if (pipeline->avio != NULL) {
+		av_freep(&pipeline->avio->buffer);
+	}
+	avio_context_free(&pipeline->avio);
+	if (pipeline->avio == NULL) {
+		appLogger->information("AVIO context closed successfully");
+	}
+	else {
+		appLogger->error("AVIO context wasn't closed properly");
+	}
+
+	pipeline->videoEncoder.close();
+	pipeline->encoder = nullptr;
+	delete pipeline;
 }
@@ -11,6 +11,11 @@
 #include <string.h>
 #include <sstream>
 #include <set>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 
 #define __STDC_CONSTANT_MACROS
 
@@ -20,8 +25,6 @@ extern "C"
 #include "libavcodec/avcodec.h"
 #include "libavcodec/avfft.h"
 
-#include "libavdevice/avdevice.h"
-
 #include "libavfilter/avfilter.h"
 #include "libavfilter/avfilter_internal.h"
 #include "libavfilter/buffersink.h"
@@ -50,6 +53,16 @@ extern "C"
 }
 
 #include "rtc/rtc.hpp"
+#include "FrameCapture.h"
+#include "StreamPools.h"
+#include "LatencyHistogram.h"
+#include "VideoEncoder.h"
+#include "ColorConverter.h"
+#include "SnapshotList.h"
+#include "RtpSendQueue.h"
+#include "RembHandler.h"
+#include "KeyframeCache.h"
+#include "StreamRecorder.h"
 
 #include "Poco/JSON/Object.h"
 #include "Poco/JSON/Stringifier.h"
@@ -71,40 +84,236 @@ using Poco::JSON::Object;
 using Poco::Net::WebSocket;
 
 struct Receiver {
+	Receiver(const WebSocket& client) : client(client) {}
+
 	std::shared_ptr<rtc::PeerConnection> conn;
 	std::shared_ptr<rtc::Track> track;
-	WebSocket* client;
-	std::string offer;
-	bool isConnected = false;
-	//int id;
+	WebSocket client;	// a copy shares the connection, it stays valid after the request that registered the receiver
+	// set from the libdatachannel threads, read by the senders
+	std::atomic<bool> isConnected{ false };
+	VideoCodec codec = VideoCodec::VP9;	// negotiated with the answer, written before hasCodec
+	std::atomic<bool> hasCodec{ false };
+	int id = 0;
+	// the RTP packets of the receiver, sent by its own thread while the stream runs
+	std::unique_ptr<RtpSendQueue> sendQueue;
+	Thread sendThread{ "ReceiverSender" };
+	std::atomic<bool> sending{ false };
+	// simulcast: the layer the receiver gets, it switches to the target at the next keyframe of that layer.
+	// Only changed under the mutex, the senders of the layers the receiver doesn't get read it without taking it.
+	// The sequence numbers continue across a switch.
+	Mutex layerMutex;
+	std::atomic<int> layer{ 0 };
+	std::atomic<int> targetLayer{ 0 };
+	uint16_t sequenceNumberOffset = 0;
+	uint16_t lastSequenceNumber = 0;
+	std::atomic<bool> hasStarted{ false };	// got its first keyframe, from the cache of its layer or a new one
+	std::atomic<unsigned int> bandwidthEstimate{ 0 };	// bit/s from the receiver's REMB, 0 until it sent one
+};
+
+struct ReceiverStats {
+	int id;
+	std::string codec;	// empty until the answer was set
+	bool isConnected;
+	size_t bufferedBytes;
+	unsigned long long packetsSent;
+	unsigned long long packetsDropped;
+	unsigned long long keyframeWaits;	// how often the queue ran full and dropped until the next keyframe
+	int layer;
+	unsigned int bandwidthEstimateKbps;	// 0 if the receiver didn't send one
+};
+
+struct RecordingStats {
+	bool isRecording;
+	std::string file;	// the segment being written, empty if there is none
+	unsigned long long segments;
+	unsigned long long bytesWritten;
+	unsigned long long packetsDropped;	// the disk was too slow, dropped until the next keyframe
+};
+
+struct StreamStats {
+	std::atomic<unsigned long long> framesEncoded{ 0 };
+	std::atomic<unsigned long long> framesSuppressed{ 0 };	// not encoded because the projector didn't change
+	std::atomic<unsigned long long> keyframesForced{ 0 };
+	std::atomic<unsigned long long> keyframeRequests{ 0 };	// PLIs and FIRs of the receivers
+	std::atomic<unsigned long long> cacheJoins{ 0 };	// receivers that started with the cached keyframe instead of a new one
+	std::atomic<unsigned long long> framesDropped{ 0 };	// converted, but a newer frame was encoded instead
+	std::atomic<unsigned long long> framesDeferred{ 0 };	// not converted, every frame of the pool was queued, the change goes into the next tick
+	std::atomic<unsigned long long> pixelsConverted{ 0 };	// only the damaged parts of a frame are converted
+	AllocationStats allocations;
+	// per stage: captured -> taken by the converter, converting, queued -> encoded, encoded -> sent to the receivers
+	LatencyHistogram captureLatency;
+	LatencyHistogram convertLatency;
+	LatencyHistogram encodeLatency;
+	LatencyHistogram sendLatency;
+	LatencyHistogram endToEndLatency;	// captured -> sent
+	// an encoder started for a receiver -> its first packet sent: cold opens the encoder, warm resumes a parked one
+	LatencyHistogram coldStartLatency;
+	LatencyHistogram warmStartLatency;
 };
 
 class ScreenStreamer {
 public:
 
-	ScreenStreamer(Task* tsk, Event* stop_event, Mutex* mtx, Logger* logger);
+	ScreenStreamer(Task* tsk, Event* stop_event, Mutex* mtx, Logger* logger, FrameCapture* frame_capture, const StreamProfile& stream_profile, const RecordingSettings& recording_settings);
 	~ScreenStreamer();
 
 	int startSteaming();
 	void stopStreaming();
 	bool isStreaming();
-	int handle_write(uint8_t* buf, int buf_size);
 
-	int registerReceiver(WebSocket& client, Event* offerEvent);
-	std::string getOffer(WebSocket& client);
+	// returns right away, onOffer gets the offer (JSON with type and sdp) from a libdatachannel thread when the ICE candidates are gathered
+	int registerReceiver(const WebSocket& client, std::function<void(const std::string&)> onOffer);
 	int setAnswer(WebSocket& client, Object::Ptr answerJSON);
+	const StreamStats& getStats();
+	std::vector<ReceiverStats> getReceiverStats();
+	RecordingStats getRecordingStats();
 
 private:
-	int receiverIdCount = 1;
+	// A stream session runs in three stages, each on its own thread: converting the captured frames (the task thread),
+	// encoding and sending the packets to the receivers. The stages hand over through lock-free queues.
+	struct QueuedFrame {
+		AVFrame* frame;
+		int64_t captureTime;	// microseconds, Poco::Timestamp
+		int64_t queuedTime;
+	};
+	struct QueuedPacket {
+		AVPacket* packet;
+		int64_t captureTime;
+		int64_t queuedTime;
+	};
+	// Encodes and packetizes the frames for one codec and simulcast layer, opened when the first receiver negotiated the codec
+	struct Pipeline {
+		Pipeline(ScreenStreamer* streamer, VideoCodec codec, int layer, Logger* logger, int numberOfFrames, int numberOfPackets) :
+			videoEncoder(logger), frames(numberOfFrames), packets(numberOfPackets), encoderThread("StreamEncoder"), senderThread("StreamSender"), receiverReader(streamer->receivers) {
+			this->streamer = streamer;
+			this->codec = codec;
+			this->layer = layer;
+		}
+
+		ScreenStreamer* streamer;
+		VideoCodec codec;
+		int layer;	// 0 is the full size
+		VideoEncoder videoEncoder;
+		AVCodecContext* encoder = nullptr;
+		AVFormatContext* output = nullptr;
+		AVIOContext* avio = nullptr;
+		AVStream* stream = nullptr;
+		std::unique_ptr<FramePool> framePool;
+		std::unique_ptr<PacketPool> packetPool;
+		SPSCQueue<QueuedFrame> frames;		// converter -> encoder
+		SPSCQueue<QueuedPacket> packets;	// encoder -> sender
+		Event framesQueued;
+		Event packetsQueued;
+		Event packetsSent;
+		Thread encoderThread;
+		Thread senderThread;
+		std::atomic<int64_t> lastKeyframePts{ 0 };
+		std::atomic<bool> running{ false };
+		std::atomic<bool> failed{ false };
+		AVPacket* encoderPacket = nullptr;	// encoder only, acquired from the pool but not filled yet
+		StreamRecorder* recorder = nullptr;	// the full size layer of the recorded codec tees its packets into the recording
+		// set before the threads start, the sender records the start latency with the first packet
+		int64_t startTime = 0;
+		bool isColdStart = true;
+		bool isStarting = false;
+		// whoever writes to the output, the sender thread while it runs
+		SnapshotList<Receiver>::Reader receiverReader;
+		std::unique_ptr<KeyframeCache> keyframeCache;
+		std::vector<uint8_t> replayBuffer;	// a cached packet with the timestamp of the receiver that joins
+		bool writingKeyframe = false;
+		bool firstRtpPacket = false;	// the next RTP packet starts the AVPacket being written
+		int64_t writingPts = 0;
+		// the muxer starts the RTP timestamps at a random value, every layer has to start at the same one for the switches
+		bool hasTimestampBase = false;
+		uint32_t timestampBase = 0;
+		// converter only
+		int64_t lastEncodedPts = -1;
+		bool changePending = false;	// a change that couldn't be converted (all frames queued) is sent with the next tick
+		bool keyframePending = false;
+		DamageRect damage;	// changed since the last frame that was queued, in pixels of the stream
+		bool isParked = false;	// none of the receivers has the codec, the threads are stopped but the encoder stays open
+	};
+
+	// the projector window as the streamer has seen it so far, RGBA rows bottom up
+	struct Screen {
+		std::vector<unsigned char> pixels;
+		int width = 0;
+		int height = 0;
+	};
+
+	// every frame of the pool fits into the frame queue, so the converter never has to wait for the encoder,
+	// it skips a tick when the pool is empty
+	static const int numberOfPipelineFrames = 4;
+	static const int numberOfPipelinePackets = 16;
+	// per receiver: one second of the stream, but at least 512 kB
+	static constexpr size_t minimumReceiverBufferBytes = 512 * 1024;
+	// max_packet_size of the RTP muxer, fits into the MTU with the SRTP and UDP headers
+	static const int maximumRtpPacketSize = 1200;
+	// keyframes the receivers ask for are forced at most this often per layer, the ones they need to join come from the cache
+	static const int minimumKeyframeIntervalMs = 500;
+	// about 8 seconds of the stream at 30 fps
+	static const int numberOfRecorderPackets = 256;
+
+	friend int custom_write(void* opaque, const uint8_t* buf, int buf_size);
+	// sends the RTP packets of the pipeline's codec and layer to the receivers that negotiated it and get the layer, on the sender thread
+	int handle_write(Pipeline& pipeline, uint8_t* buf, int buf_size);
+	// sends the cached keyframe to the receivers of the pipeline that just connected, on the sender thread
+	void startJoiningReceivers(Pipeline& pipeline);
+	// nullptr if the encoder or the RTP output couldn't be set up
+	Pipeline* openPipeline(VideoCodec codec, int layer, int width, int height);
+	void closePipeline(Pipeline* pipeline);
+	void startPipelineThreads(Pipeline* pipeline);
+	void stopPipelineThreads(Pipeline* pipeline);
+	// stops the threads when the last receiver of the codec left, resume restarts them with a keyframe
+	void parkPipeline(Pipeline* pipeline);
+	void resumePipeline(Pipeline* pipeline);
+	// the first codec of the profile the answer accepted
+	bool getNegotiatedCodec(rtc::Description& answer, VideoCodec& codec);
+	void runEncoder(Pipeline& pipeline);
+	void runSender(Pipeline& pipeline);
+	// drains the send queue of the receiver into its track
+	void runReceiverSender(Receiver& receiver);
+	// starts the send threads of the connected receivers, joins those of the receivers that left
+	void updateReceiverSenders();
+	void stopLeftReceiverSenders();
+	void stopReceiverSender(Receiver& receiver);
+	// from the libdatachannel callbacks, its send thread is joined by the stream loop
+	void removeReceiver(const std::shared_ptr<Receiver>& receiver);
+	// patches the damaged part of the frame into the screen and adds it to damage
+	void applyCapturedFrame(Screen& screen, CapturedFrame* frame, DamageRect& damage);
+	// a hint for the encoders that support it (libx264, libvpx), the others ignore it
+	static void addRegionOfInterest(AVFrame* frame, const DamageRect& damage);
+	// the size the frames of the monitor are encoded with
+	void getStreamSize(int monitorWidth, int monitorHeight, int& width, int& height);
+	// half the size of the layer before, even
+	static void getLayerSize(int layer, int streamWidth, int streamHeight, int& width, int& height);
+	// the largest layer the estimate has room for, moving up needs some headroom so the receiver doesn't flip back and forth
+	int chooseLayer(int currentLayer, unsigned int bandwidthEstimate);
+	void onBandwidthEstimate(Receiver& receiver, unsigned int bitsPerSecond);
+
+	std::atomic<int> receiverIdCount{ 1 };	// the receivers register from the threads of the HTTP server
 	bool shouldStream = false;
 	const rtc::SSRC ssrc = 42;
+	StreamProfile profile;
+	std::atomic<bool> layerKeyframeRequested[maximumStreamLayers] = {};	// a receiver lost packets or switches to the layer
+	StreamStats stats;
+	// nullptr if recording is off, the recorded codec is the first one of the profile FFmpeg can encode
+	std::unique_ptr<StreamRecorder> recorder;
+	bool isRecording = false;
+	VideoCodec recordedCodec = VideoCodec::VP9;
+	ColorConverter colorConverter;
 	Task* task;
 	Mutex* mutex;
 	Event* stopEvent;
 	Logger* appLogger;
-	std::set <std::shared_ptr<Receiver>> receivers;
+	FrameCapture* frameCapture;
+	// the senders iterate a snapshot for every RTP packet, joins and leaves swap in a new one
+	SnapshotList<Receiver> receivers;
+	Event receiversChanged;	// a receiver connected or left, or the stream stops, wakes the idle stream loop
+	std::vector<std::shared_ptr<Receiver>> leftReceivers;
+	Mutex leftReceiversMutex;
 	//void getReceiver(int id, std::shared_ptr<Receiver>& recv);
-	void getReceiver(WebSocket* client, std::shared_ptr<Receiver>& recv);
+	void getReceiver(const WebSocket& client, std::shared_ptr<Receiver>& recv);
 	std::string peerStateToString(rtc::PeerConnection::State state);
 	std::string gatheringStateToString(rtc::PeerConnection::GatheringState state);
 };
@@ -1,8 +1,8 @@
 #pragma once
 #include "ScreenStreamerTask.h"
 
-ScreenStreamerTask::ScreenStreamerTask(Mutex* mutex, Logger* appLogger, int argc, char** argv) : Task("ScreenStreamerTask") {
-	this->screenStreamer = new ScreenStreamer(this, &stopEvent, mutex, appLogger);
+ScreenStreamerTask::ScreenStreamerTask(Mutex* mutex, Logger* appLogger, FrameCapture* frameCapture, const StreamProfile& profile, const RecordingSettings& recordingSettings, int argc, char** argv) : Task("ScreenStreamerTask") {
+	this->screenStreamer = new ScreenStreamer(this, &stopEvent, mutex, appLogger, frameCapture, profile, recordingSettings);
 	this->mtx = mutex;
 }
 
@@ -10,18 +10,26 @@ void ScreenStreamerTask::runTask() {
 	this->screenStreamer->startSteaming();
 }
 
-int ScreenStreamerTask::registerReceiver(WebSocket& client, Event* offerEvent) {
-	return this->screenStreamer->registerReceiver(client, offerEvent);
-}
-
-std::string ScreenStreamerTask::getOffer(WebSocket& client) {
-	return this->screenStreamer->getOffer(client);
+int ScreenStreamerTask::registerReceiver(const WebSocket& client, std::function<void(const std::string&)> onOffer) {
+	return this->screenStreamer->registerReceiver(client, onOffer);
 }
 
 int ScreenStreamerTask::setAnswer(WebSocket& client, Object::Ptr answer) {
 	return this->screenStreamer->setAnswer(client, answer);
 }
 
+const StreamStats& ScreenStreamerTask::getStats() {
+	return this->screenStreamer->getStats();
+}
+
+std::vector<ReceiverStats> ScreenStreamerTask::getReceiverStats() {
+	return this->screenStreamer->getReceiverStats();
+}
+
+RecordingStats ScreenStreamerTask::getRecordingStats() {
+	return this->screenStreamer->getRecordingStats();
+}
+
 void ScreenStreamerTask::cancel() {
 	this->screenStreamer->stopStreaming();
 }
@@ -6,6 +6,7 @@
 #include "Poco/Net/WebSocket.h"
 #include "Poco/Logger.h"
 #include "ScreenStreamer.h"
+#include "FrameCapture.h"
 
 using Poco::Event;
 using Poco::Mutex;
@@ -15,11 +16,13 @@ using Poco::Net::WebSocket;
 
 class ScreenStreamerTask : public Poco::Task {
 public:
-	ScreenStreamerTask(Mutex* mutex, Logger* appLogger, int argc, char** argv);
+	ScreenStreamerTask(Mutex* mutex, Logger* appLogger, FrameCapture* frameCapture, const StreamProfile& profile, const RecordingSettings& recordingSettings, int argc, char** argv);
 	void runTask();
-	int registerReceiver(WebSocket& client, Event* offerEvent);
-	std::string getOffer(WebSocket& client);
+	int registerReceiver(const WebSocket& client, std::function<void(const std::string&)> onOffer);
 	int setAnswer(WebSocket& client, Object::Ptr answer);
+	const StreamStats& getStats();
+	std::vector<ReceiverStats> getReceiverStats();
+	RecordingStats getRecordingStats();
 	void cancel(); // TODO: IMPLEMENT For cancellation to work, the task's runTask() method must periodically call isCancelled() and react accordingly. 
 	Event* getStopEvent();
 private:
@@ -5,6 +5,8 @@
 #include<iostream>
 #include <set>
 #include <map>
+#include <memory>
+#include <atomic>
 #include "Poco/Net/WebSocket.h"
 #include "Poco/Mutex.h"
 #include "Poco/TaskManager.h"
@@ -13,6 +15,8 @@
 #include "ScreenStreamer.h"
 #include "ScreenStreamerTask.h"
 #include "TextBoxRenderer.h"
+#include "FontRegistry.h"
+#include "FrameCapture.h"
 
 using Poco::Net::WebSocket;
 using Poco::Mutex;
@@ -30,17 +34,36 @@ struct MonitorInfo {
 	std::string monitorJSONAsString;
 };
 
+struct RenderStats {
+	std::atomic<unsigned long long> framesRendered{ 0 };
+	std::atomic<unsigned long long> framesSkipped{ 0 };	// held back while glyphs were rasterized
+	std::atomic<unsigned long long> idleWakeups{ 0 };	// loop iterations with nothing to draw
+};
+
 extern Mutex textMutex;
 extern Mutex clientSetMutex;
 extern Mutex streamingServerMutex;
 extern Poco::TaskManager* taskManager;
 extern ScreenStreamerTask* screenStreamerTask;
-extern std::set<WebSocket> clients;
+extern std::map<WebSocket, std::shared_ptr<Mutex>> clients;	// every connection with the lock of its writes, guarded by clientSetMutex
 extern bool isServerRunning;
 extern std::map<int, TextBoxRenderer*> renderers;
+extern FontRegistry* fontRegistry;
 extern float backgroundColorR;
 extern float backgroundColorG;
 extern float backgroundColorB;
 extern float backgroundColorA;
 extern MonitorInfo monitorInfo;
-extern AutoPtr<PropertyFileConfiguration> pConf;
\ No newline at end of file
+extern AutoPtr<PropertyFileConfiguration> pConf;
+extern std::atomic<unsigned long long> renderGeneration;
+extern RenderStats renderStats;
+extern FrameCapture frameCapture;
+extern StreamProfile streamProfile;	// used by the next stream, guarded by streamingServerMutex
+extern RecordingSettings recordingSettings;
+
+// Marks the projector window as dirty and wakes up the render loop, call it after changing anything that is visible
+void requestRedraw();
+
+// Sends a text frame to a client. The request thread of the client, the stream (offers) and the monitor events
+// all write to the clients, the frames of one connection must not interleave. Throws like WebSocket::sendFrame.
+void sendToClient(WebSocket ws, const std::string& text);
\ No newline at end of file
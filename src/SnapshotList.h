@@ -0,0 +1,93 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// A list that is read far more often than it changes, e.g. the receivers every RTP packet goes to.
+// Readers take an immutable snapshot with a single atomic load and iterate it without locks, it stays valid
+// (and keeps its items alive) as long as they hold it. Writers copy the list, change the copy and swap it in,
+// they are serialized by a mutex the readers never touch.
+template <typename T>
+class SnapshotList {
+public:
+    typedef std::vector<std::shared_ptr<T>> Items;
+
+    // Keeps the snapshot of one thread until the list changes, so the hot path is a single atomic read instead of
+    // an atomic load of the shared_ptr (which the standard library may implement with a lock) and its refcount.
+    // A removed item stays alive until the next get() of every reader that has it.
+    class Reader {
+    public:
+        explicit Reader(const SnapshotList& list) : list(list) {
+            version = list.version.load(std::memory_order_acquire);
+            snapshot = list.get();
+        }
+
+        const Items& get() {
+            uint64_t currentVersion = list.version.load(std::memory_order_acquire);
+            if (currentVersion != version) {
+                // the version is bumped after the swap, the loaded list is at least as new
+                version = currentVersion;
+                snapshot = list.get();
+            }
+            return *snapshot;
+        }
+
+    private:
+        const SnapshotList& list;
+        uint64_t version;
+        std::shared_ptr<const Items> snapshot;
+    };
+
+    SnapshotList() {
+        items = std::make_shared<const Items>();
+    }
+
+    SnapshotList(const SnapshotList&) = delete;
+    SnapshotList& operator=(const SnapshotList&) = delete;
+
+    // never nullptr
+    std::shared_ptr<const Items> get() const {
+        return std::atomic_load(&items);
+    }
+
+    void add(const std::shared_ptr<T>& item) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        std::shared_ptr<Items> changed = std::make_shared<Items>(*std::atomic_load(&items));
+        changed->push_back(item);
+        std::atomic_store(&items, std::shared_ptr<const Items>(std::move(changed)));
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+    // false if the item wasn't in the list
+    bool remove(const std::shared_ptr<T>& item) {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        std::shared_ptr<const Items> current = std::atomic_load(&items);
+        if (std::find(current->begin(), current->end(), item) == current->end()) {
+            return false;
+        }
+        std::shared_ptr<Items> changed = std::make_shared<Items>();
+        changed->reserve(current->size() - 1);
+        for (const std::shared_ptr<T>& other : *current) {
+            if (other != item) {
+                changed->push_back(other);
+            }
+        }
+        std::atomic_store(&items, std::shared_ptr<const Items>(std::move(changed)));
+        version.fetch_add(1, std::memory_order_release);
+        return true;
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> lock(writeMutex);
+        std::atomic_store(&items, std::make_shared<const Items>());
+        version.fetch_add(1, std::memory_order_release);
+    }
+
+private:
+    std::mutex writeMutex;
+    std::shared_ptr<const Items> items;   // only through std::atomic_load / std::atomic_store
+    std::atomic<uint64_t> version{ 0 };
+};
@@ -0,0 +1,99 @@
+#include "StreamPools.h"
+
+FramePool::FramePool(int size, int width, int height, AVPixelFormat format, AllocationStats* stats) : available(size) {
+	allocationStats = stats;
+	valid = true;
+	for (int i = 0; i < size; i++) {
+		AVFrame* frame = av_frame_alloc();
+		if (frame == nullptr) {
+			valid = false;
+			break;
+		}
+		allocationStats->frameAllocations++;
+		frames.push_back(frame);
+
+		frame->width = width;
+		frame->height = height;
+		frame->format = format;
+		if (av_frame_get_buffer(frame, 0) < 0) {
+			valid = false;
+			break;
+		}
+		allocationStats->frameBufferAllocations++;
+		available.push(frame);
+	}
+}
+
+FramePool::~FramePool() {
+	for (AVFrame*& frame : frames) {
+		av_frame_free(&frame);
+	}
+}
+
+AVFrame* FramePool::acquire() {
+	AVFrame* frame;
+	if (!available.pop(frame)) {
+		return nullptr;
+	}
+
+	// the encoder may still hold a reference to the buffer, only then this has to allocate a new one
+	uint8_t* buffer = frame->data[0];
+	if (av_frame_make_writable(frame) < 0) {
+		available.push(frame);
+		return nullptr;
+	}
+	if (frame->data[0] != buffer) {
+		allocationStats->frameBufferAllocations++;
+	}
+
+	frame->pts = AV_NOPTS_VALUE;
+	frame->pict_type = AV_PICTURE_TYPE_NONE;
+	frame->flags = 0;
+	av_frame_remove_side_data(frame, AV_FRAME_DATA_REGIONS_OF_INTEREST);
+	return frame;
+}
+
+void FramePool::release(AVFrame* frame) {
+	available.push(frame);
+}
+
+bool FramePool::isValid() {
+	return valid;
+}
+
+PacketPool::PacketPool(int size, AllocationStats* stats) : available(size) {
+	valid = true;
+	for (int i = 0; i < size; i++) {
+		AVPacket* packet = av_packet_alloc();
+		if (packet == nullptr) {
+			valid = false;
+			break;
+		}
+		stats->packetAllocations++;
+		packets.push_back(packet);
+		available.push(packet);
+	}
+}
+
+PacketPool::~PacketPool() {
+	for (AVPacket*& packet : packets) {
+		av_packet_free(&packet);
+	}
+}
+
+AVPacket* PacketPool::acquire() {
+	AVPacket* packet;
+	if (!available.pop(packet)) {
+		return nullptr;
+	}
+	return packet;
+}
+
+void PacketPool::release(AVPacket* packet) {
+	av_packet_unref(packet);
+	available.push(packet);
+}
+
+bool PacketPool::isValid() {
+	return valid;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <atomic>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+}
+
+#include "SPSCQueue.h"
+
+// How often the stream allocated frames, frame buffers and packets. These only grow while a session starts,
+// a steady stream reuses them. The payloads grow with every packet: the encoders allocate them themselves
+// and the recording takes a reference (a small AVBufferRef, the data is shared) to every packet it writes.
+struct AllocationStats {
+	std::atomic<unsigned long long> frameAllocations{ 0 };
+	std::atomic<unsigned long long> frameBufferAllocations{ 0 };
+	std::atomic<unsigned long long> packetAllocations{ 0 };
+	std::atomic<unsigned long long> packetPayloadAllocations{ 0 };
+	std::atomic<unsigned long long> packetReferenceAllocations{ 0 };
+};
+
+// AVFrames with buffers of one size and format, allocated once per stream session.
+// One thread acquires, one thread releases (they can be the same).
+class FramePool {
+public:
+	FramePool(int size, int width, int height, AVPixelFormat format, AllocationStats* stats);
+	~FramePool();
+
+	// nullptr if all frames are in use. The frame is writable, its properties (pts, pict_type, side data...) are reset.
+	AVFrame* acquire();
+	void release(AVFrame* frame);
+	bool isValid();
+
+private:
+	std::vector<AVFrame*> frames;
+	SPSCQueue<AVFrame*> available;
+	AllocationStats* allocationStats;
+	bool valid;
+};
+
+// Empty AVPackets, allocated once per stream session. The encoder fills them, release() unrefs them.
+class PacketPool {
+public:
+	PacketPool(int size, AllocationStats* stats);
+	~PacketPool();
+
+	// nullptr if all packets are in use
+	AVPacket* acquire();
+	void release(AVPacket* packet);
+	bool isValid();
+
+private:
+	std::vector<AVPacket*> packets;
+	SPSCQueue<AVPacket*> available;
+	bool valid;
+};
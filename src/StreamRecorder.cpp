@@ -0,0 +1,254 @@
+#include "StreamRecorder.h"
+#include <cstring>
+extern "C"
+{
+#include "libavcodec/bsf.h"
+}
+#include "Poco/DateTimeFormatter.h"
+#include "Poco/Exception.h"
+#include "Poco/File.h"
+#include "Poco/LocalDateTime.h"
+#include "Poco/Path.h"
+#include "Poco/Timestamp.h"
+
+StreamRecorder::StreamRecorder(Logger* logger, const RecordingSettings& settings, int numberOfPackets) :
+	ready(numberOfPackets), available(numberOfPackets), writerThread("StreamRecorder") {
+	this->appLogger = logger;
+	this->settings = settings;
+	for (int i = 0; i < numberOfPackets; i++) {
+		AVPacket* packet = av_packet_alloc();
+		if (packet != nullptr) {
+			packets.push_back(packet);
+			available.push(packet);
+		}
+	}
+}
+
+StreamRecorder::~StreamRecorder() {
+	stop();
+	for (AVPacket* packet : packets) {
+		av_packet_free(&packet);
+	}
+	avcodec_parameters_free(&parameters);
+}
+
+bool StreamRecorder::start(VideoCodec codec, const AVCodecParameters* parameters, AVRational timeBase) {
+	try {
+		Poco::File(settings.directory).createDirectories();
+	} catch (Poco::Exception& e) {
+		appLogger->error("Could not create the recording directory " + settings.directory + ": " + e.displayText());
+		return false;
+	}
+
+	avcodec_parameters_free(&this->parameters);
+	this->parameters = avcodec_parameters_alloc();
+	if (this->parameters == nullptr || avcodec_parameters_copy(this->parameters, parameters) < 0) {
+		appLogger->error("Could not copy the codec parameters for the recording");
+		return false;
+	}
+	this->codec = codec;
+	this->timeBase = timeBase;
+	failed = false;
+	dropping = false;
+
+	running = true;
+	writerThread.startFunc([this]() { run(); });
+	return true;
+}
+
+void StreamRecorder::stop() {
+	if (!running) {
+		return;
+	}
+	// the producer has stopped, the writer empties the queue before it ends
+	running = false;
+	packetsQueued.set();
+	writerThread.join();
+}
+
+bool StreamRecorder::write(const AVPacket* packet) {
+	if (!running) {
+		return false;
+	}
+	// a file can't be played past a lost packet, the next one that works is a keyframe
+	if (dropping && !(packet->flags & AV_PKT_FLAG_KEY)) {
+		packetsDropped++;
+		return false;
+	}
+
+	AVPacket* reference;
+	if (!available.pop(reference)) {
+		// the disk is too slow
+		dropping = true;
+		packetsDropped++;
+		return false;
+	}
+	dropping = false;
+	// shares the data of the encoder, an empty packet (out of memory) is skipped by the writer
+	av_packet_ref(reference, packet);
+	// every packet fits into the queue
+	ready.push(reference);
+	packetsQueued.set();
+	return true;
+}
+
+void StreamRecorder::run() {
+	while (true) {
+		AVPacket* packet;
+		while (ready.pop(packet)) {
+			bool isKeyframe = (packet->flags & AV_PKT_FLAG_KEY) != 0;
+			if (packet->size > 0 && !failed) {
+				int64_t now = Poco::Timestamp().epochMicroseconds();
+				if (output != nullptr && isKeyframe && (now - segmentStartTime >= (int64_t) settings.segmentMinutes * 60 * 1000000 ||
+					segmentBytes >= (unsigned long long) settings.segmentMegabytes * 1024 * 1024)) {
+					closeSegment();
+				}
+				if (output == nullptr && isKeyframe) {
+					if (openSegment(packet)) {
+						segmentStartPts = packet->pts;
+					} else {
+						failed = true;
+					}
+				}
+			}
+
+			if (output != nullptr && packet->size > 0) {
+				// every segment starts at 0
+				packet->pts -= segmentStartPts;
+				if (packet->dts != AV_NOPTS_VALUE) {
+					packet->dts -= segmentStartPts;
+				}
+				av_packet_rescale_ts(packet, timeBase, output->streams[0]->time_base);
+				packet->stream_index = 0;
+				int size = packet->size;
+				if (av_write_frame(output, packet) < 0) {
+					appLogger->error("Could not write to the recording, it stops until the stream starts again");
+					closeSegment();
+					failed = true;
+				} else {
+					segmentBytes += size;
+					bytesWritten += size;
+				}
+			}
+
+			av_packet_unref(packet);
+			available.push(packet);
+		}
+
+		if (!running) {
+			break;
+		}
+		packetsQueued.wait();
+	}
+	closeSegment();
+}
+
+void StreamRecorder::addExtradata(const AVPacket* keyframe) {
+	// the encoder writes the stream headers in band for the receivers that join later, Matroska needs them in front
+	// (avcC for H.264, av1C for AV1) or the segment can't be decoded
+	if (parameters->extradata_size > 0 || (codec != VideoCodec::H264 && codec != VideoCodec::AV1)) {
+		return;
+	}
+	const AVBitStreamFilter* filter = av_bsf_get_by_name("extract_extradata");
+	AVBSFContext* context = nullptr;
+	AVPacket* packet = av_packet_clone(keyframe);
+	if (filter == nullptr || packet == nullptr || av_bsf_alloc(filter, &context) < 0 || avcodec_parameters_copy(context->par_in, parameters) < 0) {
+		appLogger->warning("Could not read the stream headers for the recording");
+		av_packet_free(&packet);
+		av_bsf_free(&context);
+		return;
+	}
+	context->time_base_in = timeBase;
+
+	size_t size = 0;
+	const uint8_t* extradata = nullptr;
+	if (av_bsf_init(context) >= 0 && av_bsf_send_packet(context, packet) >= 0 && av_bsf_receive_packet(context, packet) >= 0) {
+		extradata = av_packet_get_side_data(packet, AV_PKT_DATA_NEW_EXTRADATA, &size);
+	}
+	if (extradata != nullptr && size > 0) {
+		parameters->extradata = (uint8_t*) av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+		if (parameters->extradata != nullptr) {
+			memcpy(parameters->extradata, extradata, size);
+			parameters->extradata_size = (int) size;
+		}
+	} else {
+		appLogger->warning("The first keyframe of the recording has no stream headers, the segments may not play");
+	}
+	av_packet_free(&packet);
+	av_bsf_free(&context);
+}
+
+bool StreamRecorder::openSegment(const AVPacket* keyframe) {
+	addExtradata(keyframe);
+
+	// WebM only has VP8, VP9 and AV1
+	std::string extension = codec == VideoCodec::H264 ? ".mkv" : ".webm";
+	Poco::Path path(settings.directory);
+	path.makeDirectory();
+	path.setFileName("recording-" + Poco::DateTimeFormatter::format(Poco::LocalDateTime(), "%Y%m%d-%H%M%S") + "-" + std::to_string(segments + 1) + extension);
+	std::string fileName = path.toString();
+
+	// the format comes from the extension
+	if (avformat_alloc_output_context2(&output, nullptr, nullptr, fileName.c_str()) < 0) {
+		appLogger->error("Could not allocate the recording output for " + fileName);
+		output = nullptr;
+		return false;
+	}
+	AVStream* stream = avformat_new_stream(output, nullptr);
+	if (stream == nullptr || avcodec_parameters_copy(stream->codecpar, parameters) < 0 || avio_open(&output->pb, fileName.c_str(), AVIO_FLAG_WRITE) < 0) {
+		appLogger->error("Could not open the recording " + fileName);
+		avformat_free_context(output);
+		output = nullptr;
+		return false;
+	}
+	stream->codecpar->codec_tag = 0;
+	stream->time_base = timeBase;
+	if (avformat_write_header(output, nullptr) < 0) {
+		appLogger->error("Could not write the header of the recording " + fileName);
+		avio_closep(&output->pb);
+		avformat_free_context(output);
+		output = nullptr;
+		return false;
+	}
+
+	appLogger->information("Recording into " + fileName);
+	segmentStartTime = Poco::Timestamp().epochMicroseconds();
+	segmentBytes = 0;
+	segments++;
+	Poco::Mutex::ScopedLock lock(fileMutex);
+	file = fileName;
+	return true;
+}
+
+void StreamRecorder::closeSegment() {
+	if (output == nullptr) {
+		return;
+	}
+	av_write_trailer(output);
+	avio_closep(&output->pb);
+	avformat_free_context(output);
+	output = nullptr;
+	Poco::Mutex::ScopedLock lock(fileMutex);
+	file.clear();
+}
+
+bool StreamRecorder::isRecording() {
+	return running;
+}
+
+std::string StreamRecorder::getFile() {
+	Poco::Mutex::ScopedLock lock(fileMutex);
+	return file;
+}
+
+unsigned long long StreamRecorder::getSegments() {
+	return segments;
+}
+
+unsigned long long StreamRecorder::getBytesWritten() {
+	return bytesWritten;
+}
+
+unsigned long long StreamRecorder::getPacketsDropped() {
+	return packetsDropped;
+}
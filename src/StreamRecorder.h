@@ -0,0 +1,85 @@
+#pragma once
+#include <atomic>
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavformat/avformat.h"
+}
+
+#include "Poco/Event.h"
+#include "Poco/Logger.h"
+#include "Poco/Mutex.h"
+#include "Poco/Thread.h"
+#include "SPSCQueue.h"
+#include "VideoEncoder.h"
+
+using Poco::Logger;
+
+// Where and how the stream is recorded (Recording* in SimpleTextProjector.properties)
+struct RecordingSettings {
+	std::string directory;		// empty turns recording off
+	int segmentMinutes = 30;	// a new file is started with the first keyframe after this time or size
+	int segmentMegabytes = 1024;
+};
+
+// Writes the packets of one encoder into WebM files (Matroska for H.264, which WebM doesn't allow) without encoding
+// them again. The sender thread of the encoder hands the packets over by reference through a bounded queue, a thread of
+// the recorder writes them. A full queue drops packets until the next keyframe instead of waiting, the live stream
+// never waits for the disk. A new file (segment) starts at a keyframe, so every file can be played on its own.
+class StreamRecorder {
+public:
+	StreamRecorder(Logger* logger, const RecordingSettings& settings, int numberOfPackets);
+	~StreamRecorder();
+
+	StreamRecorder(const StreamRecorder&) = delete;
+	StreamRecorder& operator=(const StreamRecorder&) = delete;
+
+	// for one stream session, timeBase is the one of the packets. False if the directory can't be created.
+	bool start(VideoCodec codec, const AVCodecParameters* parameters, AVRational timeBase);
+	// writes what is still queued and closes the file
+	void stop();
+
+	// Producer only, never waits. Takes a reference to the packet, false if it was dropped.
+	bool write(const AVPacket* packet);
+
+	bool isRecording();
+	std::string getFile();	// empty while no segment is open
+	unsigned long long getSegments();
+	unsigned long long getBytesWritten();	// of all segments
+	unsigned long long getPacketsDropped();
+
+private:
+	void run();
+	void addExtradata(const AVPacket* keyframe);
+	bool openSegment(const AVPacket* keyframe);
+	void closeSegment();
+
+	Logger* appLogger;
+	RecordingSettings settings;
+	std::vector<AVPacket*> packets;
+	SPSCQueue<AVPacket*> ready;		// producer -> writer
+	SPSCQueue<AVPacket*> available;	// writer -> producer
+	Poco::Event packetsQueued;
+	Poco::Thread writerThread;
+	std::atomic<bool> running{ false };
+	bool dropping = false;	// producer only
+
+	// writer only
+	VideoCodec codec = VideoCodec::VP9;
+	AVCodecParameters* parameters = nullptr;	// with the stream headers of the first keyframe
+	AVRational timeBase = { 1, 90000 };
+	AVFormatContext* output = nullptr;
+	int64_t segmentStartPts = 0;
+	int64_t segmentStartTime = 0;	// microseconds, Poco::Timestamp
+	unsigned long long segmentBytes = 0;
+	bool failed = false;
+
+	Poco::Mutex fileMutex;
+	std::string file;
+	std::atomic<unsigned long long> segments{ 0 };
+	std::atomic<unsigned long long> bytesWritten{ 0 };
+	std::atomic<unsigned long long> packetsDropped{ 0 };
+};
@@ -1,17 +1,20 @@
 #include <glad/glad.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/type_ptr.hpp>
-#include <fstream>
+#include <cmath>
 #include "TextBoxRenderer.h"
 #include "utf8.h"
 
-TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, Logger* logger, FT_Library& freeTypeLibrary): 
-    TextBoxRenderer(screenWidth, screenHeight, boxX, boxY, width, height, 72.0f, 5.0f, 5.0f, 1, 1, 1, 1, "fonts/Raleway.ttf", true, logger, freeTypeLibrary) {
+TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, Logger* logger, FontRegistry* fontRegistry): 
+    TextBoxRenderer(screenWidth, screenHeight, boxX, boxY, width, height, 72.0f, 5.0f, 5.0f, 1, 1, 1, 1, "fonts/Raleway.ttf", true, logger, fontRegistry) {
 }
 
-TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, float desiredFontSize, float decreaseStep, float lineSpacing, float colorR, float colorG, float colorB, float colorA, std::string fontPath, bool wordWrap, Logger* logger, FT_Library& freeTypeLibrary) {
+TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, float desiredFontSize, float decreaseStep, float lineSpacing, float colorR, float colorG, float colorB, float colorA, std::string fontPath, bool wordWrap, Logger* logger, FontRegistry* fontRegistry) : glyphRasterizer(logger, fontRegistry) {
     this->consoleLogger = logger;
     this->projectionMatrix = glm::ortho(0.0f, screenWidth, 0.0f, screenHeight);
+    this->_screenWidth = screenWidth;
+    this->_screenHeight = screenHeight;
+    this->damage = DamageRect::full((int) std::ceil(screenWidth), (int) std::ceil(screenHeight));
     this->_boxX = boxX;
     this->_boxY = boxY;
     this->_width = width;
@@ -20,15 +23,30 @@ TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float bo
     this->_decreaseStep = decreaseStep;
     this->_lineSpacing = lineSpacing;
     this->_wordWrap = wordWrap;
-    this->_freeTypeLibrary = freeTypeLibrary;
+    this->_fontRegistry = fontRegistry;
     this->_colorR = colorR;
     this->_colorG = colorG;
     this->_colorB = colorB;
     this->_colorA = colorA;
     this->_fontPath = fontPath;
 	this->fontFace = nullptr;
+    this->sizeMetrics = nullptr;
+    this->metricsBatch = 0;
+    this->cachedIsTextFittingInBox = false;
+    this->verticesNeedUpdate = true;
+    this->prewarmPending = false;
+    this->nextBatch = 0;
+    this->lazyBatch = 0;
+    this->prewarmBatch = 0;
+    this->prewarmRemaining = 0;
+    this->waitingForGlyphs = false;
+    this->waitAtlasGeneration = 0;
+    this->glyphsDontFit = false;
+    this->_pendingFontSize = desiredFontSize;
+    this->_pendingDecreaseStep = decreaseStep;
 
     loadFontFace(fontPath);
+    startGlyphBatch();
 
     // compile shaders
     unsigned int vertex;
@@ -53,9 +71,17 @@ TextBoxRenderer::TextBoxRenderer(float screenWidth, float screenHeight, float bo
     glDeleteShader(vertex);
     glDeleteShader(fragment);
 
+    // resolve the locations once, they don't change after linking
+    positionAttributeLocation = glGetAttribLocation(shaderID, "position");
+    texCoordAttributeLocation = glGetAttribLocation(shaderID, "texCoord");
+    colorLocation = glGetUniformLocation(shaderID, "textColor");
+    projectionLocation = glGetUniformLocation(shaderID, "projection");
+    textTextureLocation = glGetUniformLocation(shaderID, "text");
+
+    vboCapacity = sizeof(float) * 6 * 4;
     glGenBuffers(1, &VBO);
     glBindBuffer(GL_ARRAY_BUFFER, VBO);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(float) * 6 * 4, NULL, GL_DYNAMIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, vboCapacity, NULL, GL_DYNAMIC_DRAW);
     glEnableVertexAttribArray(0);
 
 }
@@ -91,313 +117,534 @@ void TextBoxRenderer::checkCompileErrors(unsigned int shader, ShaderType type) {
 }
 
 
-void TextBoxRenderer::renderCenteredText(bool debug) {
-    if (debug) {
-        drawDebugLines(_boxX, _boxY, _width, _height);
-    }
+bool TextBoxRenderer::renderCenteredText(bool debug) {
+    receiveRasterizedGlyphs();
 
-    std::string modifiedText;
-    Lines lines;
-    bool isTextFittingInTheBox;
+    if (prewarmPending && prewarmRemaining == 0) {
+        applyPrewarmedGlyphs();
+    }
 
-    if (cachedInput == _text) {
-        // cache hit, no need to measure text & all
-        modifiedText = cachedModifiedText;
-        isTextFittingInTheBox = cachedIsTextFittingInBox;
-        lines = cachedLines;
-    } else {
+    if (cachedInput != _text) {
+        if (!requestMissingMetrics(_text)) {
+            // keep showing the last frame until the workers measured the new characters
+            return false;
+        }
         // cache miss, now measure the text and update cache
-        modifiedText = _text;
-        isTextFittingInTheBox = adjustTextForBox(modifiedText, lines);
+        cachedIsTextFittingInBox = adjustTextForBox(_text, cachedLines);
         cachedInput = _text;
-        cachedModifiedText = modifiedText;
-        cachedIsTextFittingInBox = isTextFittingInTheBox;
-        cachedLines = lines;
+        verticesNeedUpdate = true;
+        glyphsDontFit = false;
     }
 
-    if (!isTextFittingInTheBox) {
-        // text doesn't fit, don't draw anything
-        return;
+    if (cachedIsTextFittingInBox && verticesNeedUpdate) {
+        if (!buildVertexBatch()) {
+            // keep showing the last frame until the workers delivered the missing glyphs
+            return false;
+        }
+        uploadVertexBatch();
+        verticesNeedUpdate = false;
     }
 
-    int numberOfCharacters = utf8::distance(modifiedText.begin(), modifiedText.end());
+    if (debug) {
+        drawDebugLines(_boxX, _boxY, _width, _height);
+    }
+
+    if (!cachedIsTextFittingInBox || drawRanges.empty()) {
+        // text doesn't fit, don't draw anything
+        return true;
+    }
 
     glUseProgram(shaderID);
-    int colorLocation = glGetUniformLocation(shaderID, "textColor");
     glUniform4f(colorLocation, _colorR, _colorG, _colorB, _colorA);
-
-    unsigned int projectionLocation = glGetUniformLocation(shaderID, "projection");
     glUniformMatrix4fv(projectionLocation, 1, GL_FALSE, glm::value_ptr(projectionMatrix));
+    glUniform1i(textTextureLocation, 0);
 
-    
-    std::string::iterator it = modifiedText.begin();
-    int currentLineNumber = 0;
-    float x = _boxX + (_width / 2.0f) - (lines.lineWidths[currentLineNumber] / 2.0f);
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    glVertexAttribPointer(positionAttributeLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)0);
+    glEnableVertexAttribArray(positionAttributeLocation);
+    glVertexAttribPointer(texCoordAttributeLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)(2 * sizeof(GLfloat)));
+    glEnableVertexAttribArray(texCoordAttributeLocation);
+
+    // one draw call per atlas page, usually there is only one page
+    glActiveTexture(GL_TEXTURE0);
+    for (const DrawRange& range : drawRanges) {
+        glBindTexture(GL_TEXTURE_2D, glyphAtlas.getTexture(range.page));
+        glDrawArrays(GL_TRIANGLES, range.first, range.count);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return true;
+}
 
-    float y = _boxY + (_height / 2.0f) + (lines.totalTextHeight / 2.0f) - lines.lineAscends[currentLineNumber];
+bool TextBoxRenderer::buildVertexBatch() {
+    const std::string& text = cachedInput;
+
+    // every glyph has to be in the atlas before emitting quads, the missing ones are requested from the workers
+    bool allGlyphsInAtlas = true;
+    std::string::const_iterator it = text.begin();
+    while (it != text.end() && !glyphsDontFit) {
+        int charCode = utf8::next(it, text.end());
+        if (charCode != 10 && charCode != 13 && characterCache.find(charCode) == characterCache.end()) {
+            allGlyphsInAtlas = false;
+            if (requestedGlyphs.insert(charCode).second) {
+                // ahead of the prewarm requests, the text on screen waits for these
+                glyphRasterizer.request(_fontPath, _glyphFontSize, charCode, lazyBatch, true);
+            }
+        }
+    }
 
+    if (!allGlyphsInAtlas) {
+        if (!waitingForGlyphs) {
+            waitingForGlyphs = true;
+            waitAtlasGeneration = glyphAtlas.getGeneration();
+        }
+        // an eviction invalidates the glyphs added before it, if the atlas is evicted again while
+        // waiting the glyphs of the text can't be in it at the same time
+        if (glyphAtlas.getGeneration() - waitAtlasGeneration < 2) {
+            return false;
+        }
+        consoleLogger->error("The glyphs of the text don't fit in the glyph atlas");
+        glyphsDontFit = true;
+    }
+    waitingForGlyphs = false;
 
-    for (int i = 0; i < numberOfCharacters; i++) {
-        int charCode = utf8::next(it, modifiedText.end());
+    // quads are grouped by atlas page, so every page can be drawn with a single call
+    for (std::vector<float>& pageBatch : pageBatches) {
+        pageBatch.clear();
+    }
+    pageBatches.resize(glyphAtlas.getPageCount());
 
-        if (charCode == 10) {
-            currentLineNumber++;
-            if (currentLineNumber < lines.numberOfLines) {
-                x = _boxX + (_width / 2.0f) - (lines.lineWidths[currentLineNumber] / 2.0f);
-                int previousLineDescent = lines.lineHeights[currentLineNumber - 1] - lines.lineAscends[currentLineNumber - 1];
-                y = y - previousLineDescent - lines.lineAscends[currentLineNumber] - _lineSpacing;
-            }
-            continue;
-        }
+    const Lines& lines = cachedLines;
+    float y = _boxY + (_height / 2.0f) + (lines.totalTextHeight / 2.0f);
 
-        std::map<int, TextBoxRenderer::Character>::iterator characterIt = characterCache.find(charCode);
+    for (size_t lineNumber = 0; lineNumber < lines.spans.size(); lineNumber++) {
+        const LineSpan& line = lines.spans[lineNumber];
 
-        if (characterIt == characterCache.end()) {
-            // cache miss --> generate texture
-            generateAndAddCharacter(charCode);
-            characterIt = characterCache.find(charCode);
+        if (lineNumber == 0) {
+            y -= line.ascent;
+        } else {
+            y -= lines.spans[lineNumber - 1].descent + line.ascent + _lineSpacing;
         }
+        float x = _boxX + (_width / 2.0f) - (line.width / 2.0f);
 
-        // drawing text
-        Character ch = (*characterIt).second;
-        
-        float xPos = x + ch.Bearing.x;
-        float yPos = y - (ch.Size.y - ch.Bearing.y);
+        std::string::const_iterator it = text.begin() + line.begin;
+        std::string::const_iterator lineEnd = text.begin() + line.end;
+        while (it != lineEnd) {
+            int charCode = utf8::next(it, lineEnd);
 
-        float characterWidth = ch.Size.x;
-        float characterHeight = ch.Size.y;
+            std::map<int, TextBoxRenderer::Character>::iterator characterIt = characterCache.find(charCode);
+            if (characterIt == characterCache.end()) {
+                continue;
+            }
 
-        float vertices[6][4] = {
-            { xPos,                  yPos + characterHeight,   0.0f, 0.0f },
-            { xPos,                  yPos,                     0.0f, 1.0f },
-            { xPos + characterWidth, yPos,                     1.0f, 1.0f },
+            const Character& ch = characterIt->second;
 
-            { xPos,                  yPos + characterHeight,   0.0f, 0.0f },
-            { xPos + characterWidth, yPos,                     1.0f, 1.0f },
-            { xPos + characterWidth, yPos + characterHeight,   1.0f, 0.0f }
-        };
+            if (ch.Size.x > 0 && ch.Size.y > 0) {
+                float xPos = x + ch.Bearing.x;
+                float yPos = y - (ch.Size.y - ch.Bearing.y);
 
-        unsigned int positionAttributeLocation = glGetAttribLocation(shaderID, "position");
-        glVertexAttribPointer(positionAttributeLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)0);
-        glEnableVertexAttribArray(positionAttributeLocation);
+                float characterWidth = ch.Size.x;
+                float characterHeight = ch.Size.y;
 
-        unsigned int textTextureLocation = glGetUniformLocation(shaderID, "text");
-        glUniform1i(textTextureLocation, 0);
+                const GlyphAtlas::Region& region = ch.AtlasRegion;
 
-        unsigned int texCoordinateAttributeLocation = glGetAttribLocation(shaderID, "texCoord");
-        glVertexAttribPointer(texCoordinateAttributeLocation, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat), (GLvoid*)(2 * sizeof(GLfloat)));
-        glEnableVertexAttribArray(texCoordinateAttributeLocation);
+                float vertices[6][4] = {
+                    { xPos,                  yPos + characterHeight,   region.u0, region.v0 },
+                    { xPos,                  yPos,                     region.u0, region.v1 },
+                    { xPos + characterWidth, yPos,                     region.u1, region.v1 },
 
-        glActiveTexture(GL_TEXTURE0);
-        glBindTexture(GL_TEXTURE_2D, ch.TextureID);
+                    { xPos,                  yPos + characterHeight,   region.u0, region.v0 },
+                    { xPos + characterWidth, yPos,                     region.u1, region.v1 },
+                    { xPos + characterWidth, yPos + characterHeight,   region.u1, region.v0 }
+                };
 
-        glBindBuffer(GL_ARRAY_BUFFER, VBO);
-        glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+                std::vector<float>& pageBatch = pageBatches[region.page];
+                pageBatch.insert(pageBatch.end(), &vertices[0][0], &vertices[0][0] + 6 * 4);
+            }
 
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        x += (ch.Advance >> 6);
+            x += (ch.Advance >> 6);
+        }
     }
-    glBindTexture(GL_TEXTURE_2D, 0);
 
+    vertexBatch.clear();
+    drawRanges.clear();
+    for (unsigned int page = 0; page < pageBatches.size(); page++) {
+        std::vector<float>& pageBatch = pageBatches[page];
+        if (pageBatch.empty()) {
+            continue;
+        }
+        DrawRange range = { page, (int) (vertexBatch.size() / 4), (int) (pageBatch.size() / 4) };
+        drawRanges.push_back(range);
+        vertexBatch.insert(vertexBatch.end(), pageBatch.begin(), pageBatch.end());
+    }
+    return true;
 }
 
-void TextBoxRenderer::generateAndAddCharacter(int charCode) {
-    int freeTypeError;
-    unsigned int glyphIndex = FT_Get_Char_Index(fontFace, charCode);
-    freeTypeError = FT_Load_Glyph(fontFace, glyphIndex, FT_LOAD_DEFAULT);
-    if (freeTypeError) {
-        consoleLogger->error("Error loading glyph");
+void TextBoxRenderer::uploadVertexBatch() {
+    size_t batchSize = vertexBatch.size() * sizeof(float);
+    if (batchSize == 0) {
+        return;
     }
-    freeTypeError = FT_Render_Glyph(fontFace->glyph, FT_RENDER_MODE_NORMAL);
-    if (freeTypeError) {
-        consoleLogger->error("Error rendering glyph");
+
+    glBindBuffer(GL_ARRAY_BUFFER, VBO);
+    if (batchSize > vboCapacity) {
+        // grow the buffer, it is reused for all the following layouts
+        glBufferData(GL_ARRAY_BUFFER, batchSize, vertexBatch.data(), GL_DYNAMIC_DRAW);
+        vboCapacity = batchSize;
+    } else {
+        glBufferSubData(GL_ARRAY_BUFFER, 0, batchSize, vertexBatch.data());
     }
+}
 
-    // tell OpenGL to use the spacing you give it, not the normal 32-bit boundaries it expects.
-    glPixelStorei(GL_PACK_ALIGNMENT, 1);
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+void TextBoxRenderer::receiveRasterizedGlyphs() {
+    // only the texture uploads happen here, FreeType ran on the worker threads
+    while (glyphRasterizer.poll(scratchGlyph)) {
+        if (scratchGlyph.batch == lazyBatch) {
+            requestedGlyphs.erase(scratchGlyph.charCode);
+            if (characterCache.find(scratchGlyph.charCode) == characterCache.end()) {
+                // a glyph that failed stays empty, so it isn't requested again on every layout
+                addCharacter(scratchGlyph, true);
+                verticesNeedUpdate = true;
+            }
+        } else if (scratchGlyph.batch == prewarmBatch && prewarmPending) {
+            // glyphs the font doesn't have would all end up as the same .notdef box
+            if (scratchGlyph.inFont) {
+                prewarmedGlyphs.push_back(std::move(scratchGlyph));
+            }
+            prewarmRemaining--;
+        }
+    }
 
-    unsigned int texture;
+    while (glyphRasterizer.pollMetrics(scratchMeasurement)) {
+        if (scratchMeasurement.batch != metricsBatch) {
+            continue;
+        }
+        GlyphMetrics metrics = { scratchMeasurement.advance, scratchMeasurement.ascent, scratchMeasurement.descent };
+        metricsCache[scratchMeasurement.fontSize][scratchMeasurement.charCode] = metrics;
+        std::map<int, int>::iterator pendingIt = pendingMetrics.find(scratchMeasurement.charCode);
+        if (pendingIt != pendingMetrics.end() && --pendingIt->second == 0) {
+            pendingMetrics.erase(pendingIt);
+            measuredCodePoints.insert(scratchMeasurement.charCode);
+        }
+    }
+}
+
+void TextBoxRenderer::startGlyphBatch() {
+    // the glyphs still on their way are for the old font or size
+    this->lazyBatch = ++nextBatch;
+    this->requestedGlyphs.clear();
+    this->waitingForGlyphs = false;
+    this->glyphsDontFit = false;
+    glyphRasterizer.setActiveBatches(lazyBatch, prewarmBatch);
+}
+
+bool TextBoxRenderer::addCharacter(const GlyphBitmap& glyph, bool evictIfFull) {
+    GlyphAtlas::Region region = { 0, 0.0f, 0.0f, 0.0f, 0.0f };
     glEnable(GL_TEXTURE_2D);
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    glTexImage2D(
-        GL_TEXTURE_2D,
-        0,
-        GL_RED,
-        fontFace->glyph->bitmap.width,
-        fontFace->glyph->bitmap.rows,
-        0,
-        GL_RED,
-        GL_UNSIGNED_BYTE,
-        fontFace->glyph->bitmap.buffer
-    );
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    if (!glyphAtlas.add(glyph.width, glyph.rows, glyph.pixels.data(), region)) {
+        if (!evictIfFull) {
+            return false;
+        }
+        if (glyphAtlas.canFit(glyph.width, glyph.rows)) {
+            // atlas is full, evict every glyph and start over
+            clearGlyphs();
+            glyphAtlas.add(glyph.width, glyph.rows, glyph.pixels.data(), region);
+        } else {
+            consoleLogger->error("Glyph " + std::to_string(glyph.charCode) + " is too big for the glyph atlas");
+        }
+    }
 
     Character character = {
-        texture,
-        glm::ivec2(fontFace->glyph->bitmap.width, fontFace->glyph->bitmap.rows),
-        glm::ivec2(fontFace->glyph->bitmap_left, fontFace->glyph->bitmap_top),
-        fontFace->glyph->advance.x,
-        fontFace->glyph->metrics.height
+        region,
+        glm::ivec2(glyph.width, glyph.rows),
+        glm::ivec2(glyph.left, glyph.top),
+        (unsigned int) glyph.advance,
+        (int) glyph.height
     };
 
-    characterCache.insert(std::pair<int, Character>(charCode, character));
+    characterCache.insert(std::pair<int, Character>(glyph.charCode, character));
+    return true;
 }
 
-void TextBoxRenderer::addNewLineToString(std::string& str, int pos, bool wordWrap) {
-    char newLine = '\n';
-
-    char* strAsCString = (char*)str.c_str();
-    utf8::unchecked::iterator<char*> it(strAsCString);
+void TextBoxRenderer::startPrewarm(std::string fontPath, float fontSize, float decreaseStep) {
+    // the font on screen stays until the new one is rasterized, then both are swapped at once in applyPrewarmedGlyphs
+    this->prewarmPending = true;
+    this->_pendingFontPath = fontPath;
+    this->_pendingFontSize = fontSize;
+    this->_pendingDecreaseStep = decreaseStep;
+
+    this->prewarmBatch = ++nextBatch;
+    this->prewarmRemaining = prewarmCodePoints.size();
+    this->prewarmedGlyphs.clear();
+    glyphRasterizer.setActiveBatches(lazyBatch, prewarmBatch);
+    for (int charCode : prewarmCodePoints) {
+        glyphRasterizer.request(fontPath, fontSize, charCode, prewarmBatch);
+    }
+}
 
-    auto insertIterator = str.begin();
-    int character = -1;
-    for (int i = 0; i < pos && insertIterator != str.end(); i++) {
-        character = utf8::unchecked::next(insertIterator);
+void TextBoxRenderer::applyPrewarmedGlyphs() {
+    std::string fontPath = _pendingFontPath;
+    float fontSize = _pendingFontSize;
+    prewarmPending = false;
+    addBoxDamage();
+
+    this->_desiredFontSize = fontSize;
+    this->_decreaseStep = _pendingDecreaseStep;
+    if (fontPath != _fontPath) {
+        this->_fontPath = fontPath;
+        loadFontFace(fontPath);
+    } else {
+        // the sizes the fitting tries are different now
+        clearMetrics();
     }
+    setFaceFontSize(fontSize);
+    clearGlyphs();
+    _glyphFontSize = fontSize;
+    startGlyphBatch();
+
+    for (const GlyphBitmap& glyph : prewarmedGlyphs) {
+        if (!addCharacter(glyph, false)) {
+            consoleLogger->information("Glyph atlas is full, the remaining glyphs will be rasterized when they are needed");
+            break;
+        }
+    }
+    prewarmedGlyphs.clear();
 
-    bool foundASpaceCharacter = false;
-    if (wordWrap) {
-        if (character != 32) {
-            
-            for (int i = pos; i >= 0 && insertIterator != str.begin(); i--) {
-                character = utf8::unchecked::prior(insertIterator);
-                if (character == 32) { // ASCII code for space
-                    // erase the space
-                    auto insertIteratorOneNext = insertIterator;
-                    utf8::unchecked::next(insertIteratorOneNext); 
-                    str.erase(insertIterator, insertIteratorOneNext);
+    this->cachedInput.clear();
+}
 
-                    foundASpaceCharacter = true;
-                    break;
-                }
-            }
-            if (!foundASpaceCharacter) {
-                for (int i = 0; i < pos && insertIterator != str.end(); i++) {
-                    utf8::unchecked::next(insertIterator);
-                }
+bool TextBoxRenderer::adjustTextForBox(const std::string& input, Lines& lines) {
+    // The sizes we may use are desired, desired - step, desired - 2 * step, ... (the last one being <= step).
+    // A text that fits at one size also fits at all the smaller ones, so binary search for the biggest fitting size.
+    // The search only looks at the glyph metrics, glyphs are rasterized just for the size that wins.
+    int numberOfSizes = getNumberOfCandidateSizes();
+
+    // the candidates are laid out into scratchLines and swapped (not copied) into lines when they fit,
+    // both tables keep their capacity so this doesn't allocate once they are big enough for the text
+    int bestSizeIndex = -1;
+
+    // most texts fit at the desired size, try that first
+    if (measureText(input, getCandidateFontSize(0), lines)) {
+        bestSizeIndex = 0;
+    } else if (numberOfSizes > 1 && measureText(input, getCandidateFontSize(numberOfSizes - 1), scratchLines)) {
+        std::swap(lines, scratchLines);
+
+        // invariant: the size at index high fits, the ones before low don't
+        int low = 1;
+        int high = numberOfSizes - 1;
+        while (low < high) {
+            int middle = low + (high - low) / 2;
+            if (measureText(input, getCandidateFontSize(middle), scratchLines)) {
+                high = middle;
+                std::swap(lines, scratchLines);
+            } else {
+                low = middle + 1;
             }
         }
+
+        bestSizeIndex = high;
+    }
+
+    if (bestSizeIndex < 0) {
+        // doesn't fit at any size, keep the face at the size of the glyphs we have
+        setFaceFontSize(_glyphFontSize);
+        return false;
+    }
+
+    float fittedFontSize = getCandidateFontSize(bestSizeIndex);
+    setFaceFontSize(fittedFontSize);
+    if (fittedFontSize != _glyphFontSize) {
+        clearGlyphs();
+        _glyphFontSize = fittedFontSize;
+        startGlyphBatch();
+    }
+
+    return true;
+}
+
+int TextBoxRenderer::getNumberOfCandidateSizes() {
+    int numberOfSizes = 1;
+    if (_decreaseStep > 0 && _desiredFontSize > _decreaseStep) {
+        numberOfSizes += (int) std::ceil((_desiredFontSize - _decreaseStep) / _decreaseStep);
     }
+    return numberOfSizes;
+}
 
-    std::string newLineString;
-    utf8::append(newLine, std::back_inserter(newLineString));
-    str.insert(insertIterator - str.begin(), newLineString);
+float TextBoxRenderer::getCandidateFontSize(int sizeIndex) {
+    return _desiredFontSize - sizeIndex * _decreaseStep;
 }
 
-bool TextBoxRenderer::adjustTextForBox(std::string& input, Lines& lines) {
-    // measure text
-    int numberOfCharacters = utf8::distance(input.begin(), input.end());
+bool TextBoxRenderer::requestMissingMetrics(const std::string& text) {
+    // The fitting needs the metrics of the text at every size it may try, the workers measure the code points
+    // that are new at all those sizes at once, so the render thread never waits for FreeType.
+    scratchCodePoints.clear();
+    bool allMeasured = true;
+    std::string::const_iterator it = text.begin();
+    while (it != text.end()) {
+        int charCode = utf8::next(it, text.end());
+        if (charCode == 10 || charCode == 13 || measuredCodePoints.count(charCode) != 0) {
+            continue;
+        }
+        allMeasured = false;
+        if (pendingMetrics.find(charCode) == pendingMetrics.end()) {
+            scratchCodePoints.push_back(charCode);
+            pendingMetrics[charCode] = 0;
+        }
+    }
 
-    std::string modifiedText = input;
+    if (!scratchCodePoints.empty()) {
+        int numberOfSizes = getNumberOfCandidateSizes();
+        scratchFontSizes.clear();
+        for (int sizeIndex = 0; sizeIndex < numberOfSizes; sizeIndex++) {
+            scratchFontSizes.push_back(getCandidateFontSize(sizeIndex));
+        }
+        for (int charCode : scratchCodePoints) {
+            pendingMetrics[charCode] = numberOfSizes;
+        }
+        glyphRasterizer.requestMetrics(_fontPath, scratchFontSizes, scratchCodePoints, metricsBatch);
+    }
+    return allMeasured;
+}
 
-    int _numberOfLines = 0;
+bool TextBoxRenderer::measureText(const std::string& input, float fontSize, Lines& lines) {
+    setFaceFontSize(fontSize);
 
-    bool textFitsInBox = false;
+    breakLines(input, lines);
 
-    while (!textFitsInBox) {
-        bool textWidthBiggerThanBoxWidth = false;
+    int totalTextHeight = 0;
+    for (const LineSpan& line : lines.spans) {
+        totalTextHeight += line.ascent + line.descent;
+    }
 
-        numberOfCharacters = utf8::distance(modifiedText.begin(), modifiedText.end());
-        std::string::iterator iterator = modifiedText.begin();
-        _numberOfLines = 0;
-        int textWidth = 0;
-        int textHeight = 0;
+    if (!lines.spans.empty()) {
+        totalTextHeight += (lines.spans.size() - 1) * _lineSpacing;
+    }
 
-        int maxAscend = 0;
-        int maxDescend = 0;
+    lines.totalTextHeight = totalTextHeight;
 
-        for (int i = 0; i < numberOfCharacters; i++) {
-            int charCode = utf8::next(iterator, modifiedText.end());
+    return totalTextHeight <= _height;
+}
 
-            if (charCode != 10) {
-                std::map<int, TextBoxRenderer::Character>::iterator characterIt = characterCache.find(charCode);
+void TextBoxRenderer::breakLines(const std::string& text, Lines& lines) {
+    // Single pass over the text: every line is recorded as a byte range of the (unmodified) text.
+    // When a line overflows it is broken at its last space (if word wrap is on), only the characters after
+    // that space get measured again and they can't be carried over twice, so this stays linear.
+    lines.spans.clear();
+
+    const uint32_t noSpace = UINT32_MAX;
+    LineSpan line = { 0, 0, 0, 0, 0 };
+    LineSpan beforeLastSpace = line;   // the line as it was right before its last space
+    uint32_t lastSpace = noSpace;
+
+    std::string::const_iterator it = text.begin();
+    while (it != text.end()) {
+        uint32_t position = (uint32_t) (it - text.begin());
+        int charCode = utf8::next(it, text.end());
+        uint32_t nextPosition = (uint32_t) (it - text.begin());
+
+        if (charCode == 10 || charCode == 13) {
+            // \r\n is a single line break
+            if (charCode == 13 && it != text.end() && *it == '\n') {
+                ++it;
+                nextPosition++;
+            }
+            line.end = position;
+            lines.spans.push_back(line);
+            line = { nextPosition, nextPosition, 0, 0, 0 };
+            lastSpace = noSpace;
+            continue;
+        }
 
-                if (characterIt == characterCache.end()) {
-                    // cache miss --> generate texture
-                    generateAndAddCharacter(charCode);
-                    characterIt = characterCache.find(charCode);
-                }
+        const GlyphMetrics& metrics = getGlyphMetrics(charCode);
 
-                Character ch = (*characterIt).second;
+        // a line always keeps at least one character, even if it's wider than the box
+        if (line.width + metrics.advance > _width && position > line.begin) {
+            if (charCode == 32 && _wordWrap) {
+                // overflowing on a space, break right here and drop the space
+                line.end = position;
+                lines.spans.push_back(line);
+                line = { nextPosition, nextPosition, 0, 0, 0 };
+                lastSpace = noSpace;
+                continue;
+            }
 
-                textWidth += (ch.Advance >> 6);
-                if (textWidth > _width) {
-                    textWidthBiggerThanBoxWidth = true;
-                    addNewLineToString(modifiedText, i, _wordWrap);
-                    break;
+            if (_wordWrap && lastSpace != noSpace) {
+                // a space at the start of the line leaves nothing before it
+                if (lastSpace > beforeLastSpace.begin) {
+                    beforeLastSpace.end = lastSpace;
+                    lines.spans.push_back(beforeLastSpace);
                 }
 
-                int ascend = ch.Bearing.y;
-                int descend = (ch.height >> 6) - ascend;
-
-                maxAscend = std::max(maxAscend, ascend);
-                maxDescend = std::max(maxDescend, descend);
+                // carry the word after the space over to the new line
+                uint32_t wordStart = lastSpace + 1;
+                line = { wordStart, wordStart, 0, 0, 0 };
+                std::string::const_iterator wordIt = text.begin() + wordStart;
+                std::string::const_iterator wordEnd = text.begin() + position;
+                while (wordIt != wordEnd) {
+                    addToLine(line, getGlyphMetrics(utf8::next(wordIt, wordEnd)));
+                }
 
-            } else {
-                if (_numberOfLines < 256) {
-                    lines.lineWidths[_numberOfLines] = textWidth;
-                    if (textWidth > _width) {
-                        textWidthBiggerThanBoxWidth = true;
-                        addNewLineToString(modifiedText, i, _wordWrap);
-                        break;
-                    }
-                    textHeight = maxAscend + maxDescend;
-                    lines.lineHeights[_numberOfLines] = textHeight;
-                    lines.lineAscends[_numberOfLines] = maxAscend;
-                    _numberOfLines++;
-                    textWidth = 0;
-                    maxAscend = 0;
-                    maxDescend = 0;
+                // the word alone can still be too wide with this character, break it like without word wrap
+                if (line.width + metrics.advance > _width && position > line.begin) {
+                    line.end = position;
+                    lines.spans.push_back(line);
+                    line = { position, position, 0, 0, 0 };
                 }
+            } else {
+                line.end = position;
+                lines.spans.push_back(line);
+                line = { position, position, 0, 0, 0 };
             }
+            lastSpace = noSpace;
         }
 
-        if (textWidthBiggerThanBoxWidth) {
-            continue;
+        if (charCode == 32) {
+            lastSpace = position;
+            beforeLastSpace = line;
         }
 
-        char lastChar = modifiedText.back();
-        if (lastChar != '\n' && lastChar != '\r') {
-            lines.lineWidths[_numberOfLines] = textWidth;
-            textHeight = maxAscend + maxDescend;
-            lines.lineHeights[_numberOfLines] = textHeight;
-            lines.lineAscends[_numberOfLines] = maxAscend;
-            _numberOfLines++;
-        }
+        addToLine(line, metrics);
+    }
 
-        int _totalTextHeight = 0;
+    // a trailing new line doesn't start a new (empty) line
+    if (line.begin < text.size()) {
+        line.end = (uint32_t) text.size();
+        lines.spans.push_back(line);
+    }
+}
 
-        for (int i = 0; i < _numberOfLines; i++) {
-            _totalTextHeight += lines.lineHeights[i];
-        }
+void TextBoxRenderer::addToLine(LineSpan& line, const GlyphMetrics& metrics) {
+    line.width += metrics.advance;
+    line.ascent = std::max(line.ascent, metrics.ascent);
+    line.descent = std::max(line.descent, metrics.descent);
+}
 
-        _totalTextHeight += (_numberOfLines - 1) * _lineSpacing;
+const TextBoxRenderer::GlyphMetrics& TextBoxRenderer::getGlyphMetrics(int charCode) {
+    std::map<int, GlyphMetrics>::iterator metricsIt = sizeMetrics->find(charCode);
+    if (metricsIt != sizeMetrics->end()) {
+        return metricsIt->second;
+    }
 
-        if (_totalTextHeight > _height) {
-            if (_desiredFontSize > _decreaseStep) {
-                _desiredFontSize -= _decreaseStep;
-                FT_Set_Pixel_Sizes(fontFace, 0, _desiredFontSize);
-                characterCache.clear();
-                modifiedText = input;
-                continue;
-            } else {
-                return false;
-            }
-        }
+    // requestMissingMetrics had all code points of the text measured before the layout started
+    static const GlyphMetrics noMetrics = { 0, 0, 0 };
+    return noMetrics;
+}
 
-        lines.totalTextHeight = _totalTextHeight;
-        textFitsInBox = true;
+void TextBoxRenderer::setFaceFontSize(float fontSize) {
+    if (fontSize == _faceFontSize) {
+        return;
     }
+    _faceFontSize = fontSize;
+    sizeMetrics = &metricsCache[fontSize];
+}
 
-    lines.numberOfLines = _numberOfLines;
-    input = modifiedText;
-
-    return textFitsInBox;
+void TextBoxRenderer::clearMetrics() {
+    metricsCache.clear();
+    sizeMetrics = &metricsCache[_faceFontSize];
+    // the measurements still on their way are for the old font or sizes
+    measuredCodePoints.clear();
+    pendingMetrics.clear();
+    metricsBatch = ++nextBatch;
+    glyphRasterizer.setActiveMetricsBatch(metricsBatch);
 }
 
 void TextBoxRenderer::drawDebugLines(float boxX, float boxY, float width, float height) {
@@ -449,63 +696,32 @@ void TextBoxRenderer::drawDebugLines(float boxX, float boxY, float width, float
 
 
 void TextBoxRenderer::loadFontFace(std::string fontPath) {
-    size_t fontFileSize;
-    const unsigned char* fontFileBuffer = loadFile(fontPath, fontFileSize);
-    if (fontFileBuffer == nullptr) {
-        consoleLogger->error("Could not load font file " + fontPath + " into memory");
-        exit(1);
-    }
-
-    FT_Face fontFace;
-    int freeTypeError = FT_New_Memory_Face(_freeTypeLibrary, fontFileBuffer, fontFileSize, 0, &fontFace);
-
-    if (freeTypeError) {
-        consoleLogger->error("Error loading the font from memory. Error code: " + freeTypeError);
+    // the glyphs are measured and rasterized by the workers, the shared face only makes sure the font loads
+    FT_Face fontFace = _fontRegistry->acquireSharedFace(fontPath);
+    if (fontFace == nullptr) {
+        consoleLogger->error("Could not load the font " + fontPath);
         exit(1);
     }
 
-    FT_Set_Pixel_Sizes(fontFace, 0, _desiredFontSize);
-
     if (this->fontFace) {
-        FT_Done_Face(this->fontFace);
+        _fontRegistry->releaseSharedFace(this->fontFace);
     }
 
-
     this->fontFace = fontFace;
-}
-
-
-unsigned char* TextBoxRenderer::loadFile(const std::string& filename, size_t& fileSize) {
-    // Open the file in binary mode
-    std::ifstream file(filename, std::ios::binary | std::ios::ate);
-
-    // Check if the file was successfully opened
-    if (!file.is_open()) {
-        return nullptr;
-    }
-
-    // Get the size of the file
-    fileSize = file.tellg();
-    file.seekg(0, std::ios::beg);
-
-    // Allocate memory to hold the file contents
-    unsigned char* buffer = new unsigned char[fileSize];
-
-    // Read the file contents into the buffer
-    if (file.read(reinterpret_cast<char*>(buffer), fileSize)) {
-        return buffer;
-    }
-    else {
-        delete[] buffer;
-        return nullptr;
-    }
+    this->_faceFontSize = _desiredFontSize;
+    this->_glyphFontSize = _desiredFontSize;
+    clearMetrics();
 }
 
 void TextBoxRenderer::setText(std::string text) {
+    if (text != this->_text) {
+        addBoxDamage();
+    }
     this->_text = text;
 }
 
 void TextBoxRenderer::setColor(float colorR, float colorG, float colorB, float colorA) {
+    addBoxDamage();
     this->_colorR = colorR;
     this->_colorG = colorG;
     this->_colorB = colorB;
@@ -513,39 +729,120 @@ void TextBoxRenderer::setColor(float colorR, float colorG, float colorB, float c
 }
 
 void TextBoxRenderer::setBoxPosition(float boxX, float boxY) {
+    // where the box was and where it is now
+    addBoxDamage();
     this->_boxX = boxX;
     this->_boxY = boxY;
+    addBoxDamage();
+    this->verticesNeedUpdate = true;
 }
 
 void TextBoxRenderer::setBoxSize(float width, float height) {
+    addBoxDamage();
     this->_width = width;
     this->_height = height;
+    addBoxDamage();
+    this->cachedInput.clear();
 }
 
 void TextBoxRenderer::setFontSize(float desiredFontSize, float decreaseStep) {
+    if (!prewarmCodePoints.empty()) {
+        startPrewarm(prewarmPending ? _pendingFontPath : _fontPath, desiredFontSize, decreaseStep);
+        return;
+    }
+    addBoxDamage();
     this->_desiredFontSize = desiredFontSize;
     this->_decreaseStep = decreaseStep;
-    FT_Set_Pixel_Sizes(fontFace, 0, _desiredFontSize);
-    clearCache();
+    // the glyphs are only evicted if the fitted size changes, the metrics of the old candidate sizes aren't needed anymore
+    clearMetrics();
+    this->cachedInput.clear();
 }
 
 void TextBoxRenderer::setLineSpacing(float lineSpacing) {
+    addBoxDamage();
     this->_lineSpacing = lineSpacing;
+    this->cachedInput.clear();
 }
 
 void TextBoxRenderer::setWordWrap(bool wordWrap) {
+    addBoxDamage();
     this->_wordWrap = wordWrap;
+    this->cachedInput.clear();
 }
 
 void TextBoxRenderer::setFont(std::string fontPath) {
+    if (!prewarmCodePoints.empty()) {
+        if (prewarmPending) {
+            startPrewarm(fontPath, _pendingFontSize, _pendingDecreaseStep);
+        } else {
+            startPrewarm(fontPath, _desiredFontSize, _decreaseStep);
+        }
+        return;
+    }
+    addBoxDamage();
     this->_fontPath = fontPath;
     loadFontFace(fontPath);
     clearCache();
+    startGlyphBatch();
 }
 
 void TextBoxRenderer::setScreenSize(float screenWidth, float screenHeight) {
+    // only the projection depends on the screen, the glyphs and the layout stay valid
     this->projectionMatrix = glm::ortho(0.0f, screenWidth, 0.0f, screenHeight);
-    clearCache();
+    this->_screenWidth = screenWidth;
+    this->_screenHeight = screenHeight;
+    // everything moves relative to the new screen
+    this->damage = DamageRect::full((int) std::ceil(screenWidth), (int) std::ceil(screenHeight));
+}
+
+void TextBoxRenderer::setGlyphPrewarm(const std::vector<int>& codePoints) {
+    this->prewarmCodePoints = codePoints;
+    if (!prewarmCodePoints.empty()) {
+        startPrewarm(_fontPath, _desiredFontSize, _decreaseStep);
+    }
+}
+
+void TextBoxRenderer::setRedrawCallback(std::function<void()> callback) {
+    glyphRasterizer.setOnGlyphsReady(callback);
+}
+
+void TextBoxRenderer::setGlyphRasterizerThreads(int numberOfThreads) {
+    glyphRasterizer.setNumberOfWorkers(numberOfThreads);
+}
+
+void TextBoxRenderer::setGlyphDiskCache(GlyphDiskCache* diskCache) {
+    glyphRasterizer.setDiskCache(diskCache);
+}
+
+DamageRect TextBoxRenderer::takeDamage(int framebufferWidth, int framebufferHeight) {
+    DamageRect framebufferDamage = damage;
+    damage = DamageRect();
+    if (framebufferDamage.isEmpty() || _screenWidth <= 0 || _screenHeight <= 0) {
+        return DamageRect();
+    }
+
+    // the projection maps the screen to the whole framebuffer, they differ with display scaling
+    float scaleX = framebufferWidth / _screenWidth;
+    float scaleY = framebufferHeight / _screenHeight;
+    int left = (int) std::floor(framebufferDamage.x * scaleX);
+    int bottom = (int) std::floor(framebufferDamage.y * scaleY);
+    framebufferDamage.width = (int) std::ceil((framebufferDamage.x + framebufferDamage.width) * scaleX) - left;
+    framebufferDamage.height = (int) std::ceil((framebufferDamage.y + framebufferDamage.height) * scaleY) - bottom;
+    framebufferDamage.x = left;
+    framebufferDamage.y = bottom;
+    framebufferDamage.clip(framebufferWidth, framebufferHeight);
+    return framebufferDamage;
+}
+
+void TextBoxRenderer::addBoxDamage() {
+    // everything the renderer draws is inside the box, the margin covers anti-aliased edges and the debug lines
+    const float margin = 2.0f;
+    DamageRect box;
+    box.x = (int) std::floor(_boxX - margin);
+    box.y = (int) std::floor(_boxY - margin);
+    box.width = (int) std::ceil(_boxX + _width + margin) - box.x;
+    box.height = (int) std::ceil(_boxY + _height + margin) - box.y;
+    damage.unite(box);
 }
 
 std::string TextBoxRenderer::getText() {
@@ -553,10 +850,20 @@ std::string TextBoxRenderer::getText() {
 }
 
 std::string TextBoxRenderer::getFontPath() {
+    if (prewarmPending) {
+        return this->_pendingFontPath;
+    }
     return this->_fontPath;
 }
 
 void TextBoxRenderer::clearCache() {
-    this->characterCache.clear();
+    clearGlyphs();
     this->cachedInput.clear();
+}
+
+void TextBoxRenderer::clearGlyphs() {
+    this->characterCache.clear();
+    this->glyphAtlas.clear();
+    // the atlas regions of the batched quads are gone
+    this->verticesNeedUpdate = true;
 }
\ No newline at end of file
@@ -2,19 +2,30 @@
 #include <ft2build.h>
 #include FT_FREETYPE_H
 #include <string>
+#include <cstdint>
+#include <vector>
+#include <map>
+#include <set>
+#include <functional>
 #include <glm/glm.hpp>
 #include "Poco/Logger.h"
+#include "GlyphAtlas.h"
+#include "GlyphRasterizer.h"
+#include "FontRegistry.h"
+#include "DamageRect.h"
 
 using Poco::Logger;
 
 class TextBoxRenderer {
 public:
-    TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, float desiredFontSize, float decreaseStep, float lineSpacing, float colorR, float colorG, float colorB, float colorA, std::string fontPath, bool wordWrap, Logger* logger, FT_Library& freeTypeLibrary);
+    TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, float desiredFontSize, float decreaseStep, float lineSpacing, float colorR, float colorG, float colorB, float colorA, std::string fontPath, bool wordWrap, Logger* logger, FontRegistry* fontRegistry);
     
-    TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, Logger* logger, FT_Library& freeTypeLibrary);
+    TextBoxRenderer(float screenWidth, float screenHeight, float boxX, float boxY, float width, float height, Logger* logger, FontRegistry* fontRegistry);
     //~TextBoxRenderer();
 
-    void renderCenteredText(bool debug = false);
+    // Returns false if glyphs of the text are still being rasterized and nothing was drawn,
+    // the redraw callback is called once they are ready
+    bool renderCenteredText(bool debug = false);
     void setText(std::string text);
     void setColor(float colorR, float colorG, float colorB, float colorA);
     void setBoxPosition(float boxX, float boxY);
@@ -24,6 +35,14 @@ public:
     void setWordWrap(bool wordWrap);
     void setFont(std::string fontPath);
     void setScreenSize(float screenWidth, float screenHeight);
+    // Code points to rasterize in the background whenever the font or its size changes, empty to disable
+    void setGlyphPrewarm(const std::vector<int>& codePoints);
+    // Called from a background thread when rasterized glyphs are ready to be uploaded
+    void setRedrawCallback(std::function<void()> callback);
+    void setGlyphRasterizerThreads(int numberOfThreads);
+    void setGlyphDiskCache(GlyphDiskCache* diskCache);
+    // What changed on screen since the last call, in pixels of the framebuffer. Call after a complete frame was drawn.
+    DamageRect takeDamage(int framebufferWidth, int framebufferHeight);
     std::string getText();
     std::string getFontPath();
 private:
@@ -41,35 +60,100 @@ private:
     bool _wordWrap;
     std::string _text;
     std::string _fontPath;
+    float _screenWidth;
+    float _screenHeight;
+    DamageRect damage;      // in screen units, collected by the setters until takeDamage
 
     struct Character {
-        unsigned int TextureID; // ID handle of the glyph texture
+        GlyphAtlas::Region AtlasRegion; // where the glyph lives in the glyph atlas
         glm::ivec2   Size;      // Size of glyph
         glm::ivec2   Bearing;   // Offset from baseline to left/top of glyph
         unsigned int Advance;   // Horizontal offset to advance to next glyph
         int height;
     };
 
+    // what the layout needs to know about a glyph, available without rasterizing it
+    struct GlyphMetrics {
+        int advance;
+        int ascent;
+        int descent;
+    };
+
+    // one laid out line, a byte range of the text plus its measurements (20 bytes, a long text costs next to nothing)
+    struct LineSpan {
+        uint32_t begin;
+        uint32_t end;
+        int width;
+        int ascent;
+        int descent;
+    };
+
+    // grows with the text, never shrinks, so laying out again doesn't allocate
     struct Lines {
-        int lineWidths[256];
-        int lineHeights[256];
-        int lineAscends[256];
-        int numberOfLines;
-        int totalTextHeight;
+        std::vector<LineSpan> spans;
+        int totalTextHeight = 0;
     };
 
     Logger* consoleLogger;
-    FT_Library _freeTypeLibrary;
-    FT_Face fontFace;
+    FontRegistry* _fontRegistry;
+    FT_Face fontFace;       // shared with the other renderers using the font, keeps it mapped for the workers
     glm::mat4 projectionMatrix;
     unsigned int shaderID;
     unsigned int VBO;
+    size_t vboCapacity;
+    int positionAttributeLocation;
+    int texCoordAttributeLocation;
+    int colorLocation;
+    int projectionLocation;
+    int textTextureLocation;
+
+    // all quads of the laid out text, rebuilt only when the layout changes
+    struct DrawRange {
+        unsigned int page;
+        int first;
+        int count;
+    };
+    std::vector<float> vertexBatch;
+    std::vector<std::vector<float>> pageBatches;
+    std::vector<DrawRange> drawRanges;
+    bool verticesNeedUpdate;
 
     // cache
     std::map<int, Character> characterCache;
+    std::map<float, std::map<int, GlyphMetrics>> metricsCache;    // per font size, the fitting search goes back and forth between sizes
+    std::map<int, GlyphMetrics>* sizeMetrics;                       // the metrics of _faceFontSize
+    unsigned int metricsBatch;
+    std::set<int> measuredCodePoints;   // have metrics at every candidate size
+    std::map<int, int> pendingMetrics;  // sizes the workers still have to measure a code point at
+    std::vector<int> scratchCodePoints;
+    std::vector<float> scratchFontSizes;
+    GlyphMeasurement scratchMeasurement;
+    GlyphAtlas glyphAtlas;
+    float _faceFontSize;    // size the layout is measuring with
+    float _glyphFontSize;   // size the glyphs in characterCache were rasterized at
     std::string cachedInput;
-    std::string cachedModifiedText;
     Lines cachedLines;
+    Lines scratchLines;     // layout of the size being tried by the font fitting, swapped with cachedLines when it fits
+    GlyphBitmap scratchGlyph;
+
+    // glyphs are rasterized by the worker threads, requests of an old font or size are dropped by batch
+    GlyphRasterizer glyphRasterizer;
+    unsigned int nextBatch;
+    unsigned int lazyBatch;             // glyphs of the text on screen, at _fontPath and _glyphFontSize
+    std::set<int> requestedGlyphs;      // requested in lazyBatch and not arrived yet
+    bool waitingForGlyphs;
+    unsigned int waitAtlasGeneration;
+    bool glyphsDontFit;
+
+    // prewarm: font and size that become active once the background rasterizer is done
+    unsigned int prewarmBatch;
+    size_t prewarmRemaining;
+    std::vector<int> prewarmCodePoints;
+    std::vector<GlyphBitmap> prewarmedGlyphs;
+    bool prewarmPending;
+    std::string _pendingFontPath;
+    float _pendingFontSize;
+    float _pendingDecreaseStep;
     bool cachedIsTextFittingInBox;
 
     const char* vertexShaderSource = R"(
@@ -98,22 +182,53 @@ private:
        gl_FragColor = vec4(textColor.rgb, sampled.r * textColor.a);
     }
 )";
-    void generateAndAddCharacter(int charCode);
+    void receiveRasterizedGlyphs();
+
+    void startGlyphBatch();
+
+    bool addCharacter(const GlyphBitmap& glyph, bool evictIfFull);
+
+    void startPrewarm(std::string fontPath, float fontSize, float decreaseStep);
+
+    void applyPrewarmedGlyphs();
 
     enum ShaderType {vertex, fragment, program};
 
     void checkCompileErrors(unsigned int shader, ShaderType type);
 
-    bool adjustTextForBox(std::string& input, Lines& lines);
+    bool adjustTextForBox(const std::string& input, Lines& lines);
 
-    static void addNewLineToString(std::string& str, int position, bool breakAtSpace);
+    int getNumberOfCandidateSizes();
 
-    void drawDebugLines(float boxX, float boxY, float width, float height);
+    float getCandidateFontSize(int sizeIndex);
+
+    bool requestMissingMetrics(const std::string& text);
 
-    unsigned char* loadFile(const std::string& filename, size_t& fileSize);
+    bool measureText(const std::string& input, float fontSize, Lines& lines);
+
+    void breakLines(const std::string& text, Lines& lines);
+
+    static void addToLine(LineSpan& line, const GlyphMetrics& metrics);
+
+    const GlyphMetrics& getGlyphMetrics(int charCode);
+
+    void setFaceFontSize(float fontSize);
+
+    void clearMetrics();
+
+    bool buildVertexBatch();
+
+    void uploadVertexBatch();
+
+    // the box as it is now has to be drawn again
+    void addBoxDamage();
+
+    void drawDebugLines(float boxX, float boxY, float width, float height);
 
     void loadFontFace(std::string fontPath);
 
     void clearCache();
+
+    void clearGlyphs();
 };
 
@@ -0,0 +1,299 @@
+#include "VideoEncoder.h"
+#include <algorithm>
+#include <cctype>
+
+extern "C"
+{
+#include "libavutil/dict.h"
+}
+
+#include "Poco/String.h"
+#include "Poco/StringTokenizer.h"
+#include "Poco/Exception.h"
+
+bool loadStreamProfile(Poco::Util::AbstractConfiguration& configuration, const std::string& name, StreamProfile& profile, std::string& error) {
+	std::string prefix = "StreamProfiles." + name;
+	Poco::Util::AbstractConfiguration::Keys keys;
+	configuration.keys(prefix, keys);
+	if (name.empty() || keys.empty()) {
+		error = "stream profile not found: " + name;
+		return false;
+	}
+
+	StreamProfile loadedProfile;
+	loadedProfile.name = name;
+	try {
+		loadedProfile.width = configuration.getInt(prefix + ".width", loadedProfile.width);
+		loadedProfile.height = configuration.getInt(prefix + ".height", loadedProfile.height);
+		loadedProfile.fps = configuration.getInt(prefix + ".fps", loadedProfile.fps);
+		loadedProfile.bitrateKbps = configuration.getInt(prefix + ".bitrateKbps", loadedProfile.bitrateKbps);
+		loadedProfile.keyframeIntervalS = configuration.getInt(prefix + ".keyframeIntervalS", loadedProfile.keyframeIntervalS);
+		loadedProfile.speed = configuration.getInt(prefix + ".speed", loadedProfile.speed);
+		loadedProfile.layers = configuration.getInt(prefix + ".layers", loadedProfile.layers);
+		if (configuration.has(prefix + ".codecs")) {
+			loadedProfile.codecs = VideoEncoder::parseCodecList(configuration.getString(prefix + ".codecs"));
+		}
+	} catch (Poco::SyntaxException& e) {
+		error = "stream profile " + name + ": " + e.message();
+		return false;
+	}
+
+	if (!validateStreamProfile(loadedProfile, error)) {
+		return false;
+	}
+	profile = loadedProfile;
+	return true;
+}
+
+bool validateStreamProfile(const StreamProfile& profile, std::string& error) {
+	if (profile.width < 0 || profile.height < 0) {
+		error = "width and height can't be negative";
+	} else if (profile.fps < 1 || profile.fps > 120) {
+		error = "fps has to be between 1 and 120";
+	} else if (profile.bitrateKbps < 50 || profile.bitrateKbps > 100000) {
+		error = "bitrate_kbps has to be between 50 and 100000";
+	} else if (profile.keyframeIntervalS < 1) {
+		error = "keyframe_interval_s has to be at least 1";
+	} else if (profile.speed < 0 || profile.speed > 9) {
+		error = "speed has to be between 0 and 9";
+	} else if (profile.codecs.empty()) {
+		error = "codecs needs at least one of VP8, VP9, H264 or AV1";
+	} else if (profile.layers < 1 || profile.layers > maximumStreamLayers) {
+		error = "layers has to be between 1 and " + std::to_string(maximumStreamLayers);
+	} else {
+		return true;
+	}
+	return false;
+}
+
+int getLayerBitrateKbps(const StreamProfile& profile, int layer) {
+	int bitrateKbps = profile.bitrateKbps;
+	for (int i = 0; i < layer; i++) {
+		bitrateKbps /= 3;
+	}
+	return std::max(bitrateKbps, 50);
+}
+
+VideoEncoder::VideoEncoder(Logger* logger) {
+	this->appLogger = logger;
+	this->encoder = nullptr;
+	this->context = nullptr;
+}
+
+VideoEncoder::~VideoEncoder() {
+	close();
+}
+
+int VideoEncoder::open(VideoCodec codec, const StreamProfile& profile, int width, int height, bool globalHeader) {
+	close();
+
+	for (const std::string& encoderName : getEncoderNames(codec)) {
+		encoder = avcodec_find_encoder_by_name(encoderName.c_str());
+		if (encoder != nullptr) {
+			break;
+		}
+	}
+	if (encoder == nullptr) {
+		appLogger->error("FFmpeg has no encoder for " + getCodecName(codec));
+		return -1;
+	}
+
+	context = avcodec_alloc_context3(encoder);
+	if (context == nullptr) {
+		appLogger->error("Could not allocate the " + getCodecName(codec) + " encoder");
+		return -1;
+	}
+
+	AVRational frameRate = { profile.fps, 1 };
+	context->codec_type = AVMEDIA_TYPE_VIDEO;
+	context->width = width;
+	context->height = height;
+	context->bit_rate = (int64_t) profile.bitrateKbps * 1000;
+	context->gop_size = profile.keyframeIntervalS * profile.fps;
+	// B-frames would hold the frames back, a receiver should see a change as soon as it is rendered
+	context->max_b_frames = 0;
+	context->pix_fmt = AV_PIX_FMT_YUV420P;
+	context->framerate = frameRate;
+	context->time_base = av_inv_q(frameRate);
+	context->strict_std_compliance = FF_COMPLIANCE_EXPERIMENTAL;
+	if (codec == VideoCodec::H264) {
+		// what the SDP offers (profile-level-id=42e01f), browsers can decode it without hardware support
+		context->profile = AV_PROFILE_H264_CONSTRAINED_BASELINE;
+	}
+	if (globalHeader) {
+		context->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+	}
+
+	AVDictionary* options = nullptr;
+	setOptions(codec, profile, &options);
+	int ret = avcodec_open2(context, encoder, &options);
+	// the options the encoder doesn't know stay in the dictionary
+	av_dict_free(&options);
+	if (ret < 0) {
+		appLogger->error("Could not open the video encoder " + getEncoderName());
+		avcodec_free_context(&context);
+		return ret;
+	}
+
+	appLogger->information("Encoding %s with %s", getCodecName(codec), getEncoderName());
+	return 0;
+}
+
+void VideoEncoder::setOptions(VideoCodec codec, const StreamProfile& profile, AVDictionary** options) {
+	std::string encoderName = encoder->name;
+	switch (codec) {
+	case VideoCodec::VP8:
+	case VideoCodec::VP9:
+		av_dict_set(options, "deadline", "realtime", 0);
+		av_dict_set_int(options, "cpu-used", profile.speed, 0);
+		av_dict_set_int(options, "lag-in-frames", 0, 0);
+		if (codec == VideoCodec::VP9) {
+			av_dict_set(options, "tune-content", "screen", 0);
+			av_dict_set_int(options, "row-mt", 1, 0);
+		} else {
+			av_dict_set_int(options, "screen-content-mode", 1, 0);
+		}
+		break;
+	case VideoCodec::H264:
+		if (encoderName == "libx264") {
+			static const char* presets[] = { "slow", "medium", "fast", "faster", "veryfast", "veryfast", "superfast", "superfast", "ultrafast", "ultrafast" };
+			av_dict_set(options, "preset", presets[std::clamp(profile.speed, 0, 9)], 0);
+			av_dict_set(options, "tune", "stillimage,zerolatency", 0);
+			av_dict_set(options, "profile", "baseline", 0);
+		} else {
+			// openh264 skips frames to keep the bitrate, a slide that changed has to be sent
+			av_dict_set_int(options, "allow_skip_frames", 0, 0);
+		}
+		break;
+	case VideoCodec::AV1:
+		if (encoderName == "libsvtav1") {
+			// presets 4 - 13, scm: screen content mode, pred-struct 1: low delay
+			av_dict_set_int(options, "preset", 4 + std::clamp(profile.speed, 0, 9), 0);
+			av_dict_set(options, "svtav1-params", "scm=1:pred-struct=1", 0);
+		} else {
+			av_dict_set(options, "usage", "realtime", 0);
+			av_dict_set_int(options, "cpu-used", 1 + std::clamp(profile.speed, 0, 9), 0);
+			av_dict_set_int(options, "lag-in-frames", 0, 0);
+			av_dict_set_int(options, "enable-palette", 1, 0);
+			av_dict_set_int(options, "row-mt", 1, 0);
+		}
+		break;
+	}
+}
+
+void VideoEncoder::close() {
+	avcodec_free_context(&context);
+	encoder = nullptr;
+}
+
+AVCodecContext* VideoEncoder::getContext() {
+	return context;
+}
+
+std::string VideoEncoder::getEncoderName() {
+	return encoder == nullptr ? "" : encoder->name;
+}
+
+std::string VideoEncoder::getCodecName(VideoCodec codec) {
+	switch (codec) {
+	case VideoCodec::VP8:
+		return "VP8";
+	case VideoCodec::VP9:
+		return "VP9";
+	case VideoCodec::H264:
+		return "H264";
+	case VideoCodec::AV1:
+		return "AV1";
+	default:
+		return "Unknown";
+	}
+}
+
+bool VideoEncoder::parseCodecName(const std::string& name, VideoCodec& codec) {
+	for (VideoCodec candidate : { VideoCodec::VP8, VideoCodec::VP9, VideoCodec::H264, VideoCodec::AV1 }) {
+		if (Poco::icompare(name, getCodecName(candidate)) == 0) {
+			codec = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+std::vector<VideoCodec> VideoEncoder::parseCodecList(const std::string& list) {
+	std::vector<VideoCodec> codecs;
+	Poco::StringTokenizer tokenizer(list, ",", Poco::StringTokenizer::TOK_TRIM | Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+	for (const std::string& name : tokenizer) {
+		VideoCodec codec;
+		if (parseCodecName(name, codec) && std::find(codecs.begin(), codecs.end(), codec) == codecs.end()) {
+			codecs.push_back(codec);
+		}
+	}
+	return codecs;
+}
+
+std::string VideoEncoder::codecListToString(const std::vector<VideoCodec>& codecs) {
+	std::string list;
+	for (VideoCodec codec : codecs) {
+		if (!list.empty()) {
+			list += ", ";
+		}
+		list += getCodecName(codec);
+	}
+	return list;
+}
+
+bool VideoEncoder::isAvailable(VideoCodec codec) {
+	for (const std::string& encoderName : getEncoderNames(codec)) {
+		if (avcodec_find_encoder_by_name(encoderName.c_str()) != nullptr) {
+			return true;
+		}
+	}
+	return false;
+}
+
+int VideoEncoder::getPayloadType(VideoCodec codec) {
+	switch (codec) {
+	case VideoCodec::VP8:
+		return 97;
+	case VideoCodec::H264:
+		return 98;
+	case VideoCodec::AV1:
+		return 99;
+	case VideoCodec::VP9:
+	default:
+		return 96;
+	}
+}
+
+void VideoEncoder::addToDescription(VideoCodec codec, rtc::Description::Video& media) {
+	int payloadType = getPayloadType(codec);
+	switch (codec) {
+	case VideoCodec::VP8:
+		media.addVP8Codec(payloadType);
+		break;
+	case VideoCodec::VP9:
+		media.addVP9Codec(payloadType);
+		break;
+	case VideoCodec::H264:
+		media.addH264Codec(payloadType);
+		break;
+	case VideoCodec::AV1:
+		media.addAV1Codec(payloadType);
+		break;
+	}
+}
+
+std::vector<std::string> VideoEncoder::getEncoderNames(VideoCodec codec) {
+	switch (codec) {
+	case VideoCodec::VP8:
+		return { "libvpx" };
+	case VideoCodec::VP9:
+		return { "libvpx-vp9" };
+	case VideoCodec::H264:
+		return { "libx264", "libopenh264" };
+	case VideoCodec::AV1:
+		return { "libsvtav1", "libaom-av1" };
+	default:
+		return {};
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+#include <string>
+#include <vector>
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+}
+
+#include "rtc/rtc.hpp"
+#include "Poco/Logger.h"
+#include "Poco/Util/AbstractConfiguration.h"
+
+using Poco::Logger;
+
+enum class VideoCodec {
+	VP8,
+	VP9,
+	H264,
+	AV1
+};
+
+// How the projector is encoded for the receivers, the profiles are in SimpleTextProjector.properties (StreamProfiles.<name>.*)
+struct StreamProfile {
+	std::string name = "default";
+	int width = 0;			// largest size of the stream, 0: the size of the monitor. The aspect ratio of the monitor is kept
+	int height = 0;
+	int fps = 30;
+	int bitrateKbps = 2500;
+	int keyframeIntervalS = 3;	// also while the projector shows the same frame, for decoders that lost track
+	int speed = 6;			// 0 - 9, higher is faster with less quality (mapped to the presets of each encoder)
+	std::vector<VideoCodec> codecs = { VideoCodec::VP9 };	// offered to the receivers, the first one a receiver supports is used
+	int layers = 1;			// 1 - 3 simulcast layers, each one has half the size and a third of the bitrate of the one before
+};
+
+static const int maximumStreamLayers = 3;
+
+// Reads StreamProfiles.<name>.* (keys that are missing keep their default). False with the error if the profile
+// doesn't exist or one of its values is out of range.
+bool loadStreamProfile(Poco::Util::AbstractConfiguration& configuration, const std::string& name, StreamProfile& profile, std::string& error);
+bool validateStreamProfile(const StreamProfile& profile, std::string& error);
+// the bitrate of a simulcast layer, layer 0 has the bitrate of the profile
+int getLayerBitrateKbps(const StreamProfile& profile, int layer);
+
+// An FFmpeg encoder for one of the codecs WebRTC receivers can decode, set up for text slides:
+// realtime, no B-frames and the screen content tools of the encoder where it has them.
+class VideoEncoder {
+public:
+	VideoEncoder(Logger* logger);
+	~VideoEncoder();
+
+	// Opens the first encoder of the codec FFmpeg was built with, < 0 if there is none or it couldn't be opened
+	int open(VideoCodec codec, const StreamProfile& profile, int width, int height, bool globalHeader);
+	void close();
+	AVCodecContext* getContext();
+	std::string getEncoderName();
+
+	// "VP9", like in the SDP
+	static std::string getCodecName(VideoCodec codec);
+	// case insensitive, false if the name isn't a codec
+	static bool parseCodecName(const std::string& name, VideoCodec& codec);
+	// comma separated names ("VP9, H264"), unknown names are skipped
+	static std::vector<VideoCodec> parseCodecList(const std::string& list);
+	static std::string codecListToString(const std::vector<VideoCodec>& codecs);
+	// if FFmpeg has an encoder for it
+	static bool isAvailable(VideoCodec codec);
+	static int getPayloadType(VideoCodec codec);
+	static void addToDescription(VideoCodec codec, rtc::Description::Video& media);
+
+private:
+	static std::vector<std::string> getEncoderNames(VideoCodec codec);
+	void setOptions(VideoCodec codec, const StreamProfile& profile, AVDictionary** options);
+
+	Logger* appLogger;
+	const AVCodec* encoder;
+	AVCodecContext* context;
+};
@@ -38,7 +38,7 @@ public:
 			int n;
 			clientSetMutex.lock();
 			if (!clients.count(*ws)) {
-				clients.insert(*ws);
+				clients[*ws] = std::make_shared<Mutex>();
 			}
 			clientSetMutex.unlock();
 
@@ -0,0 +1,129 @@
+// Compares the speed of the RGBA -> I420 kernels of the ColorConverter with swscale, ColorConverterTest checks their output.
+// Usage: ColorConversionBenchmark [width] [height] [frames]
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <chrono>
+#include <random>
+#include <vector>
+
+extern "C"
+{
+#include "libavutil/frame.h"
+#include "libswscale/swscale.h"
+}
+
+#include "ColorConverter.h"
+
+struct Plane {
+	std::vector<uint8_t> pixels;
+	int stride;
+};
+
+struct I420Frame {
+	Plane planes[3];
+
+	I420Frame(int width, int height) {
+		planes[0] = { std::vector<uint8_t>((size_t) width * height), width };
+		planes[1] = { std::vector<uint8_t>((size_t) width * height / 4), width / 2 };
+		planes[2] = { std::vector<uint8_t>((size_t) width * height / 4), width / 2 };
+	}
+
+	void getPointers(uint8_t* data[3], int stride[3]) {
+		for (int i = 0; i < 3; i++) {
+			data[i] = planes[i].pixels.data();
+			stride[i] = planes[i].stride;
+		}
+	}
+};
+
+int64_t getWallMicroseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// like a slide: lines of light "glyphs" with anti-aliased edges on a dark background
+void drawSlide(std::vector<uint8_t>& rgba, int width, int height, std::mt19937& random) {
+	for (size_t i = 0; i < rgba.size(); i += 4) {
+		rgba[i] = 10;
+		rgba[i + 1] = 20;
+		rgba[i + 2] = 60;
+		rgba[i + 3] = 255;
+	}
+	int glyphHeight = height / 14;
+	for (int line = 0; line < 4; line++) {
+		int top = height / 4 + line * glyphHeight * 5 / 4;
+		for (int x = width / 8; x < width * 7 / 8; x += glyphHeight / 2) {
+			int glyphWidth = glyphHeight / 4 + (int) (random() % (glyphHeight / 4 + 1));
+			for (int y = top; y < top + glyphHeight && y < height; y++) {
+				for (int column = x; column < x + glyphWidth && column < width; column++) {
+					uint8_t coverage = (column == x || column == x + glyphWidth - 1) ? 128 : 255;
+					uint8_t* pixel = &rgba[((size_t) y * width + column) * 4];
+					pixel[0] = pixel[1] = pixel[2] = coverage;
+				}
+			}
+		}
+	}
+}
+
+int main(int argc, char** argv) {
+	int width = (argc > 1 ? std::atoi(argv[1]) : 1920) & ~1;
+	int height = (argc > 2 ? std::atoi(argv[2]) : 1080) & ~1;
+	int frames = argc > 3 ? std::atoi(argv[3]) : 100;
+	if (width <= 0 || height <= 0 || frames <= 0) {
+		std::fprintf(stderr, "Usage: ColorConversionBenchmark [width] [height] [frames]\n");
+		return 1;
+	}
+
+	std::mt19937 random(42);
+	std::vector<uint8_t> slide((size_t) width * height * 4);
+	drawSlide(slide, width, height, random);
+
+	// bottom up like glReadPixels gives them, the streamer flips with a negative stride
+	const uint8_t* slideData[1] = { slide.data() + (size_t) (height - 1) * width * 4 };
+	int sourceStride[1] = { -width * 4 };
+
+	SwsContext* swsContext = sws_getContext(width, height, AV_PIX_FMT_RGBA, width, height, AV_PIX_FMT_YUV420P, SWS_BICUBIC, nullptr, nullptr, nullptr);
+	if (swsContext == nullptr) {
+		std::fprintf(stderr, "Could not create the SWS context\n");
+		return 1;
+	}
+
+	const ColorConverter::Kernel kernels[] = { ColorConverter::Kernel::Scalar, ColorConverter::Kernel::SSE2, ColorConverter::Kernel::AVX2 };
+	std::printf("%dx%d, %d frames, ms per frame\n", width, height, frames);
+	I420Frame frame(width, height);
+	uint8_t* data[3];
+	int stride[3];
+	frame.getPointers(data, stride);
+
+	int64_t start = getWallMicroseconds();
+	for (int i = 0; i < frames; i++) {
+		sws_scale(swsContext, slideData, sourceStride, 0, height, data, stride);
+	}
+	std::printf("%-8s full frame %7.3f\n", "swscale", (getWallMicroseconds() - start) / 1000.0 / frames);
+
+	for (ColorConverter::Kernel kernel : kernels) {
+		ColorConverter converter;
+		if (!converter.setKernel(kernel)) {
+			std::printf("%-8s not supported by the CPU\n", ColorConverter::getKernelName(kernel));
+			continue;
+		}
+
+		start = getWallMicroseconds();
+		for (int i = 0; i < frames; i++) {
+			converter.convert(slideData[0], sourceStride[0], width, height, ColorConverter::PixelOrder::RGBA, data, stride);
+		}
+		double fullFrame = (getWallMicroseconds() - start) / 1000.0 / frames;
+
+		// one changed line of text
+		start = getWallMicroseconds();
+		for (int i = 0; i < frames; i++) {
+			converter.convertRect(slideData[0], sourceStride[0], width, height, ColorConverter::PixelOrder::RGBA, data, stride, width / 8, height / 4, width * 3 / 4, height / 14);
+		}
+		double textLine = (getWallMicroseconds() - start) / 1000.0 / frames;
+
+		std::printf("%-8s full frame %7.3f, one line of text %7.3f\n", ColorConverter::getKernelName(kernel), fullFrame, textLine);
+	}
+
+	sws_freeContext(swsContext);
+	return 0;
+}
@@ -0,0 +1,245 @@
+// Compares the video encoders the stream can use on slides like the projector shows them: CPU time and size of
+// the frame that is encoded when the slide changes and of the keyframes the stream repeats while it doesn't.
+// Usage: EncoderBenchmark [font file] [width] [height] [bitrate kbit/s] [speed]
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <sys/resource.h>
+#endif
+
+extern "C"
+{
+#include "libavcodec/avcodec.h"
+#include "libavutil/frame.h"
+#include "libswscale/swscale.h"
+}
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#include "Poco/Logger.h"
+#include "Poco/ConsoleChannel.h"
+#include "Poco/AutoPtr.h"
+#include "Poco/StringTokenizer.h"
+#include "VideoEncoder.h"
+
+using Poco::Logger;
+
+// public domain hymns, two to four lines like a typical slide
+static const char* slides[] = {
+	"Amazing grace, how sweet the sound\nThat saved a wretch like me",
+	"I once was lost, but now am found\nWas blind, but now I see",
+	"Holy, holy, holy! Lord God Almighty!\nEarly in the morning our song shall rise to Thee",
+	"Holy, holy, holy! Merciful and mighty!\nGod in three Persons, blessed Trinity!",
+	"Be Thou my vision, O Lord of my heart\nNaught be all else to me, save that Thou art",
+	"Thou my best thought, by day or by night\nWaking or sleeping, Thy presence my light",
+	"A mighty fortress is our God\nA bulwark never failing\nOur helper He amid the flood\nOf mortal ills prevailing",
+	"Praise God, from whom all blessings flow\nPraise Him, all creatures here below"
+};
+static const int numberOfSlides = sizeof(slides) / sizeof(slides[0]);
+
+struct Measurement {
+	int frames = 0;
+	int64_t cpuMicroseconds = 0;
+	int64_t wallMicroseconds = 0;
+	size_t bytes = 0;
+};
+
+// CPU time of the whole process, the encoders can use more than one thread
+int64_t getCpuMicroseconds() {
+#ifdef _WIN32
+	FILETIME creationTime, exitTime, kernelTime, userTime;
+	GetProcessTimes(GetCurrentProcess(), &creationTime, &exitTime, &kernelTime, &userTime);
+	ULARGE_INTEGER kernel, user;
+	kernel.LowPart = kernelTime.dwLowDateTime;
+	kernel.HighPart = kernelTime.dwHighDateTime;
+	user.LowPart = userTime.dwLowDateTime;
+	user.HighPart = userTime.dwHighDateTime;
+	// 100 ns units
+	return (int64_t) ((kernel.QuadPart + user.QuadPart) / 10);
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return (int64_t) (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+#endif
+}
+
+int64_t getWallMicroseconds() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// white text centered on black, RGBA top down
+void drawSlide(FT_Face face, const std::string& text, int width, int height, std::vector<uint8_t>& rgba) {
+	rgba.assign((size_t) width * height * 4, 0);
+	for (size_t i = 3; i < rgba.size(); i += 4) {
+		rgba[i] = 255;
+	}
+
+	Poco::StringTokenizer lines(text, "\n");
+	int lineHeight = (int) (face->size->metrics.height >> 6);
+	int ascender = (int) (face->size->metrics.ascender >> 6);
+	int baseline = (height - lineHeight * (int) lines.count()) / 2 + ascender;
+
+	for (const std::string& line : lines) {
+		int lineWidth = 0;
+		for (unsigned char character : line) {
+			if (FT_Load_Char(face, character, FT_LOAD_DEFAULT) == 0) {
+				lineWidth += (int) (face->glyph->advance.x >> 6);
+			}
+		}
+
+		int penX = (width - lineWidth) / 2;
+		for (unsigned char character : line) {
+			if (FT_Load_Char(face, character, FT_LOAD_RENDER) != 0) {
+				continue;
+			}
+			FT_GlyphSlot glyph = face->glyph;
+			for (unsigned int row = 0; row < glyph->bitmap.rows; row++) {
+				int y = baseline - glyph->bitmap_top + (int) row;
+				for (unsigned int column = 0; column < glyph->bitmap.width; column++) {
+					int x = penX + glyph->bitmap_left + (int) column;
+					if (x < 0 || y < 0 || x >= width || y >= height) {
+						continue;
+					}
+					uint8_t coverage = glyph->bitmap.buffer[row * glyph->bitmap.pitch + column];
+					uint8_t* pixel = &rgba[((size_t) y * width + x) * 4];
+					pixel[0] = std::max(pixel[0], coverage);
+					pixel[1] = std::max(pixel[1], coverage);
+					pixel[2] = std::max(pixel[2], coverage);
+				}
+			}
+			penX += (int) (glyph->advance.x >> 6);
+		}
+		baseline += lineHeight;
+	}
+}
+
+// < 0 on error
+int encodeFrame(AVCodecContext* context, AVFrame* frame, AVPacket* packet, Measurement& measurement) {
+	int64_t cpuStart = getCpuMicroseconds();
+	int64_t wallStart = getWallMicroseconds();
+
+	int ret = avcodec_send_frame(context, frame);
+	if (ret < 0) {
+		return ret;
+	}
+	while ((ret = avcodec_receive_packet(context, packet)) >= 0) {
+		measurement.bytes += packet->size;
+		av_packet_unref(packet);
+	}
+	if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+		return ret;
+	}
+
+	measurement.cpuMicroseconds += getCpuMicroseconds() - cpuStart;
+	measurement.wallMicroseconds += getWallMicroseconds() - wallStart;
+	measurement.frames++;
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	std::string fontPath = argc > 1 ? argv[1] : "fonts/Roboto.ttf";
+	int width = argc > 2 ? std::atoi(argv[2]) : 1920;
+	int height = argc > 3 ? std::atoi(argv[3]) : 1080;
+	StreamProfile profile;
+	profile.bitrateKbps = argc > 4 ? std::atoi(argv[4]) : profile.bitrateKbps;
+	profile.speed = argc > 5 ? std::atoi(argv[5]) : profile.speed;
+	width &= ~1;
+	height &= ~1;
+
+	std::string error;
+	if (width <= 0 || height <= 0 || !validateStreamProfile(profile, error)) {
+		std::fprintf(stderr, "Invalid arguments %s\nUsage: EncoderBenchmark [font file] [width] [height] [bitrate kbit/s] [speed]\n", error.c_str());
+		return 1;
+	}
+
+	Poco::AutoPtr<Poco::ConsoleChannel> consoleChannel(new Poco::ConsoleChannel);
+	Logger& logger = Logger::create("EncoderBenchmark", consoleChannel, Poco::Message::PRIO_WARNING);
+
+	FT_Library freeTypeLibrary;
+	FT_Face face;
+	if (FT_Init_FreeType(&freeTypeLibrary) != 0 || FT_New_Face(freeTypeLibrary, fontPath.c_str(), 0, &face) != 0) {
+		std::fprintf(stderr, "Could not load the font %s\n", fontPath.c_str());
+		return 1;
+	}
+	FT_Set_Pixel_Sizes(face, 0, height / 14);
+
+	// the slides are converted up front, only the encoders are measured
+	SwsContext* swsContext = sws_getContext(width, height, AV_PIX_FMT_RGBA, width, height, AV_PIX_FMT_YUV420P, SWS_POINT, nullptr, nullptr, nullptr);
+	std::vector<AVFrame*> frames;
+	std::vector<uint8_t> rgba;
+	for (int i = 0; i < numberOfSlides; i++) {
+		drawSlide(face, slides[i], width, height, rgba);
+		AVFrame* frame = av_frame_alloc();
+		frame->width = width;
+		frame->height = height;
+		frame->format = AV_PIX_FMT_YUV420P;
+		av_frame_get_buffer(frame, 0);
+		const uint8_t* source[1] = { rgba.data() };
+		int sourceLinesize[1] = { width * 4 };
+		sws_scale(swsContext, source, sourceLinesize, 0, height, frame->data, frame->linesize);
+		frames.push_back(frame);
+	}
+	sws_freeContext(swsContext);
+	FT_Done_Face(face);
+	FT_Done_FreeType(freeTypeLibrary);
+
+	std::printf("%dx%d, %d kbit/s, speed %d, %d slides shown 3 times\n\n", width, height, profile.bitrateKbps, profile.speed, numberOfSlides);
+	std::printf("%-6s %-12s | %-30s | %-30s\n", "codec", "encoder", "slide change", "repeated keyframe");
+	std::printf("%-6s %-12s | %9s %9s %10s | %9s %9s %10s\n", "", "", "cpu ms", "wall ms", "bytes", "cpu ms", "wall ms", "bytes");
+
+	AVPacket* packet = av_packet_alloc();
+	for (VideoCodec codec : { VideoCodec::VP8, VideoCodec::VP9, VideoCodec::H264, VideoCodec::AV1 }) {
+		VideoEncoder encoder(&logger);
+		if (!VideoEncoder::isAvailable(codec) || encoder.open(codec, profile, width, height, false) < 0) {
+			std::printf("%-6s not available\n", VideoEncoder::getCodecName(codec).c_str());
+			continue;
+		}
+
+		// like the stream: a new slide every few seconds, while it is shown only the keyframes are repeated
+		Measurement changes;
+		Measurement keyframes;
+		int64_t pts = 0;
+		bool failed = false;
+		for (int round = 0; round < 3 && !failed; round++) {
+			for (AVFrame* frame : frames) {
+				frame->pts = pts;
+				frame->pict_type = AV_PICTURE_TYPE_NONE;
+				failed = encodeFrame(encoder.getContext(), frame, packet, changes) < 0;
+
+				pts += (int64_t) profile.keyframeIntervalS * profile.fps;
+				frame->pts = pts;
+				frame->pict_type = AV_PICTURE_TYPE_I;
+				failed = failed || encodeFrame(encoder.getContext(), frame, packet, keyframes) < 0;
+				pts += (int64_t) profile.keyframeIntervalS * profile.fps;
+				if (failed) {
+					break;
+				}
+			}
+		}
+
+		if (failed || changes.frames == 0 || keyframes.frames == 0) {
+			std::printf("%-6s %-12s failed\n", VideoEncoder::getCodecName(codec).c_str(), encoder.getEncoderName().c_str());
+			continue;
+		}
+		std::printf("%-6s %-12s | %9.2f %9.2f %10zu | %9.2f %9.2f %10zu\n", VideoEncoder::getCodecName(codec).c_str(), encoder.getEncoderName().c_str(),
+			changes.cpuMicroseconds / 1000.0 / changes.frames, changes.wallMicroseconds / 1000.0 / changes.frames, changes.bytes / changes.frames,
+			keyframes.cpuMicroseconds / 1000.0 / keyframes.frames, keyframes.wallMicroseconds / 1000.0 / keyframes.frames, keyframes.bytes / keyframes.frames);
+	}
+
+	av_packet_free(&packet);
+	for (AVFrame*& frame : frames) {
+		av_frame_free(&frame);
+	}
+	return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+#include <cstdio>
+
+// The checks run by ctest: a failed CHECK prints where it failed and the test ends with exit code 1.
+// Unlike assert() they also run in Release builds.
+static int checkFailures = 0;
+
+#define CHECK(condition) \
+	do { \
+		if (!(condition)) { \
+			std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+			checkFailures++; \
+		} \
+	} while (false)
+
+#define CHECK_RESULT() (checkFailures == 0 ? 0 : 1)
@@ -0,0 +1,124 @@
+// Every kernel of the ColorConverter has to give the bytes of the scalar one, the scalar one has to stay
+// within 2 of BT.601 limited range and convertRect may only touch its rectangle.
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "ColorConverter.h"
+#include "Check.h"
+
+struct I420Frame {
+	std::vector<uint8_t> planes[3];
+	uint8_t* data[3];
+	int stride[3];
+
+	I420Frame(int width, int height, uint8_t fill) {
+		planes[0].assign((size_t) width * height, fill);
+		planes[1].assign((size_t) width * height / 4, fill);
+		planes[2].assign((size_t) width * height / 4, fill);
+		for (int i = 0; i < 3; i++) {
+			data[i] = planes[i].data();
+			stride[i] = i == 0 ? width : width / 2;
+		}
+	}
+};
+
+static int clampToByte(double value) {
+	return (int) std::lround(std::min(255.0, std::max(0.0, value)));
+}
+
+// the pixels are bottom up (like glReadPixels gives them) and converted with a negative stride, as the stream does
+static void checkAgainstReference(const std::vector<uint8_t>& rgba, int width, int height, ColorConverter::PixelOrder order, const I420Frame& frame) {
+	int red = order == ColorConverter::PixelOrder::BGRA ? 2 : 0;
+	int blue = order == ColorConverter::PixelOrder::BGRA ? 0 : 2;
+	int largestDifference[3] = { 0, 0, 0 };
+	for (int y = 0; y < height; y += 2) {
+		for (int x = 0; x < width; x += 2) {
+			double r = 0, g = 0, b = 0;
+			for (int i = 0; i < 4; i++) {
+				int row = y + i / 2;
+				int column = x + i % 2;
+				const uint8_t* pixel = &rgba[((size_t) (height - 1 - row) * width + column) * 4];
+				int luma = clampToByte(16 + (65.481 * pixel[red] + 128.553 * pixel[1] + 24.966 * pixel[blue]) / 255);
+				largestDifference[0] = std::max(largestDifference[0], std::abs(luma - frame.planes[0][(size_t) row * width + column]));
+				r += pixel[red] / 4.0;
+				g += pixel[1] / 4.0;
+				b += pixel[blue] / 4.0;
+			}
+			size_t chroma = (size_t) (y / 2) * (width / 2) + x / 2;
+			int u = clampToByte(128 + (-37.797 * r - 74.203 * g + 112.0 * b) / 255);
+			int v = clampToByte(128 + (112.0 * r - 93.786 * g - 18.214 * b) / 255);
+			largestDifference[1] = std::max(largestDifference[1], std::abs(u - frame.planes[1][chroma]));
+			largestDifference[2] = std::max(largestDifference[2], std::abs(v - frame.planes[2][chroma]));
+		}
+	}
+	CHECK(largestDifference[0] <= 2);
+	CHECK(largestDifference[1] <= 2);
+	CHECK(largestDifference[2] <= 2);
+}
+
+static void testSize(int width, int height, std::mt19937& random) {
+	std::vector<uint8_t> rgba((size_t) width * height * 4);
+	for (uint8_t& channel : rgba) {
+		channel = (uint8_t) random();
+	}
+	const uint8_t* bottomUp = rgba.data() + (size_t) (height - 1) * width * 4;
+	int sourceStride = -width * 4;
+
+	const ColorConverter::Kernel kernels[] = { ColorConverter::Kernel::SSE2, ColorConverter::Kernel::AVX2 };
+	for (ColorConverter::PixelOrder order : { ColorConverter::PixelOrder::RGBA, ColorConverter::PixelOrder::BGRA }) {
+		ColorConverter converter;
+		CHECK(converter.setKernel(ColorConverter::Kernel::Scalar));
+		I420Frame scalarFrame(width, height, 0);
+		converter.convert(bottomUp, sourceStride, width, height, order, scalarFrame.data, scalarFrame.stride);
+		checkAgainstReference(rgba, width, height, order, scalarFrame);
+
+		for (ColorConverter::Kernel kernel : kernels) {
+			if (!converter.setKernel(kernel)) {
+				// not supported by the CPU
+				continue;
+			}
+			I420Frame kernelFrame(width, height, 0);
+			converter.convert(bottomUp, sourceStride, width, height, order, kernelFrame.data, kernelFrame.stride);
+			for (int i = 0; i < 3; i++) {
+				CHECK(kernelFrame.planes[i] == scalarFrame.planes[i]);
+			}
+
+			// odd coordinates are rounded out to the 2x2 blocks around them
+			int x = 5;
+			int y = 3;
+			int rectWidth = width / 2 + 1;
+			int rectHeight = height / 2;
+			I420Frame rectFrame(width, height, 7);
+			converter.convertRect(bottomUp, sourceStride, width, height, order, rectFrame.data, rectFrame.stride, x, y, rectWidth, rectHeight);
+			for (int i = 0; i < 3; i++) {
+				int shift = i == 0 ? 0 : 1;
+				int planeWidth = width >> shift;
+				int left = (x & ~1) >> shift;
+				int top = (y & ~1) >> shift;
+				int right = ((x + rectWidth + 1) & ~1) >> shift;
+				int bottom = ((y + rectHeight + 1) & ~1) >> shift;
+				bool matches = true;
+				for (size_t j = 0; j < rectFrame.planes[i].size(); j++) {
+					int column = (int) (j % planeWidth);
+					int row = (int) (j / planeWidth);
+					bool isInside = column >= left && column < right && row >= top && row < bottom;
+					matches = matches && rectFrame.planes[i][j] == (isInside ? scalarFrame.planes[i][j] : 7);
+				}
+				CHECK(matches);
+			}
+		}
+	}
+}
+
+int main() {
+	std::mt19937 random(42);
+	// the widths leave tails for the 8 and 16 pixel loops of the kernels
+	testSize(2, 2, random);
+	testSize(46, 10, random);
+	testSize(640, 360, random);
+	testSize(1926, 34, random);
+	return CHECK_RESULT();
+}
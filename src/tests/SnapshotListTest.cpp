@@ -0,0 +1,92 @@
+// Sender threads iterate snapshots of a SnapshotList while signaling threads let receivers join and leave,
+// like the receivers of the stream. Every receiver a sender sees has to be alive and every join has to be undone.
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "SnapshotList.h"
+#include "Check.h"
+
+static const uint32_t aliveMagic = 0x5EC0DE42;
+
+struct FakeReceiver {
+	std::atomic<uint32_t> magic{ aliveMagic };
+	std::atomic<bool> isConnected{ true };
+	std::atomic<uint64_t> packets{ 0 };
+
+	~FakeReceiver() {
+		magic = 0;
+	}
+};
+
+int main() {
+	const int steadyReceivers = 8;
+	const int joinsPerThread = 250;
+	const int numberOfSenders = 2;
+	const int numberOfSignalingThreads = 4;
+
+	SnapshotList<FakeReceiver> receivers;
+	std::vector<std::shared_ptr<FakeReceiver>> steady;
+	for (int i = 0; i < steadyReceivers; i++) {
+		steady.push_back(std::make_shared<FakeReceiver>());
+		receivers.add(steady.back());
+	}
+
+	std::atomic<bool> running{ true };
+	std::atomic<uint64_t> deadReceivers{ 0 };
+	std::atomic<int> failedRemoves{ 0 };
+
+	std::vector<std::thread> senders;
+	for (int i = 0; i < numberOfSenders; i++) {
+		senders.emplace_back([&]() {
+			// what handle_write does with every packet
+			SnapshotList<FakeReceiver>::Reader reader(receivers);
+			while (running) {
+				for (const std::shared_ptr<FakeReceiver>& receiver : reader.get()) {
+					if (receiver->magic.load(std::memory_order_relaxed) != aliveMagic) {
+						deadReceivers++;
+					}
+					if (receiver->isConnected) {
+						receiver->packets.fetch_add(1, std::memory_order_relaxed);
+					}
+				}
+			}
+		});
+	}
+
+	std::vector<std::thread> signaling;
+	for (int i = 0; i < numberOfSignalingThreads; i++) {
+		signaling.emplace_back([&, i]() {
+			std::mt19937 random(i);
+			for (int join = 0; join < joinsPerThread; join++) {
+				std::shared_ptr<FakeReceiver> receiver = std::make_shared<FakeReceiver>();
+				receivers.add(receiver);
+				std::this_thread::sleep_for(std::chrono::microseconds(random() % 200));
+				// like onStateChange: disconnected first, then removed from a libdatachannel thread
+				receiver->isConnected = false;
+				if (!receivers.remove(receiver)) {
+					failedRemoves++;
+				}
+			}
+		});
+	}
+	for (std::thread& thread : signaling) {
+		thread.join();
+	}
+	running = false;
+	for (std::thread& thread : senders) {
+		thread.join();
+	}
+
+	CHECK(deadReceivers == 0);
+	CHECK(failedRemoves == 0);
+	CHECK(receivers.get()->size() == steady.size());
+	for (const std::shared_ptr<FakeReceiver>& receiver : steady) {
+		CHECK(receiver->packets > 0);
+	}
+	return CHECK_RESULT();
+}